@@ -0,0 +1,359 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <leveldb/db.h>
+#include <leveldb/env.h>
+#include <leveldb/write_batch.h>
+
+#include "storage.h"
+
+/* Measures storage value throughput. The "json" rows write values as the
+   original json text and the "binary" rows in the binary encoding, both
+   through Storage with each storage engine. The "key" rows compare text
+   and binary table keys with identical values.
+
+   Given the path of a copy of a block database, measures its size and
+   lookup speed, migrates it to the current format and measures it again. */
+
+static const unsigned int nValues = 20000;
+static const unsigned int commitEvery = 100;
+
+static std::string randomHex(std::mt19937_64& rng) {
+    static const char digits[] = "0123456789abcdef";
+    std::string returning;
+    for(unsigned int i = 0; i < 64; i++) {
+        returning.push_back(digits[rng() % 16]);
+    }
+
+    // Ids are written without leading zeros, like BigNum::toString()
+    return returning.substr(std::min(returning.find_first_not_of('0'), returning.size() - 1));
+}
+
+static Json::Value makeOutput(std::mt19937_64& rng) {
+    Json::Value returning;
+    returning["value"] = Json::Value::UInt64(rng() % 10000000000ULL);
+    returning["nonce"] = Json::Value::UInt64(rng() % 4294967296ULL);
+    returning["data"]["publicKey"] = "BGOjpbmxzX26d7zHmNxy3RWb94MzTciGhF7y8ehF2EH2BlTDStCrAhSmmfmbaWDuRYqagRViAhVj6QhOsfp4oT4=";
+    returning["creationTx"] = randomHex(rng);
+    returning["id"] = randomHex(rng);
+    return returning;
+}
+
+static Json::Value makeBlock(std::mt19937_64& rng) {
+    Json::Value returning;
+    for(unsigned int i = 0; i < 50; i++) {
+        returning["transactions"].append(randomHex(rng));
+    }
+    returning["coinbaseTx"] = randomHex(rng);
+    returning["previousBlockId"] = randomHex(rng);
+    returning["timestamp"] = Json::Value::UInt64(1500000000 + rng() % 100000000);
+    returning["consensusData"]["nonce"] = Json::Value::UInt64(rng());
+    returning["consensusData"]["target"] = randomHex(rng);
+    returning["consensusData"]["totalWork"] = randomHex(rng);
+    returning["height"] = Json::Value::UInt64(rng() % 1000000);
+    returning["transactionMerkleRoot"] = randomHex(rng);
+    returning["id"] = randomHex(rng);
+    return returning;
+}
+
+class Timer {
+public:
+    Timer() : start(std::chrono::steady_clock::now()) {}
+
+    double seconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+static void report(const std::string& name, const unsigned int ops, const double seconds) {
+    std::cout << std::left << std::setw(40) << name
+              << std::right << std::setw(14) << std::fixed << std::setprecision(0)
+              << ops / seconds << " ops/s" << std::endl;
+}
+
+static uint64_t directorySize(const std::string& dir) {
+    leveldb::Env* env = leveldb::Env::Default();
+    std::vector<std::string> files;
+    env->GetChildren(dir, &files);
+
+    uint64_t returning = 0;
+    for(const auto& file : files) {
+        uint64_t size = 0;
+        if(env->GetFileSize(dir + "/" + file, &size).ok()) {
+            returning += size;
+        }
+    }
+
+    return returning;
+}
+
+static leveldb::DB* openRaw(const std::string& dir) {
+    leveldb::DB* db;
+    leveldb::Options options;
+    options.create_if_missing = true;
+    if(!leveldb::DB::Open(options, dir, &db).ok()) {
+        throw std::runtime_error("Failed to open benchmark database " + dir);
+    }
+
+    return db;
+}
+
+static void benchCodec(const std::string& name, const std::vector<Json::Value>& values) {
+    std::vector<std::string> text;
+    std::vector<std::string> binary;
+    size_t textBytes = 0;
+    size_t binaryBytes = 0;
+
+    Timer textEncode;
+    for(const auto& value : values) {
+        text.push_back(CryptoKernel::Storage::toString(value));
+    }
+    report(name + " json encode", values.size(), textEncode.seconds());
+
+    Timer binaryEncode;
+    for(const auto& value : values) {
+        binary.push_back(CryptoKernel::Storage::toBinary(value));
+    }
+    report(name + " binary encode", values.size(), binaryEncode.seconds());
+
+    Timer textDecode;
+    for(const auto& value : text) {
+        textBytes += value.size();
+        CryptoKernel::Storage::toJson(value);
+    }
+    report(name + " json decode", values.size(), textDecode.seconds());
+
+    Timer binaryDecode;
+    for(const auto& value : binary) {
+        binaryBytes += value.size();
+        CryptoKernel::Storage::fromBinary(value);
+    }
+    report(name + " binary decode", values.size(), binaryDecode.seconds());
+
+    std::cout << name << " average size: json " << textBytes / values.size()
+              << " bytes, binary " << binaryBytes / values.size() << " bytes" << std::endl;
+}
+
+static void benchStorage(const std::string& encoding, const std::string& engine,
+                         const std::string& durability,
+                         const std::vector<std::string>& keys,
+                         const std::vector<Json::Value>& values) {
+    const std::string filename = "./benchdb-" + engine;
+    const std::string name = encoding + " " + engine + " " + durability;
+    CryptoKernel::Storage::destroy(filename);
+
+    Json::Value options;
+    options["engine"] = engine;
+    options["durability"] = durability;
+    options["valueEncoding"] = encoding;
+    // Without the value cache every get decodes the stored value
+    options["cacheSize"] = 0;
+
+    {
+        CryptoKernel::Storage database(filename, options);
+        CryptoKernel::Storage::Table utxos("utxos");
+
+        Timer put;
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+        for(unsigned int i = 0; i < keys.size(); i++) {
+            utxos.put(dbTx.get(), keys[i], values[i]);
+            if((i + 1) % commitEvery == 0) {
+                dbTx->commit();
+                dbTx.reset(database.begin());
+            }
+        }
+        dbTx->abort();
+        database.flush();
+        report(name + " put+commit", keys.size(), put.seconds());
+
+        Timer get;
+        dbTx.reset(database.begin());
+        for(const auto& key : keys) {
+            utxos.get(dbTx.get(), key);
+        }
+        report(name + " get", keys.size(), get.seconds());
+
+        const Json::Value latency = database.getStats()["commitLatency"];
+        std::cout << name << " commit latency: p50 " << latency["p50"].asUInt64()
+                  << " us, p99 " << latency["p99"].asUInt64() << " us, max "
+                  << latency["max"].asUInt64() << " us" << std::endl;
+    }
+
+    CryptoKernel::Storage::destroy(filename);
+}
+
+/* Fills one database with text table keys and one with binary table keys,
+   then compares their size and random lookup speed */
+static void benchKeys(const std::vector<std::string>& keys,
+                      const std::vector<Json::Value>& values) {
+    CryptoKernel::Storage::Table utxos("utxos");
+
+    uint64_t textKeyBytes = 0;
+    uint64_t binaryKeyBytes = 0;
+    std::vector<std::string> textKeys;
+    std::vector<std::string> binaryKeys;
+    for(const auto& key : keys) {
+        textKeys.push_back("utxos/0/" + key);
+        binaryKeys.push_back(utxos.getKey(key));
+        textKeyBytes += textKeys.back().size();
+        binaryKeyBytes += binaryKeys.back().size();
+    }
+
+    std::cout << "key average size: text " << textKeyBytes / keys.size()
+              << " bytes, binary " << binaryKeyBytes / keys.size() << " bytes" << std::endl;
+
+    std::mt19937_64 rng(7);
+    std::vector<unsigned int> order(keys.size());
+    for(unsigned int i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+
+    for(const auto& format : {std::make_pair(std::string("text"), &textKeys),
+                              std::make_pair(std::string("binary"), &binaryKeys)
+                             }) {
+        const std::string dir = "./benchdb-keys-" + format.first;
+        CryptoKernel::Storage::destroy(dir);
+
+        leveldb::DB* db = openRaw(dir);
+        leveldb::WriteBatch batch;
+        for(unsigned int i = 0; i < keys.size(); i++) {
+            batch.Put((*format.second)[i], CryptoKernel::Storage::toBinary(values[i]));
+        }
+        db->Write(leveldb::WriteOptions(), &batch);
+        db->CompactRange(nullptr, nullptr);
+
+        Timer get;
+        for(const unsigned int i : order) {
+            std::string data;
+            db->Get(leveldb::ReadOptions(), (*format.second)[i], &data);
+        }
+        report(format.first + " key get", keys.size(), get.seconds());
+
+        delete db;
+        std::cout << format.first << " key database size: " << directorySize(dir)
+                  << " bytes" << std::endl;
+        CryptoKernel::Storage::destroy(dir);
+    }
+}
+
+static void measureChain(const std::string& dir, const std::vector<std::string>& sample,
+                         const std::string& label) {
+    leveldb::DB* db = openRaw(dir);
+    db->CompactRange(nullptr, nullptr);
+
+    uint64_t nKeys = 0;
+    uint64_t keyBytes = 0;
+    uint64_t valueBytes = 0;
+    std::unique_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        nKeys++;
+        keyBytes += it->key().size();
+        valueBytes += it->value().size();
+    }
+    it.reset();
+
+    Timer get;
+    for(const auto& key : sample) {
+        std::string data;
+        db->Get(leveldb::ReadOptions(), key, &data);
+    }
+    const double seconds = get.seconds();
+    delete db;
+
+    std::cout << label << ": " << nKeys << " keys, " << keyBytes << " key bytes, "
+              << valueBytes << " value bytes, " << directorySize(dir)
+              << " bytes on disk" << std::endl;
+    report(label + " random get", sample.size(), seconds);
+}
+
+/* Measures a copy of a real block database before and after it is migrated
+   to binary keys. The given directory is modified. */
+static void benchChain(const std::string& dir) {
+    std::vector<std::string> keys;
+    {
+        leveldb::DB* db = openRaw(dir);
+        std::unique_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
+        for(it->SeekToFirst(); it->Valid(); it->Next()) {
+            keys.push_back(it->key().ToString());
+        }
+        it.reset();
+        delete db;
+    }
+
+    std::mt19937_64 rng(42);
+    std::shuffle(keys.begin(), keys.end(), rng);
+    keys.resize(std::min<size_t>(keys.size(), nValues));
+
+    measureChain(dir, keys, "before");
+
+    {
+        CryptoKernel::Storage database(dir);
+    }
+
+    for(auto& key : keys) {
+        const std::string newKey = CryptoKernel::Storage::fromLegacyKey(key);
+        if(!newKey.empty()) {
+            key = newKey;
+        }
+    }
+
+    measureChain(dir, keys, "after");
+}
+
+int main(int argc, char* argv[]) {
+    if(argc > 1) {
+        benchChain(argv[1]);
+        return 0;
+    }
+
+    std::mt19937_64 rng(42);
+
+    std::vector<Json::Value> outputs;
+    std::vector<Json::Value> blocks;
+    std::vector<std::string> keys;
+    for(unsigned int i = 0; i < nValues; i++) {
+        outputs.push_back(makeOutput(rng));
+        keys.push_back(randomHex(rng));
+        if(i % 10 == 0) {
+            blocks.push_back(makeBlock(rng));
+        }
+    }
+
+    benchCodec("output", outputs);
+    benchCodec("block", blocks);
+    benchKeys(keys, outputs);
+    for(const std::string encoding : {"json", "binary"}) {
+        benchStorage(encoding, "leveldb", "sync", keys, outputs);
+        benchStorage(encoding, "leveldb", "group", keys, outputs);
+        benchStorage(encoding, "leveldb", "none", keys, outputs);
+        benchStorage(encoding, "memory", "sync", keys, outputs);
+    }
+
+    return 0;
+}
@@ -203,6 +203,69 @@ public:
         else
         { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
     }
+    Json::Value storagestats() throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p = Json::nullValue;
+        Json::Value result = this->CallMethod("storagestats",p);
+        if (result.isObject())
+        { return result; }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
+    Json::Value checkpoint(const std::string& directory) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["directory"] = directory;
+        Json::Value result = this->CallMethod("checkpoint",p);
+        if (result.isObject())
+        { return result; }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
+    Json::Value checkpointstatus() throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p = Json::nullValue;
+        Json::Value result = this->CallMethod("checkpointstatus",p);
+        if (result.isObject())
+        { return result; }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
+    Json::Value compact(const Json::Value& tables) throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p["tables"] = tables;
+        Json::Value result = this->CallMethod("compact",p);
+        if (result.isObject())
+        { return result; }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
+    Json::Value compactionstatus() throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p = Json::nullValue;
+        Json::Value result = this->CallMethod("compactionstatus",p);
+        if (result.isObject())
+        { return result; }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
+    Json::Value projectedblock() throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p = Json::nullValue;
+        Json::Value result = this->CallMethod("projectedblock",p);
+        if (result.isObject())
+        { return result; }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
+    Json::Value mempoolstats() throw (jsonrpc::JsonRpcException) {
+        Json::Value p;
+        p = Json::nullValue;
+        Json::Value result = this->CallMethod("mempoolstats",p);
+        if (result.isObject())
+        { return result; }
+        else
+        { throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, result.toStyledString()); }
+    }
 };
 
 #endif //JSONRPC_CPP_STUB_CRYPTOCLIENT_H_
@@ -82,6 +82,22 @@ public:
         this->bindAndAddMethod(jsonrpc::Procedure("getoutputsetid", jsonrpc::PARAMS_BY_NAME,
                                jsonrpc::JSON_STRING, "outputs", jsonrpc::JSON_ARRAY,
                                NULL), &CryptoRPCServer::getoutputsetidI);
+        this->bindAndAddMethod(jsonrpc::Procedure("storagestats", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, NULL), &CryptoRPCServer::storagestatsI);
+        this->bindAndAddMethod(jsonrpc::Procedure("checkpoint", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, "directory", jsonrpc::JSON_STRING, NULL),
+                               &CryptoRPCServer::checkpointI);
+        this->bindAndAddMethod(jsonrpc::Procedure("checkpointstatus", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, NULL), &CryptoRPCServer::checkpointstatusI);
+        this->bindAndAddMethod(jsonrpc::Procedure("compact", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, "tables", jsonrpc::JSON_ARRAY, NULL),
+                               &CryptoRPCServer::compactI);
+        this->bindAndAddMethod(jsonrpc::Procedure("compactionstatus", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, NULL), &CryptoRPCServer::compactionstatusI);
+        this->bindAndAddMethod(jsonrpc::Procedure("projectedblock", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, NULL), &CryptoRPCServer::projectedblockI);
+        this->bindAndAddMethod(jsonrpc::Procedure("mempoolstats", jsonrpc::PARAMS_BY_NAME,
+                               jsonrpc::JSON_OBJECT, NULL), &CryptoRPCServer::mempoolstatsI);
     }
 
     inline virtual void getinfoI(const Json::Value &request, Json::Value &response) {
@@ -149,6 +165,27 @@ public:
     inline virtual void getoutputsetidI(const Json::Value &request, Json::Value &response) {
         response = this->getoutputsetid(request["outputs"]);
     }
+    inline virtual void storagestatsI(const Json::Value &request, Json::Value &response) {
+        response = this->storagestats();
+    }
+    inline virtual void checkpointI(const Json::Value &request, Json::Value &response) {
+        response = this->checkpoint(request["directory"].asString());
+    }
+    inline virtual void checkpointstatusI(const Json::Value &request, Json::Value &response) {
+        response = this->checkpointstatus();
+    }
+    inline virtual void compactI(const Json::Value &request, Json::Value &response) {
+        response = this->compact(request["tables"]);
+    }
+    inline virtual void compactionstatusI(const Json::Value &request, Json::Value &response) {
+        response = this->compactionstatus();
+    }
+    inline virtual void projectedblockI(const Json::Value &request, Json::Value &response) {
+        response = this->projectedblock();
+    }
+    inline virtual void mempoolstatsI(const Json::Value &request, Json::Value &response) {
+        response = this->mempoolstats();
+    }
     virtual Json::Value getinfo() = 0;
     virtual Json::Value account(const std::string& account, const std::string& password) = 0;
     virtual std::string sendtoaddress(const std::string& address, double amount,
@@ -171,6 +208,13 @@ public:
     virtual Json::Value getpeerinfo() = 0;
     virtual Json::Value dumpprivkeys(const std::string& account, const std::string& password) = 0;
     virtual std::string getoutputsetid(const Json::Value& outputs) = 0;
+    virtual Json::Value storagestats() = 0;
+    virtual Json::Value checkpoint(const std::string& directory) = 0;
+    virtual Json::Value checkpointstatus() = 0;
+    virtual Json::Value compact(const Json::Value& tables) = 0;
+    virtual Json::Value compactionstatus() = 0;
+    virtual Json::Value projectedblock() = 0;
+    virtual Json::Value mempoolstats() = 0;
 };
 
 class CryptoServer : public CryptoRPCServer {
@@ -201,6 +245,13 @@ public:
     virtual Json::Value getpeerinfo();
     virtual Json::Value dumpprivkeys(const std::string& account, const std::string& password);
     virtual std::string getoutputsetid(const Json::Value& outputs);
+    virtual Json::Value storagestats();
+    virtual Json::Value checkpoint(const std::string& directory);
+    virtual Json::Value checkpointstatus();
+    virtual Json::Value compact(const Json::Value& tables);
+    virtual Json::Value compactionstatus();
+    virtual Json::Value projectedblock();
+    virtual Json::Value mempoolstats();
 
 private:
     CryptoKernel::Wallet* wallet;
@@ -181,10 +181,45 @@ int main(int argc, char* argv[]) {
                 } else {
                     std::cout << "Usage: dumpprivkeys [accountname]" << std::endl;
                 }
+            } else if(command == "checkpoint") {
+                if(argc >= 3 + offset) {
+                    std::cout << client.checkpoint(argv[2 + offset]).toStyledString() << std::endl;
+                } else {
+                    std::cout << "Usage: checkpoint [directory]" << std::endl;
+                }
+            } else if(command == "checkpointstatus") {
+                std::cout << client.checkpointstatus().toStyledString() << std::endl;
+            } else if(command == "compact") {
+                Json::Value tables = Json::Value(Json::arrayValue);
+                for(int i = 2 + offset; i < argc; i++) {
+                    tables.append(argv[i]);
+                }
+                std::cout << client.compact(tables).toStyledString() << std::endl;
+            } else if(command == "compactionstatus") {
+                std::cout << client.compactionstatus().toStyledString() << std::endl;
+            } else if(command == "mempoolstats") {
+                std::cout << client.mempoolstats().toStyledString() << std::endl;
+            } else if(command == "projectedblock") {
+                std::cout << client.projectedblock().toStyledString() << std::endl;
+            } else if(command == "storagestats") {
+                const Json::Value stats = client.storagestats();
+                if(argc >= 3 + offset) {
+                    std::ofstream dump(argv[2 + offset]);
+                    dump << CryptoKernel::Storage::toString(stats);
+                    if(!dump) {
+                        std::cout << "Failed to write " << argv[2 + offset] << std::endl;
+                    }
+                } else {
+                    std::cout << stats.toStyledString() << std::endl;
+                }
             } else {
                 std::cout << "CryptoKernel - Blockchain Development Toolkit - v" << version << "\n\n"
                           << "[-p [port]]\n\n"
                           << "account [accountname]\n"
+                          << "checkpoint [directory]\n"
+                          << "checkpointstatus\n"
+                          << "compact [table ...]\n"
+                          << "compactionstatus\n"
                           << "compilecontract [code]\n"
                           << "dumpprivkeys [accountname]\n"
                           << "getblockbyheight [height]\n"
@@ -194,8 +229,11 @@ int main(int argc, char* argv[]) {
                           << "listaccounts\n"
                           << "listtransactions\n"
                           << "listunspentoutputs [accountname]\n"
+                          << "mempoolstats\n"
+                          << "projectedblock\n"
                           << "sendtoaddress [address] [amount]\n"
-                          << "stop\n";
+                          << "stop\n"
+                          << "storagestats [file]\n";
             }
         } catch(jsonrpc::JsonRpcException e) {
             std::cout << e.what() << std::endl;
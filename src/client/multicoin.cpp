@@ -28,6 +28,7 @@ CryptoKernel::MulticoinLoader::MulticoinLoader(const std::string& configFile,
 
         newCoin->blockchain.reset(new DynamicBlockchain(log,
                                                         coin["blockdb"].asString(),
+                                                        coin["storage"]["blockdb"],
                                                         coinbaseOwnerFunc,
                                                         subsidyFunc));
 
@@ -43,13 +44,15 @@ CryptoKernel::MulticoinLoader::MulticoinLoader(const std::string& configFile,
 
         newCoin->network.reset(new Network(log, newCoin->blockchain.get(),
                                            coin["port"].asUInt(),
-                                           coin["peerdb"].asString()));
+                                           coin["peerdb"].asString(),
+                                           coin["storage"]["peerdb"]));
 
         if(!coin["walletdb"].empty()) {
             newCoin->wallet.reset(new Wallet(newCoin->blockchain.get(),
                                             newCoin->network.get(),
                                             log,
-                                            coin["walletdb"].asString()));
+                                            coin["walletdb"].asString(),
+                                            coin["storage"]["walletdb"]));
         }
 
         newCoin->httpserver.reset(new jsonrpc::HttpServerLocal(coin["rpcport"].asUInt(),
@@ -115,9 +118,10 @@ std::unique_ptr<CryptoKernel::Consensus> CryptoKernel::MulticoinLoader::getConse
 CryptoKernel::MulticoinLoader::
 DynamicBlockchain::DynamicBlockchain(Log* GlobalLog,
                                      const std::string& dbDir,
+                                     const Json::Value& storageOptions,
                                      std::function<std::string(const std::string&)> getCoinbaseOwnerFunc,
                                      std::function<uint64_t(const uint64_t)> getBlockRewardFunc) :
-CryptoKernel::Blockchain(GlobalLog, dbDir) {
+CryptoKernel::Blockchain(GlobalLog, dbDir, storageOptions) {
     this->getCoinbaseOwnerFunc = getCoinbaseOwnerFunc;
     this->getBlockRewardFunc = getBlockRewardFunc;
 }
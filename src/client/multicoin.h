@@ -42,6 +42,7 @@ namespace CryptoKernel {
                 public:
                     DynamicBlockchain(Log* GlobalLog,
                                       const std::string& dbDir,
+                                      const Json::Value& storageOptions,
                                       std::function<std::string(const std::string&)> getCoinbaseOwnerFunc,
                                       std::function<uint64_t(const uint64_t)> getBlockRewardFunc);
 
@@ -58,6 +58,17 @@ Json::Value CryptoServer::getinfo() {
 
     returning["mempool"]["size"] = buffer.str();
 
+    const Json::Value mempoolStats = blockchain->getMempoolStats();
+    buffer.str("");
+    buffer << std::setprecision(3)
+           << (mempoolStats["memory"].asUInt64() / double(1024 * 1024))
+           << " / "
+           << (mempoolStats["maxMemory"].asUInt64() / double(1024 * 1024))
+           << " MB";
+
+    returning["mempool"]["memory"] = buffer.str();
+    returning["mempool"]["minFeeRate"] = mempoolStats["minFeeRate"];
+
     return returning;
 }
 
@@ -343,3 +354,50 @@ std::string CryptoServer::getoutputsetid(const Json::Value& outputs) {
     return CryptoKernel::MerkleNode::makeMerkleTree(outputIds)->getMerkleRoot()
            .toString();
 }
+
+Json::Value CryptoServer::storagestats() {
+    Json::Value returning;
+
+    returning["blockdb"] = blockchain->getStorageStats();
+    returning["peerdb"] = network->getStorageStats();
+    returning["walletdb"] = wallet->getStorageStats();
+
+    return returning;
+}
+
+Json::Value CryptoServer::checkpoint(const std::string& directory) {
+    try {
+        blockchain->startCheckpoint(directory);
+    } catch(const std::runtime_error& e) {
+        return Json::Value(e.what());
+    }
+
+    return blockchain->getCheckpointStatus();
+}
+
+Json::Value CryptoServer::checkpointstatus() {
+    return blockchain->getCheckpointStatus();
+}
+
+Json::Value CryptoServer::compact(const Json::Value& tables) {
+    std::vector<std::string> names;
+    for(const Json::Value& table : tables) {
+        names.push_back(table.asString());
+    }
+
+    blockchain->compactStorage(names);
+
+    return blockchain->getCompactionStatus();
+}
+
+Json::Value CryptoServer::compactionstatus() {
+    return blockchain->getCompactionStatus();
+}
+
+Json::Value CryptoServer::projectedblock() {
+    return blockchain->getProjectedBlock();
+}
+
+Json::Value CryptoServer::mempoolstats() {
+    return blockchain->getMempoolStats();
+}
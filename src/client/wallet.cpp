@@ -24,12 +24,13 @@
 CryptoKernel::Wallet::Wallet(CryptoKernel::Blockchain* blockchain,
                              CryptoKernel::Network* network,
                              CryptoKernel::Log* log,
-                             const std::string& dbDir) {
+                             const std::string& dbDir,
+                             const Json::Value& storageOptions) {
     this->blockchain = blockchain;
     this->network = network;
     this->log = log;
 
-    walletdb.reset(new CryptoKernel::Storage(dbDir));
+    walletdb.reset(new CryptoKernel::Storage(dbDir, storageOptions));
     accounts.reset(new CryptoKernel::Storage::Table("accounts"));
     utxos.reset(new CryptoKernel::Storage::Table("utxos"));
     transactions.reset(new CryptoKernel::Storage::Table("transactions"));
@@ -177,7 +178,7 @@ void CryptoKernel::Wallet::watchFunc() {
         */
         std::lock_guard<std::recursive_mutex> lock(walletLock);
         std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(walletdb->begin());
-        std::unique_ptr<CryptoKernel::Storage::Transaction> bchainTx(blockchain->getTxHandle());
+        std::unique_ptr<CryptoKernel::Storage::Transaction> bchainTx(blockchain->getReadTxHandle());
 
         bool rewind = false;
         do {
@@ -588,7 +589,7 @@ CryptoKernel::Wallet::Account CryptoKernel::Wallet::newAccount(const std::string
 std::string CryptoKernel::Wallet::sendToAddress(const std::string& pubKey,
         const uint64_t amount, const std::string& password) {
     std::lock_guard<std::recursive_mutex> lock(walletLock);
-    std::unique_ptr<CryptoKernel::Storage::Transaction> bchainTx(blockchain->getTxHandle());
+    std::unique_ptr<CryptoKernel::Storage::Transaction> bchainTx(blockchain->getReadTxHandle());
 
     if(!checkPassword(password)) {
         return "Incorrect wallet password";
@@ -710,6 +711,10 @@ std::string CryptoKernel::Wallet::sendToAddress(const std::string& pubKey,
     return tx.getId().toString();
 }
 
+Json::Value CryptoKernel::Wallet::getStorageStats() {
+    return walletdb->getStats();
+}
+
 uint64_t CryptoKernel::Wallet::getTotalBalance() {
     std::lock_guard<std::recursive_mutex> lock(walletLock);
     std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
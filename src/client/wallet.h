@@ -41,7 +41,8 @@ public:
     Wallet(CryptoKernel::Blockchain* blockchain,
            CryptoKernel::Network* network,
            CryptoKernel::Log* log,
-           const std::string& dbDir);
+           const std::string& dbDir,
+           const Json::Value& storageOptions = Json::Value());
 
     ~Wallet();
 
@@ -132,6 +133,13 @@ public:
     CryptoKernel::Blockchain::transaction signTransaction(const
             CryptoKernel::Blockchain::transaction& tx, const std::string& password);
 
+    /**
+    * Returns the statistics of the wallet database, see Storage::getStats
+    *
+    * @return a json object of storage statistics
+    */
+    Json::Value getStorageStats();
+
 private:
     std::unique_ptr<CryptoKernel::Storage> walletdb;
     std::unique_ptr<CryptoKernel::Storage::Table> accounts;
@@ -26,30 +26,120 @@
 #include <thread>
 
 #include "blockchain.h"
+#include "blockchaincoinscache.h"
+#include "blockchainmempool.h"
+#include "blockchainvalidationpool.h"
+#include "storagestats.h"
 #include "crypto.h"
 #include "ckmath.h"
 #include "contract.h"
 
+/* Number of blocks connected during initial sync between durable tip
+   markers, which bounds the blocks lost if the node crashes while syncing */
+static const uint64_t durableTipInterval = 1000;
+
+struct CryptoKernel::Blockchain::ReadStats {
+    Storage::Stats::Histogram idle;
+    Storage::Stats::Histogram connecting;
+};
+
+/* A read-only snapshot for the public accessors. Reads begin their
+   snapshot under the shared commit lock, so the database and the coins
+   cache they see are from the same commit, and are timed into the read
+   latency histograms. */
+class CryptoKernel::Blockchain::ReadView {
+public:
+    ReadView(Blockchain* blockchain) {
+        this->blockchain = blockchain;
+        start = std::chrono::steady_clock::now();
+        connects = blockchain->connects;
+        {
+            // A waiting commit holds the gate, so new reads cannot keep
+            // it waiting
+            std::lock_guard<std::mutex> gate(blockchain->commitGate);
+            lock = std::shared_lock<std::shared_timed_mutex>(blockchain->commitMutex);
+        }
+        dbTx.reset(blockchain->blockdb->beginReadOnly());
+    }
+
+    ~ReadView() {
+        dbTx.reset();
+        lock.unlock();
+
+        // connects is odd while a block is being connected
+        const uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - start).count();
+        if(connects % 2 == 1 || blockchain->connects != connects) {
+            blockchain->readStats->connecting.record(micros);
+        } else {
+            blockchain->readStats->idle.record(micros);
+        }
+    }
+
+    Storage::Transaction* get() {
+        return dbTx.get();
+    }
+
+private:
+    Blockchain* blockchain;
+    std::shared_lock<std::shared_timed_mutex> lock;
+    std::unique_ptr<Storage::Transaction> dbTx;
+    std::chrono::steady_clock::time_point start;
+    uint64_t connects;
+};
+
 CryptoKernel::Blockchain::Blockchain(CryptoKernel::Log* GlobalLog,
-                                     const std::string& dbDir) {
+                                     const std::string& dbDir,
+                                     const Json::Value& storageOptions) {
     status = false;
-    blockdb.reset(new CryptoKernel::Storage(dbDir));
+    this->dbDir = dbDir;
+    this->storageOptions = storageOptions;
+    blockdb.reset(new CryptoKernel::Storage(dbDir, storageOptions));
     blocks.reset(new CryptoKernel::Storage::Table("blocks"));
     transactions.reset(new CryptoKernel::Storage::Table("transactions"));
     utxos.reset(new CryptoKernel::Storage::Table("utxos"));
     stxos.reset(new CryptoKernel::Storage::Table("stxos"));
     inputs.reset(new CryptoKernel::Storage::Table("inputs"));
     candidates.reset(new CryptoKernel::Storage::Table("candidates"));
+    undo.reset(new CryptoKernel::Storage::Table("undo"));
+
+    enableFilters();
+    coins.reset(new CoinsCache(
+                    static_cast<uint64_t>(storageOptions.get("coinsCacheSize", 64).asDouble() * 1024 * 1024),
+                    storageOptions.get("coinsFlushInterval", 1000).asUInt64()));
+    const unsigned int hardwareThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    validationPool.reset(new ValidationPool(
+                             storageOptions.get("validationThreads", hardwareThreads - 1).asUInt()));
+    unconfirmedTransactions.reset(new Mempool(
+                                      static_cast<uint64_t>(storageOptions.get("mempoolSize", 300).asDouble() * 1024 * 1024),
+                                      storageOptions.get("mempoolExpiry", 336).asUInt64() * 60 * 60));
+    readStats.reset(new ReadStats());
+    connects = 0;
+    importBatchSize = std::max(storageOptions.get("importBatchSize", 100).asUInt64(),
+                               static_cast<uint64_t>(1));
+    importing = false;
+    reorging = false;
     log = GlobalLog;
+    initialSync = false;
+    cancelCheckpoint = false;
+    checkpointStatus["running"] = false;
+    blocksSinceDurable = 0;
+    normalDurability = blockdb->getDurability();
 }
 
 bool CryptoKernel::Blockchain::loadChain(CryptoKernel::Consensus* consensus,
                                          const std::string& genesisBlockFile) {
     std::lock_guard<std::recursive_mutex> lock(chainLock);
     this->consensus = consensus;
-    std::unique_ptr<Storage::Transaction> dbTransaction(blockdb->begin());
-    const bool tipExists = blocks->get(dbTransaction.get(), "tip").isObject();
+    std::unique_ptr<Storage::Transaction> dbTransaction(blockdb->beginReadOnly());
+    bool tipExists = blocks->get(dbTransaction.get(), "tip").isObject();
     dbTransaction->abort();
+    if(tipExists) {
+        migrateAddressIndex();
+    }
+    if(tipExists && (!replayCoins() || !recoverDurableTip())) {
+        tipExists = false;
+    }
     if(!tipExists) {
         emptyDB();
         bool newGenesisBlock = false;
@@ -97,46 +187,318 @@ bool CryptoKernel::Blockchain::loadChain(CryptoKernel::Consensus* consensus,
 }
 
 CryptoKernel::Blockchain::~Blockchain() {
+    {
+        std::lock_guard<std::mutex> lock(checkpointMutex);
+        cancelCheckpoint = true;
+    }
+    if(checkpointThread) {
+        checkpointThread->join();
+    }
+
+    if(status) {
+        std::lock_guard<std::recursive_mutex> lock(chainLock);
+        try {
+            std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+            coins->requireFlush();
+            commitCoins(dbTx.get());
+        } catch(const std::exception& e) {
+            log->printf(LOG_LEVEL_ERR, "Blockchain::~Blockchain(): Failed to flush the coins cache");
+        }
+    }
+
+    if(initialSync) {
+        try {
+            setInitialSync(false);
+        } catch(const std::exception& e) {
+            log->printf(LOG_LEVEL_ERR, "Blockchain::~Blockchain(): Failed to leave initial sync mode");
+        }
+    }
+}
+
+void CryptoKernel::Blockchain::setInitialSync(const bool initialSync) {
+    std::lock_guard<std::recursive_mutex> lock(chainLock);
+    if(initialSync == this->initialSync) {
+        return;
+    }
+
+    if(initialSync) {
+        // The marker must be durable before any unsynced commit is made
+        normalDurability = blockdb->getDurability();
+        markDurableTip();
+        blockdb->setDurability(Storage::DURABILITY_NONE);
+        log->printf(LOG_LEVEL_INFO, "Blockchain::setInitialSync(): Entered initial sync mode");
+    } else {
+        std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+        blocks->erase(dbTx.get(), "durabletip");
+        dbTx->commit();
+        blockdb->setDurability(normalDurability);
+        blockdb->flush();
+
+        // The sync leaves the chain tables spread over many overlapping
+        // files, compact them while the node is idle so lookups get back
+        // to their steady state latency
+        blockdb->compact({"utxos", "stxos", "inputs", "candidates", "transactions", "blocks"},
+                         true);
+        log->printf(LOG_LEVEL_INFO, "Blockchain::setInitialSync(): Left initial sync mode");
+    }
+
+    this->initialSync = initialSync;
+    blocksSinceDurable = 0;
+}
+
+bool CryptoKernel::Blockchain::isInitialSync() {
+    std::lock_guard<std::recursive_mutex> lock(chainLock);
+    return initialSync;
+}
+
+Json::Value CryptoKernel::Blockchain::getStorageStats() {
+    Json::Value returning = blockdb->getStats();
+    returning["coins"] = coins->getStats();
+    returning["validation"] = validationPool->getStats();
+    returning["readLatency"] = readStats->idle.toJson();
+    returning["readLatencyDuringConnect"] = readStats->connecting.toJson();
+    {
+        std::lock_guard<std::mutex> importLock(importMutex);
+        returning["import"] = importStats;
+    }
+    return returning;
+}
+
+void CryptoKernel::Blockchain::compactStorage(const std::vector<std::string>& tables) {
+    blockdb->compact(tables);
+}
 
+Json::Value CryptoKernel::Blockchain::getCompactionStatus() {
+    return blockdb->getCompactionStatus();
+}
+
+void CryptoKernel::Blockchain::startCheckpoint(const std::string& directory) {
+    std::lock_guard<std::mutex> lock(checkpointMutex);
+    if(checkpointStatus["running"].asBool()) {
+        throw std::runtime_error("A checkpoint is already being written to " +
+                                 checkpointStatus["directory"].asString());
+    }
+
+    if(checkpointThread) {
+        checkpointThread->join();
+    }
+
+    checkpointStatus = Json::Value();
+    checkpointStatus["directory"] = directory;
+    checkpointStatus["running"] = true;
+    checkpointStatus["keys"] = 0;
+    checkpointStatus["bytes"] = 0;
+    checkpointStatus["total"] = static_cast<Json::UInt64>(blockdb->getApproximateSize());
+    checkpointStatus["progress"] = 0.0;
+    checkpointStatus["started"] = static_cast<Json::UInt64>(std::time(0));
+    cancelCheckpoint = false;
+
+    checkpointThread.reset(new std::thread(&CryptoKernel::Blockchain::checkpointFunc, this,
+                                           directory));
+}
+
+Json::Value CryptoKernel::Blockchain::getCheckpointStatus() {
+    std::lock_guard<std::mutex> lock(checkpointMutex);
+    return checkpointStatus;
+}
+
+void CryptoKernel::Blockchain::checkpointFunc(const std::string directory) {
+    log->printf(LOG_LEVEL_INFO, "Blockchain::checkpointFunc(): Writing checkpoint to " + directory);
+
+    try {
+        const Json::Value result = blockdb->checkpoint(directory, [&](const uint64_t keys,
+        const uint64_t bytes) {
+            std::lock_guard<std::mutex> lock(checkpointMutex);
+            checkpointStatus["keys"] = static_cast<Json::UInt64>(keys);
+            checkpointStatus["bytes"] = static_cast<Json::UInt64>(bytes);
+
+            // The total is only an estimate, so the checkpoint is never
+            // reported complete before it is
+            const uint64_t total = checkpointStatus["total"].asUInt64();
+            checkpointStatus["progress"] = total > 0 ? std::min(0.99, double(bytes) / total) : 0.0;
+
+            return !cancelCheckpoint;
+        });
+
+        // The checkpoint is fully synced, so a durable tip marker copied
+        // from an initial sync must not roll it back when it is loaded
+        {
+            CryptoKernel::Storage copy(directory);
+            std::unique_ptr<Storage::Transaction> dbTx(copy.begin());
+            blocks->erase(dbTx.get(), "durabletip");
+            dbTx->commit();
+        }
+
+        std::lock_guard<std::mutex> lock(checkpointMutex);
+        checkpointStatus["keys"] = result["keys"];
+        checkpointStatus["bytes"] = result["bytes"];
+        checkpointStatus["progress"] = 1.0;
+        log->printf(LOG_LEVEL_INFO, "Blockchain::checkpointFunc(): Finished writing checkpoint to " +
+                    directory);
+    } catch(const std::exception& e) {
+        std::lock_guard<std::mutex> lock(checkpointMutex);
+        checkpointStatus["error"] = e.what();
+        log->printf(LOG_LEVEL_WARN, "Blockchain::checkpointFunc(): Failed to write checkpoint: " +
+                    std::string(e.what()));
+    }
+
+    std::lock_guard<std::mutex> lock(checkpointMutex);
+    checkpointStatus["running"] = false;
+    checkpointStatus["finished"] = static_cast<Json::UInt64>(std::time(0));
+}
+
+void CryptoKernel::Blockchain::markDurableTip() {
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+    blocks->put(dbTx.get(), "durabletip", getBlockDB(dbTx.get(), "tip").getId().toString());
+    dbTx->commit();
+    blockdb->flush();
+}
+
+bool CryptoKernel::Blockchain::recoverDurableTip() {
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+    const Json::Value durableTip = blocks->get(dbTx.get(), "durabletip");
+    if(durableTip.isNull()) {
+        return true;
+    }
+
+    // The node stopped during initial sync, so commits after the durable
+    // tip may be missing or incomplete
+    log->printf(LOG_LEVEL_WARN,
+                "Blockchain::loadChain(): Unclean shutdown during initial sync, rolling back to " +
+                durableTip.asString());
+
+    try {
+        while(getBlockDB(dbTx.get(), "tip").getId().toString() != durableTip.asString()) {
+            reverseBlock(dbTx.get());
+        }
+
+        blocks->erase(dbTx.get(), "durabletip");
+        commitCoins(dbTx.get());
+    } catch(const std::exception& e) {
+        coins->abort();
+        log->printf(LOG_LEVEL_ERR,
+                    "Blockchain::loadChain(): Failed to roll back to the durable tip, resyncing");
+        return false;
+    }
+
+    blockdb->flush();
+
+    return true;
+}
+
+bool CryptoKernel::Blockchain::replayCoins() {
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+    const Json::Value coinsTip = blocks->get(dbTx.get(), "coinstip");
+    const dbBlock tip = getBlockDB(dbTx.get(), "tip");
+    if(coinsTip.isNull() || coinsTip.asString() == tip.getId().toString()) {
+        return true;
+    }
+
+    // The node stopped before the coins cache was flushed, so the coins
+    // in the database are those of an earlier block of the main chain.
+    // Connect the coins of every block since then again.
+    log->printf(LOG_LEVEL_WARN,
+                "Blockchain::loadChain(): Coins database is behind the tip, replaying blocks since " +
+                coinsTip.asString());
+
+    try {
+        const uint64_t height = getBlockDB(dbTx.get(), coinsTip.asString()).getHeight();
+        if(getBlockByHeightDB(dbTx.get(), height).getId().toString() != coinsTip.asString()) {
+            throw std::runtime_error("Coins tip is not in the main chain");
+        }
+
+        for(uint64_t h = height + 1; h <= tip.getHeight(); h++) {
+            const block replayed = getBlockByHeight(dbTx.get(), h);
+            connectCoins(dbTx.get(), replayed.getCoinbaseTx());
+            for(const transaction& tx : replayed.getTransactions()) {
+                connectCoins(dbTx.get(), tx);
+            }
+        }
+
+        coins->requireFlush();
+        commitCoins(dbTx.get());
+    } catch(const std::exception& e) {
+        coins->abort();
+        log->printf(LOG_LEVEL_ERR,
+                    "Blockchain::loadChain(): Failed to replay the coins database, resyncing");
+        return false;
+    }
+
+    return true;
+}
+
+void CryptoKernel::Blockchain::commitCoins(Storage::Transaction* dbTx) {
+    // Coins are only written in the same commit as the tip they belong
+    // to, and "coinstip" records that tip. Blocks connected after it are
+    // replayed by loadChain if the node stops before the next flush.
+    const bool flushing = coins->needsFlush() ||
+                          blocks->getShared(dbTx, "coinstip")->isNull();
+    if(flushing) {
+        coins->flush(dbTx);
+        blocks->put(dbTx, "coinstip", getBlockDB(dbTx, "tip").getId().toString());
+    }
+
+    commitChain(dbTx, flushing);
+}
+
+void CryptoKernel::Blockchain::commitChain(Storage::Transaction* dbTx, const bool flushing) {
+    std::lock_guard<std::mutex> gate(commitGate);
+    std::unique_lock<std::shared_timed_mutex> lock(commitMutex);
+
+    dbTx->commit();
+    coins->commit(blockdb->getSequence(), blockdb->getOldestSnapshot());
+
+    if(flushing) {
+        coins->flushed();
+    }
 }
 
 std::set<CryptoKernel::Blockchain::transaction>
 CryptoKernel::Blockchain::getUnconfirmedTransactions() {
-    chainLock.lock();
-    const std::set<CryptoKernel::Blockchain::transaction> returning = unconfirmedTransactions.getTransactions();
-    chainLock.unlock();
+    return unconfirmedTransactions->getTransactions();
+}
+
+Json::Value CryptoKernel::Blockchain::getProjectedBlock() {
+    Json::Value returning = unconfirmedTransactions->getProjectedBlock();
+
+    ReadView view(this);
+    try {
+        const dbBlock tip = getBlockDB(view.get(), "tip");
+        returning["height"] = static_cast<Json::UInt64>(tip.getHeight() + 1);
+        returning["previousBlockId"] = tip.getId().toString();
+        returning["reward"] = static_cast<Json::UInt64>(getBlockReward(tip.getHeight() + 1));
+    } catch(const NotFoundException& e) {
+        returning["height"] = 1;
+    }
 
     return returning;
 }
 
 CryptoKernel::Blockchain::dbBlock CryptoKernel::Blockchain::getBlockDB(
     Storage::Transaction* transaction, const std::string& id, const bool mainChain) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    Json::Value jsonBlock = blocks->get(transaction, id);
-    if(!jsonBlock.isObject()) {
+    std::shared_ptr<const Json::Value> jsonBlock = blocks->getShared(transaction, id);
+    if(!jsonBlock->isObject()) {
         // Check if it's an orphan
-        jsonBlock = candidates->get(transaction, id);
-        if(!jsonBlock.isObject() || mainChain) {
+        jsonBlock = candidates->getShared(transaction, id);
+        if(!jsonBlock->isObject() || mainChain) {
             throw NotFoundException("Block " + id);
         } else {
-            return dbBlock(block(jsonBlock));
+            return dbBlock(block(*jsonBlock));
         }
     }
 
-    return dbBlock(jsonBlock);
+    return dbBlock(*jsonBlock);
 }
 
 CryptoKernel::Blockchain::dbBlock CryptoKernel::Blockchain::getBlockDB(
     const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    std::unique_ptr<Storage::Transaction> tx(blockdb->begin());
+    ReadView view(this);
 
-    return getBlockDB(tx.get(), id);
+    return getBlockDB(view.get(), id);
 }
 
 CryptoKernel::Blockchain::block CryptoKernel::Blockchain::getBlock(
     Storage::Transaction* transaction, const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
     const dbBlock block = getBlockDB(transaction, id);
 
     return buildBlock(transaction, block);
@@ -144,7 +506,6 @@ CryptoKernel::Blockchain::block CryptoKernel::Blockchain::getBlock(
 
 CryptoKernel::Blockchain::block CryptoKernel::Blockchain::buildBlock(
     Storage::Transaction* dbTx, const dbBlock& dbblock) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
     std::set<transaction> transactions;
 
     try {
@@ -156,9 +517,9 @@ CryptoKernel::Blockchain::block CryptoKernel::Blockchain::buildBlock(
                     dbblock.getPreviousBlockId(), dbblock.getTimestamp(), dbblock.getConsensusData(),
                     dbblock.getHeight());
     } catch(const NotFoundException& e) {
-        const Json::Value jsonBlock = candidates->get(dbTx, dbblock.getId().toString());
-        if(jsonBlock.isObject()) {
-            return block(jsonBlock);
+        const auto jsonBlock = candidates->getShared(dbTx, dbblock.getId().toString());
+        if(jsonBlock->isObject()) {
+            return block(*jsonBlock);
         } else {
             throw;
         }
@@ -167,88 +528,79 @@ CryptoKernel::Blockchain::block CryptoKernel::Blockchain::buildBlock(
 
 CryptoKernel::Blockchain::block CryptoKernel::Blockchain::getBlockByHeight(
     Storage::Transaction* transaction, const uint64_t height) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
     const std::string id = blocks->get(transaction, std::to_string(height), 0).asString();
     return getBlock(transaction, id);
 }
 
 CryptoKernel::Blockchain::dbBlock CryptoKernel::Blockchain::getBlockByHeightDB(
     Storage::Transaction* transaction, const uint64_t height) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
     const std::string id = blocks->get(transaction, std::to_string(height), 0).asString();
     return getBlockDB(transaction, id);
 }
 
 CryptoKernel::Blockchain::transaction CryptoKernel::Blockchain::getTransaction(
     const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    std::unique_ptr<Storage::Transaction> tx(blockdb->begin());
-    return getTransaction(tx.get(), id);
+    ReadView view(this);
+    return getTransaction(view.get(), id);
 }
 
 CryptoKernel::Blockchain::block CryptoKernel::Blockchain::getBlock(
     const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    std::unique_ptr<Storage::Transaction> tx(blockdb->begin());
-    return getBlock(tx.get(), id);
+    ReadView view(this);
+    return getBlock(view.get(), id);
 }
 
 CryptoKernel::Blockchain::block CryptoKernel::Blockchain::getBlockByHeight(
     const uint64_t height) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    std::unique_ptr<Storage::Transaction> tx(blockdb->begin());
-    return getBlockByHeight(tx.get(), height);
+    ReadView view(this);
+    return getBlockByHeight(view.get(), height);
 }
 
 CryptoKernel::Blockchain::output CryptoKernel::Blockchain::getOutput(
     const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    std::unique_ptr<Storage::Transaction> tx(blockdb->begin());
-    return getOutput(tx.get(), id);
+    ReadView view(this);
+    return getOutput(view.get(), id);
 }
 
 CryptoKernel::Blockchain::output CryptoKernel::Blockchain::getOutput(
     Storage::Transaction* dbTx, const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    Json::Value outputJson = utxos->get(dbTx, id);
-    if(!outputJson.isObject()) {
-        outputJson = stxos->get(dbTx, id);
-        if(!outputJson.isObject()) {
+    std::shared_ptr<const Json::Value> outputJson = coins->get(dbTx, utxos->getKey(id));
+    if(!outputJson->isObject()) {
+        outputJson = coins->get(dbTx, stxos->getKey(id));
+        if(!outputJson->isObject()) {
             throw NotFoundException("Output " + id);
         }
     }
 
-    return output(outputJson);
+    return output(*outputJson);
 }
 
 CryptoKernel::Blockchain::dbOutput CryptoKernel::Blockchain::getOutputDB(
     Storage::Transaction* dbTx, const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    Json::Value outputJson = utxos->get(dbTx, id);
-    if(!outputJson.isObject()) {
-        outputJson = stxos->get(dbTx, id);
-        if(!outputJson.isObject()) {
+    std::shared_ptr<const Json::Value> outputJson = coins->get(dbTx, utxos->getKey(id));
+    if(!outputJson->isObject()) {
+        outputJson = coins->get(dbTx, stxos->getKey(id));
+        if(!outputJson->isObject()) {
             throw NotFoundException("Output " + id);
         }
     }
 
-    return dbOutput(outputJson);
+    return dbOutput(*outputJson);
 }
 
 CryptoKernel::Blockchain::input CryptoKernel::Blockchain::getInput(
     Storage::Transaction* dbTx, const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    Json::Value inputJson = inputs->get(dbTx, id);
-    if(!inputJson.isObject()) {
+    const auto inputJson = inputs->getShared(dbTx, id);
+    if(!inputJson->isObject()) {
         throw NotFoundException("Input " + id);
     }
 
-    return input(inputJson);
+    return input(*inputJson);
 }
 
 std::tuple<bool, bool> CryptoKernel::Blockchain::verifyTransaction(Storage::Transaction* dbTransaction,
-        const transaction& tx, const bool coinbaseTx) {
-    if(transactions->get(dbTransaction, tx.getId().toString()).isObject()) {
+        const transaction& tx, const bool coinbaseTx, const bool mempoolInputs) {
+    if(transactions->getShared(dbTransaction, tx.getId().toString())->isObject()) {
         log->printf(LOG_LEVEL_INFO, "blockchain::verifyTransaction(): tx already exists");
         return std::make_tuple(false, false);
     }
@@ -257,8 +609,8 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::verifyTransaction(Storage::Tran
     uint64_t outputTotal = 0;
 
     for(const output& out : tx.getOutputs()) {
-        if(utxos->get(dbTransaction, out.getId().toString()).isObject() ||
-                stxos->get(dbTransaction, out.getId().toString()).isObject()) {
+        if(coins->get(dbTransaction, utxos->getKey(out.getId().toString()))->isObject() ||
+                coins->get(dbTransaction, stxos->getKey(out.getId().toString()))->isObject()) {
             log->printf(LOG_LEVEL_INFO, "blockchain::verifyTransaction(): Output already exists");
             //Duplicate output
             return std::make_tuple(false, false);
@@ -269,18 +621,38 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::verifyTransaction(Storage::Tran
 
     const CryptoKernel::BigNum outputHash = tx.getOutputSetId();
 
-    for(const input& inp : tx.getInputs()) {
-        const Json::Value outJson = utxos->get(dbTransaction, inp.getOutputId().toString());
-        if(!outJson.isObject()) {
+    const std::set<input> txInputs = tx.getInputs();
+    std::vector<std::string> spentKeys;
+    for(const input& inp : txInputs) {
+        spentKeys.push_back(utxos->getKey(inp.getOutputId().toString()));
+    }
+    const auto spentOutputs = coins->getMany(dbTransaction, spentKeys);
+
+    auto spentOutput = spentOutputs.begin();
+    bool unconfirmedInputs = false;
+    bool contractInputs = false;
+    for(const input& inp : txInputs) {
+        std::shared_ptr<const Json::Value> outJson = *spentOutput++;
+        if(!outJson->isObject() && mempoolInputs) {
+            outJson = std::make_shared<const Json::Value>(
+                          unconfirmedTransactions->getOutput(inp.getOutputId()));
+            unconfirmedInputs = unconfirmedInputs || outJson->isObject();
+        }
+
+        if(!outJson->isObject()) {
             log->printf(LOG_LEVEL_INFO,
                         "blockchain::verifyTransaction(): Output has already been spent");
             return std::make_tuple(false, false);
         }
 
-        const dbOutput out = dbOutput(outJson);
+        const dbOutput out = dbOutput(*outJson);
         inputTotal += out.getValue();
 
         const Json::Value outData = out.getData();
+        if(!outData["contract"].empty()) {
+            contractInputs = true;
+        }
+
         if(!outData["publicKey"].empty() && outData["contract"].empty()) {
             const Json::Value spendData = inp.getData();
             if(spendData["signature"].empty()) {
@@ -314,10 +686,20 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::verifyTransaction(Storage::Tran
         }
     }
 
-    CryptoKernel::ContractRunner lvm(this);
-    if(!lvm.evaluateValid(dbTransaction, tx)) {
-        log->printf(LOG_LEVEL_INFO, "blockchain::verifyTransaction(): Script returned false");
-        return std::make_tuple(false, true);
+    // Contracts read the outputs they guard from the chain, so they cannot
+    // be evaluated for a transaction that also spends unconfirmed outputs
+    if(contractInputs) {
+        if(unconfirmedInputs) {
+            log->printf(LOG_LEVEL_INFO,
+                        "blockchain::verifyTransaction(): Contract inputs cannot be spent with unconfirmed inputs");
+            return std::make_tuple(false, false);
+        }
+
+        CryptoKernel::ContractRunner lvm(this);
+        if(!lvm.evaluateValid(dbTransaction, tx)) {
+            log->printf(LOG_LEVEL_INFO, "blockchain::verifyTransaction(): Script returned false");
+            return std::make_tuple(false, true);
+        }
     }
 
     if(!consensus->verifyTransaction(dbTransaction, tx)) {
@@ -342,26 +724,139 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitTransaction(const transac
 std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(const block& newBlock, bool genesisBlock) {
     std::lock_guard<std::recursive_mutex> lock(chainLock);
     std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
-    const auto result = submitBlock(dbTx.get(), newBlock, genesisBlock);
-    if(std::get<0>(result)) {
-        dbTx->commit();
+    connects++;
+    try {
+        const auto result = submitBlock(dbTx.get(), newBlock, genesisBlock);
+        if(std::get<0>(result)) {
+            commitCoins(dbTx.get());
+
+            if(initialSync && ++blocksSinceDurable >= durableTipInterval) {
+                markDurableTip();
+                blocksSinceDurable = 0;
+            }
+        } else {
+            coins->abort();
+        }
+        connects++;
+        return result;
+    } catch(const std::exception& e) {
+        coins->abort();
+        connects++;
+        throw;
     }
+}
+
+static Json::Value importRates(const uint64_t blocks, const uint64_t transactions,
+                               const uint64_t micros) {
+    const double seconds = micros / 1000000.0;
+
+    Json::Value returning;
+    returning["blocks"] = static_cast<Json::UInt64>(blocks);
+    returning["transactions"] = static_cast<Json::UInt64>(transactions);
+    returning["micros"] = static_cast<Json::UInt64>(micros);
+    returning["blocksPerSecond"] = seconds > 0 ? blocks / seconds : 0.0;
+    returning["transactionsPerSecond"] = seconds > 0 ? transactions / seconds : 0.0;
+
+    return returning;
+}
+
+std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlocks(
+    const std::vector<block>& newBlocks) {
+    std::lock_guard<std::recursive_mutex> lock(chainLock);
+    const auto start = std::chrono::steady_clock::now();
+
+    std::tuple<bool, bool> result = std::make_tuple(true, false);
+    uint64_t blockCount = 0;
+    uint64_t txCount = 0;
+
+    connects++;
+    importing = true;
+    try {
+        auto it = newBlocks.begin();
+        while(it != newBlocks.end() && std::get<0>(result)) {
+            // A rejected block is rolled back on its own, so the blocks
+            // before it in the batch are still committed
+            std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+            uint64_t batched = 0;
+            for(; it != newBlocks.end() && batched < importBatchSize; ++it) {
+                result = submitBlock(dbTx.get(), *it);
+                if(!std::get<0>(result)) {
+                    break;
+                }
+
+                batched++;
+                txCount += it->getTransactions().size() + 1;
+            }
+
+            commitCoins(dbTx.get());
+            blockCount += batched;
+
+            if(initialSync) {
+                blocksSinceDurable += batched;
+                if(blocksSinceDurable >= durableTipInterval) {
+                    markDurableTip();
+                    blocksSinceDurable = 0;
+                }
+            }
+        }
+
+        // Contracts in the mempool are checked against the new tip once
+        // for the run
+        std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+        unconfirmedTransactions->rescanScripted(dbTx.get(), this);
+    } catch(const std::exception& e) {
+        coins->abort();
+        importing = false;
+        connects++;
+        throw;
+    }
+    importing = false;
+    connects++;
+
+    const uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - start).count();
+    const Json::Value last = importRates(blockCount, txCount, micros);
+
+    log->printf(LOG_LEVEL_INFO, "Blockchain::submitBlocks(): connected " +
+                std::to_string(blockCount) + " blocks, " +
+                std::to_string(last["blocksPerSecond"].asUInt64()) + " blocks/s, " +
+                std::to_string(last["transactionsPerSecond"].asUInt64()) + " tx/s");
+
+    std::lock_guard<std::mutex> importLock(importMutex);
+    importStats = importRates(importStats["blocks"].asUInt64() + blockCount,
+                              importStats["transactions"].asUInt64() + txCount,
+                              importStats["micros"].asUInt64() + micros);
+    importStats["last"] = last;
+
     return result;
 }
 
 std::tuple<bool, bool> CryptoKernel::Blockchain::submitTransaction(Storage::Transaction* dbTx,
         const transaction& tx) {
     std::lock_guard<std::recursive_mutex> lock(chainLock);
-	const auto verifyResult = verifyTransaction(dbTx, tx);
+	const auto verifyResult = verifyTransaction(dbTx, tx, false, true);
     if(std::get<0>(verifyResult)) {
         if(consensus->submitTransaction(dbTx, tx)) {
-			if(unconfirmedTransactions.insert(tx)) {
+            const uint64_t fee = calculateTransactionFee(dbTx, tx, true);
+            // Only confirmed outputs may have contracts, see verifyTransaction
+            bool scripted = false;
+            for(const input& inp : tx.getInputs()) {
+                const auto outJson = coins->get(dbTx, utxos->getKey(inp.getOutputId().toString()));
+                if(outJson->isObject() && !(*outJson)["data"]["contract"].empty()) {
+                    scripted = true;
+                    break;
+                }
+            }
+
+			unconfirmedTransactions->expire(std::time(0));
+			if(unconfirmedTransactions->insert(tx, fee, scripted)) {
 				log->printf(LOG_LEVEL_INFO,
 							"blockchain::submitTransaction(): Received transaction " + tx.getId().toString());
 				return std::make_tuple(true, false);
 			} else {
 				log->printf(LOG_LEVEL_INFO,
-							"blockchain::submitTransaction(): " + tx.getId().toString() + " has a mempool conflict");
+							"blockchain::submitTransaction(): " + tx.getId().toString() +
+							" conflicts with the mempool or pays less than its minimum fee rate");
 				return std::make_tuple(false, false);
 			}
         } else {
@@ -380,9 +875,25 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(Storage::Transactio
         const block& newBlock, bool genesisBlock) {
     std::lock_guard<std::recursive_mutex> lock(chainLock);
 
+    // A rejected block leaves no writes behind, so the transaction can go
+    // on to be used for other blocks
+    const unsigned int savepoint = dbTx->savepoint();
+    const size_t coinsSavepoint = coins->savepoint();
+    const auto result = applyBlock(dbTx, newBlock, genesisBlock);
+    if(!std::get<0>(result)) {
+        dbTx->rollbackTo(savepoint);
+        coins->rollbackTo(coinsSavepoint);
+    }
+    dbTx->release(savepoint);
+
+    return result;
+}
+
+std::tuple<bool, bool> CryptoKernel::Blockchain::applyBlock(Storage::Transaction* dbTx,
+        const block& newBlock, bool genesisBlock) {
     const std::string idAsString = newBlock.getId().toString();
     //Check block does not already exist
-    if(blocks->get(dbTx, idAsString).isObject()) {
+    if(blocks->getShared(dbTx, idAsString)->isObject()) {
         log->printf(LOG_LEVEL_INFO, "blockchain::submitBlock(): Block is already in main chain");
         return std::make_tuple(true, false);
     }
@@ -446,32 +957,22 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(Storage::Transactio
     if(!onlySave) {
         uint64_t fees = 0;
 
-        const unsigned int threads = std::thread::hardware_concurrency();
-        const auto& txs = newBlock.getTransactions();
-        bool failure = false;
-        unsigned int nTx = 0;
-        std::vector<std::thread> threadsVec;
-
-        for(const auto& tx : txs) {
-            threadsVec.push_back(std::thread([&]{
-                if(!std::get<0>(verifyTransaction(dbTx, tx))) {
-                    failure = true;
-                }
-            }));
-            nTx++;
+        prefetchBlock(dbTx, newBlock);
 
-            if(nTx % threads == 0 || nTx >= txs.size()) {
-                for(auto& thread : threadsVec) {
-                    thread.join();
-                }
-                threadsVec.clear();
+        // Nothing is written to dbTx until every transaction is verified,
+        // so the pool's threads can all read from it
+        const std::set<transaction> blockTxs = newBlock.getTransactions();
+        std::vector<const transaction*> txs;
+        for(const transaction& tx : blockTxs) {
+            txs.push_back(&tx);
+        }
 
-                if(failure) {
-                    log->printf(LOG_LEVEL_INFO,
-                            "blockchain::submitBlock(): Transaction could not be verified");
-                    return std::make_tuple(false, true);
-                }
-            }
+        if(!validationPool->run(txs.size(), [&](const size_t i) {
+            return std::get<0>(verifyTransaction(dbTx, *txs[i]));
+        })) {
+            log->printf(LOG_LEVEL_INFO,
+                        "blockchain::submitBlock(): Transaction could not be verified");
+            return std::make_tuple(false, true);
         }
 
 
@@ -503,12 +1004,20 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(Storage::Transactio
             return std::make_tuple(false, true);
         }
 
-        confirmTransaction(dbTx, newBlock.getCoinbaseTx(), newBlock.getId(), true);
+        // The outputs the block spends are kept with it, so disconnecting
+        // it restores them without reading them back
+        Json::Value spentOutputs(Json::objectValue);
+
+        confirmTransaction(dbTx, newBlock.getCoinbaseTx(), newBlock.getId(), spentOutputs, true);
 
         //Move transactions from unconfirmed to confirmed and add transaction utxos to db
         for(const transaction& tx : newBlock.getTransactions()) {
-            confirmTransaction(dbTx, tx, newBlock.getId());
+            confirmTransaction(dbTx, tx, newBlock.getId(), spentOutputs);
         }
+
+        undo->put(dbTx, idAsString, spentOutputs);
+
+        coins->recordBlock();
     }
 
     if(onlySave) {
@@ -522,90 +1031,118 @@ std::tuple<bool, bool> CryptoKernel::Blockchain::submitBlock(Storage::Transactio
         blocks->put(dbTx, "tip", blockAsJson);
         blocks->put(dbTx, std::to_string(blockHeight), Json::Value(idAsString), 0);
         blocks->put(dbTx, idAsString, blockAsJson);
-		unconfirmedTransactions.rescanMempool(dbTx, this);
+        if(reorging) {
+            reorgConnectedBlocks.push_back(newBlock);
+        } else {
+            unconfirmedTransactions->blockConnected(newBlock);
+            unconfirmedTransactions->expire(std::time(0));
+            if(!importing) {
+                unconfirmedTransactions->rescanScripted(dbTx, this);
+            }
+        }
     }
 
     if(genesisBlock) {
         genesisBlockId = newBlock.getId();
     }
 
-    log->printf(LOG_LEVEL_INFO,
-                "blockchain::submitBlock(): successfully submitted block: " +
-                CryptoKernel::Storage::toString(getBlockDB(dbTx, idAsString).toJson(), true));
+    if(importing) {
+        log->printf(LOG_LEVEL_INFO, "blockchain::submitBlock(): successfully submitted block " +
+                    idAsString + " at height " + std::to_string(blockHeight));
+    } else {
+        log->printf(LOG_LEVEL_INFO,
+                    "blockchain::submitBlock(): successfully submitted block: " +
+                    CryptoKernel::Storage::toString(getBlockDB(dbTx, idAsString).toJson(), true));
+    }
 
     return std::make_tuple(true, false);
 }
 
+void CryptoKernel::Blockchain::prefetchBlock(Storage::Transaction* dbTx,
+        const block& newBlock) {
+    // Read every row verifying and confirming the block looks up in one
+    // parallel batch, so the serial connect finds them cached
+    std::vector<std::string> keys;
+    std::vector<std::string> coinKeys;
+    std::set<transaction> txs = newBlock.getTransactions();
+    txs.insert(newBlock.getCoinbaseTx());
+    for(const transaction& tx : txs) {
+        keys.push_back(transactions->getKey(tx.getId().toString()));
+        for(const output& out : tx.getOutputs()) {
+            const std::string id = out.getId().toString();
+            coinKeys.push_back(utxos->getKey(id));
+            coinKeys.push_back(stxos->getKey(id));
+        }
+        for(const input& inp : tx.getInputs()) {
+            coinKeys.push_back(utxos->getKey(inp.getOutputId().toString()));
+        }
+    }
+
+    // Coins already in the coins cache are never read from the database
+    for(const std::string& key : coinKeys) {
+        if(!coins->contains(key)) {
+            keys.push_back(key);
+        }
+    }
+
+    dbTx->prefetch(keys);
+}
+
 void CryptoKernel::Blockchain::confirmTransaction(Storage::Transaction* dbTransaction,
-        const transaction& tx, const BigNum& confirmingBlock, const bool coinbaseTx) {
+        const transaction& tx, const BigNum& confirmingBlock, Json::Value& spentOutputs,
+        const bool coinbaseTx) {
     //Execute custom transaction rules callback
     if(!consensus->confirmTransaction(dbTransaction, tx)) {
         log->printf(LOG_LEVEL_ERR, "Consensus rules failed to confirm transaction");
     }
 
+    connectCoins(dbTransaction, tx, &spentOutputs);
+
+    for(const input& inp : tx.getInputs()) {
+        inputs->put(dbTransaction, inp.getId().toString(), dbInput(inp).toJson());
+    }
+
+    //Commit transaction
+    transactions->put(dbTransaction, tx.getId().toString(), Blockchain::dbTransaction(tx,
+                      confirmingBlock, coinbaseTx).toJson());
+
+    //Remove transaction from unconfirmed transactions vector
+    unconfirmedTransactions->remove(tx);
+}
+
+void CryptoKernel::Blockchain::connectCoins(Storage::Transaction* dbTx,
+        const transaction& tx, Json::Value* spentOutputs) {
     //"Spend" UTXOs
     for(const input& inp : tx.getInputs()) {
         const std::string outputId = inp.getOutputId().toString();
-        const Json::Value utxo = utxos->get(dbTransaction, outputId);
-        const auto txoData = dbOutput(utxo).getData();
+        const std::shared_ptr<const Json::Value> utxo = coins->get(dbTx, utxos->getKey(outputId));
+        const auto txoData = dbOutput(*utxo).getData();
 
-        stxos->put(dbTransaction, outputId, utxo);
+        coins->put(stxos->getKey(outputId), *utxo);
+        if(spentOutputs != nullptr) {
+            (*spentOutputs)[outputId] = *utxo;
+        }
 
         if(!txoData["publicKey"].isNull()) {
-            Json::Value txos = stxos->get(dbTransaction,
-                                          txoData["publicKey"].asString(),
-                                          0);
-            txos.append(outputId);
-            stxos->put(dbTransaction,
-                       txoData["publicKey"].asString(),
-                       txos,
-                       0);
-
-            txos = utxos->get(dbTransaction,
-                              txoData["publicKey"].asString(),
-                              0);
-
-            Json::Value newTxos;
-            for(const auto& txo : txos) {
-                if(txo.asString() != outputId) {
-                    newTxos.append(txo);
-                }
-            }
-
-            utxos->put(dbTransaction,
-                       txoData["publicKey"].asString(),
-                       newTxos,
-                       0);
+            const std::string addressKey = getAddressKey(txoData["publicKey"].asString(), outputId);
+            coins->put(stxos->getKey(addressKey, 1), Json::Value(true), true);
+            coins->erase(utxos->getKey(addressKey, 1));
         }
 
-        utxos->erase(dbTransaction, outputId);
-
-        inputs->put(dbTransaction, inp.getId().toString(), dbInput(inp).toJson());
+        coins->erase(utxos->getKey(outputId));
     }
 
     //Add new outputs to UTXOs
     for(const output& out : tx.getOutputs()) {
         const auto txoData = out.getData();
         if(!txoData["publicKey"].isNull()) {
-            Json::Value txos = utxos->get(dbTransaction,
-                                          txoData["publicKey"].asString(),
-                                          0);
-            txos.append(out.getId().toString());
-            utxos->put(dbTransaction,
-                       txoData["publicKey"].asString(),
-                       txos,
-                       0);
+            coins->put(utxos->getKey(getAddressKey(txoData["publicKey"].asString(),
+                                                   out.getId().toString()), 1),
+                       Json::Value(true), true);
         }
 
-        utxos->put(dbTransaction, out.getId().toString(), dbOutput(out, tx.getId()).toJson());
+        coins->put(utxos->getKey(out.getId().toString()), dbOutput(out, tx.getId()).toJson());
     }
-
-    //Commit transaction
-    transactions->put(dbTransaction, tx.getId().toString(), Blockchain::dbTransaction(tx,
-                      confirmingBlock, coinbaseTx).toJson());
-
-    //Remove transaction from unconfirmed transactions vector
-    unconfirmedTransactions.remove(tx);
 }
 
 bool CryptoKernel::Blockchain::reorgChain(Storage::Transaction* dbTransaction,
@@ -620,27 +1157,94 @@ bool CryptoKernel::Blockchain::reorgChain(Storage::Transaction* dbTransaction,
         blockJson = candidates->get(dbTransaction, currentBlock.getPreviousBlockId().toString());
     }
 
-    //Reverse blocks to that point
+    //Reverse blocks to that point. If the new chain turns out to be
+    //invalid this is undone in place rather than reloaded from disk
+    const unsigned int savepoint = dbTransaction->savepoint();
+    const size_t coinsSavepoint = coins->savepoint();
     const BigNum forkBlockId = blockList.top().getPreviousBlockId();
-    while(getBlockDB(dbTransaction, "tip").getId() != forkBlockId) {
-        reverseBlock(dbTransaction);
-    }
+    std::set<transaction> disconnected;
+
+    // The mempool is only changed once the new chain has connected, so a
+    // failed reorg leaves it as it was
+    reorging = true;
+    try {
+        while(getBlockDB(dbTransaction, "tip").getId() != forkBlockId) {
+            const std::set<transaction> txs = reverseBlock(dbTransaction);
+            disconnected.insert(txs.begin(), txs.end());
+        }
+
+        //Submit new blocks
+        while(!blockList.empty()) {
+            if(!std::get<0>(submitBlock(dbTransaction, blockList.top()))) {
+                //TODO: should probably blacklist this fork if this happens
+
+                log->printf(LOG_LEVEL_WARN, "blockchain::reorgChain(): New chain failed to verify");
 
-    //Submit new blocks
-    while(!blockList.empty()) {
-        if(!std::get<0>(submitBlock(dbTransaction, blockList.top()))) {
-            //TODO: should probably blacklist this fork if this happens
+                dbTransaction->rollbackTo(savepoint);
+                dbTransaction->release(savepoint);
+                coins->rollbackTo(coinsSavepoint);
+                endReorg();
 
-            log->printf(LOG_LEVEL_WARN, "blockchain::reorgChain(): New chain failed to verify");
+                return false;
+            }
+            blockList.pop();
+        }
+    } catch(...) {
+        endReorg();
+        throw;
+    }
 
-            return false;
+    dbTransaction->release(savepoint);
+
+    // Mempool transactions spending the outputs of the old chain leave
+    // with them, and are submitted again after the transactions of the old
+    // chain, in case those are restored
+    const std::vector<transaction> orphaned =
+        unconfirmedTransactions->outputsRemoved(reorgRemovedOutputs);
+    for(const block& connected : reorgConnectedBlocks) {
+        unconfirmedTransactions->blockConnected(connected);
+    }
+    endReorg();
+    unconfirmedTransactions->expire(std::time(0));
+    unconfirmedTransactions->rescanScripted(dbTransaction, this);
+
+    // Transactions of the old chain that the new chain did not confirm go
+    // back to the mempool, once for the whole reorg, followed by the
+    // mempool transactions that spent their outputs. One may spend the
+    // outputs of another, so they are retried until a pass adds none.
+    std::vector<transaction> pending(disconnected.begin(), disconnected.end());
+    pending.insert(pending.end(), orphaned.rbegin(), orphaned.rend());
+    pending.erase(std::remove_if(pending.begin(), pending.end(), [&](const transaction& tx) {
+        return transactions->getShared(dbTransaction, tx.getId().toString())->isObject();
+    }), pending.end());
+
+    bool added = true;
+    while(added) {
+        added = false;
+        for(auto it = pending.begin(); it != pending.end();) {
+            if(std::get<0>(submitTransaction(dbTransaction, *it))) {
+                it = pending.erase(it);
+                added = true;
+            } else {
+                ++it;
+            }
         }
-        blockList.pop();
+    }
+
+    for(const transaction& tx : pending) {
+        log->printf(LOG_LEVEL_WARN, "Blockchain::reorgChain(): previously moved transaction " +
+                    tx.getId().toString() + " is now invalid");
     }
 
     return true;
 }
 
+void CryptoKernel::Blockchain::endReorg() {
+    reorging = false;
+    reorgRemovedOutputs.clear();
+    reorgConnectedBlocks.clear();
+}
+
 uint64_t CryptoKernel::Blockchain::getTransactionFee(const transaction& tx) {
     uint64_t fee = 0;
 
@@ -656,7 +1260,7 @@ uint64_t CryptoKernel::Blockchain::getTransactionFee(const transaction& tx) {
 }
 
 uint64_t CryptoKernel::Blockchain::calculateTransactionFee(Storage::Transaction* dbTx,
-        const transaction& tx) {
+        const transaction& tx, const bool mempoolInputs) {
     uint64_t inputTotal = 0;
     uint64_t outputTotal = 0;
 
@@ -665,8 +1269,12 @@ uint64_t CryptoKernel::Blockchain::calculateTransactionFee(Storage::Transaction*
     }
 
     for(const input& inp : tx.getInputs()) {
-        const dbOutput out = dbOutput(utxos->get(dbTx, inp.getOutputId().toString()));
-        inputTotal += out.getValue();
+        const auto outJson = coins->get(dbTx, utxos->getKey(inp.getOutputId().toString()));
+        if(!outJson->isObject() && mempoolInputs) {
+            inputTotal += dbOutput(unconfirmedTransactions->getOutput(inp.getOutputId())).getValue();
+        } else {
+            inputTotal += dbOutput(*outJson).getValue();
+        }
     }
 
     return inputTotal - outputTotal;
@@ -675,7 +1283,7 @@ uint64_t CryptoKernel::Blockchain::calculateTransactionFee(Storage::Transaction*
 CryptoKernel::Blockchain::block CryptoKernel::Blockchain::generateVerifyingBlock(
     const std::string& publicKey) {
     std::lock_guard<std::recursive_mutex> lock(chainLock);
-    std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+    std::unique_ptr<Storage::Transaction> dbTx(blockdb->beginReadOnly());
 
     const std::set<transaction> blockTransactions = getUnconfirmedTransactions();
 
@@ -726,142 +1334,181 @@ CryptoKernel::Blockchain::block CryptoKernel::Blockchain::generateVerifyingBlock
 
 std::set<CryptoKernel::Blockchain::output> CryptoKernel::Blockchain::getUnspentOutputs(
     const std::string& publicKey) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+    return getAddressOutputs(utxos.get(), publicKey);
+}
+
+std::set<CryptoKernel::Blockchain::output> CryptoKernel::Blockchain::getSpentOutputs(
+    const std::string& publicKey) {
+    return getAddressOutputs(stxos.get(), publicKey);
+}
+
+std::string CryptoKernel::Blockchain::getAddressKey(const std::string& publicKey,
+        const std::string& outputId) {
+    // Public keys are base64 and output ids hex, so neither normally
+    // contains the separator
+    return publicKey + ":" + outputId;
+}
+
+std::set<CryptoKernel::Blockchain::output> CryptoKernel::Blockchain::getAddressOutputs(
+    Storage::Table* table, const std::string& publicKey) {
+    ReadView view(this);
+    Storage::Transaction* dbTx = view.get();
+
+    // The address index holds one key per output of a public key, so its
+    // outputs are a range scan merged with the writes still in the coins
+    // cache
+    const std::string begin = publicKey + ":";
+    const std::string end = publicKey + ";";
+
+    std::map<std::string, bool> pending;
+    const size_t idStart = table->getKey(begin, 1).size();
+    for(const auto& entry : coins->getDirty(table->getKey(begin, 1), table->getKey(end, 1), true)) {
+        pending[entry.first.substr(idStart)] = !entry.second->isNull();
+    }
 
     std::set<output> returning;
 
-    const auto unspent = utxos->get(dbTx.get(), publicKey, 0);
+    Storage::Table::Iterator it(table, dbTx, 1);
+    it.setLowerBound(begin);
+    it.setUpperBound(end);
+    for(it.SeekToFirst(); it.Valid(); it.Next()) {
+        // Keys of a public key that itself contains the separator fall in
+        // the range too, and are told apart by the separator in their id
+        const std::string outputId = it.key().substr(begin.size());
+        if(outputId.find(':') == std::string::npos && pending.find(outputId) == pending.end()) {
+            returning.insert(getOutputDB(dbTx, outputId));
+        }
+    }
 
-    for(const auto& utxo : unspent) {
-        returning.insert(getOutputDB(dbTx.get(), utxo.asString()));
+    for(const auto& entry : pending) {
+        if(entry.second && entry.first.find(':') == std::string::npos) {
+            returning.insert(getOutputDB(dbTx, entry.first));
+        }
     }
 
     return returning;
 }
 
-std::set<CryptoKernel::Blockchain::output> CryptoKernel::Blockchain::getSpentOutputs(
-    const std::string& publicKey) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
-
-    std::set<output> returning;
+void CryptoKernel::Blockchain::migrateAddressIndex() {
+    // Databases written before the address index was keyed by output
+    // hold one array of output ids per public key at index 0
+    for(Storage::Table* table : {utxos.get(), stxos.get()}) {
+        Storage::Table::Iterator it(table, blockdb.get(), 0);
+        it.SeekToFirst();
+        if(!it.Valid()) {
+            continue;
+        }
 
-    const auto spent = stxos->get(dbTx.get(), publicKey, 0);
+        log->printf(LOG_LEVEL_INFO, "Blockchain::loadChain(): Migrating the address index");
 
-    for(const auto& stxo : spent) {
-        returning.insert(getOutputDB(dbTx.get(), stxo.asString()));
+        std::unique_ptr<Storage::Transaction> dbTx(blockdb->begin());
+        for(; it.Valid(); it.Next()) {
+            for(const auto& outputId : it.value()) {
+                table->put(dbTx.get(), getAddressKey(it.key(), outputId.asString()),
+                           Json::Value(true), 1);
+            }
+            table->erase(dbTx.get(), it.key(), 0);
+        }
+        dbTx->commit();
     }
-
-    return returning;
 }
 
-void CryptoKernel::Blockchain::reverseBlock(Storage::Transaction* dbTransaction) {
-    const block tip = getBlock(dbTransaction, "tip");
+std::set<CryptoKernel::Blockchain::transaction> CryptoKernel::Blockchain::reverseBlock(
+    Storage::Transaction* dbTransaction) {
+    const dbBlock tipDB = getBlockDB(dbTransaction, "tip");
+    const block tip = buildBlock(dbTransaction, tipDB);
+    const std::string tipId = tip.getId().toString();
+
+    // Blocks connected before undo records were kept have none, so the
+    // outputs they spent are read back from stxos
+    const std::shared_ptr<const Json::Value> spentOutputs = undo->getShared(dbTransaction, tipId);
 
     auto eraseUtxo = [&](const auto& out, auto& db) {
-        db->erase(dbTransaction, out.getId().toString());
+        coins->erase(db->getKey(out.getId().toString()));
 
         const auto txoData = out.getData();
         if(!txoData["publicKey"].isNull()) {
-            const Json::Value txos = db->get(dbTransaction,
-                                          txoData["publicKey"].asString(),
-                                          0);
-
-            const auto outputId = out.getId().toString();
-
-            Json::Value newTxos;
-            for(const auto& txo : txos) {
-                if(txo.asString() != outputId) {
-                    newTxos.append(txo);
-                }
-            }
-
-            db->put(dbTransaction,
-                       txoData["publicKey"].asString(),
-                       newTxos,
-                       0);
+            coins->erase(db->getKey(getAddressKey(txoData["publicKey"].asString(),
+                                                  out.getId().toString()), 1));
         }
     };
 
+    // Mempool transactions spending the outputs of the block are invalid
+    // once it is gone
+    std::set<BigNum> removedOutputs;
+
     for(const output& out : tip.getCoinbaseTx().getOutputs()) {
         eraseUtxo(out, utxos);
+        removedOutputs.insert(out.getId());
     }
 
     transactions->erase(dbTransaction, tip.getCoinbaseTx().getId().toString());
 
-	std::set<transaction> replayTxs;
-
     for(const transaction& tx : tip.getTransactions()) {
         for(const output& out : tx.getOutputs()) {
             eraseUtxo(out, utxos);
+            removedOutputs.insert(out.getId());
         }
 
         for(const input& inp : tx.getInputs()) {
             inputs->erase(dbTransaction, inp.getId().toString());
 
             const std::string oldOutputId = inp.getOutputId().toString();
-            const dbOutput oldOutput = dbOutput(stxos->get(dbTransaction, oldOutputId));
+            const dbOutput oldOutput = dbOutput(spentOutputs->isObject() ?
+                                                (*spentOutputs)[oldOutputId] :
+                                                *coins->get(dbTransaction, stxos->getKey(oldOutputId)));
 
             eraseUtxo(oldOutput, stxos);
 
-            utxos->put(dbTransaction, oldOutputId, oldOutput.toJson());
+            coins->put(utxos->getKey(oldOutputId), oldOutput.toJson());
             const auto txoData = oldOutput.getData();
             if(!txoData["publicKey"].isNull()) {
-                Json::Value txos = utxos->get(dbTransaction,
-                                              txoData["publicKey"].asString(),
-                                              0);
-                txos.append(oldOutputId);
-                utxos->put(dbTransaction,
-                           txoData["publicKey"].asString(),
-                           txos,
-                           0);
+                coins->put(utxos->getKey(getAddressKey(txoData["publicKey"].asString(),
+                                                       oldOutputId), 1), Json::Value(true));
             }
         }
 
         transactions->erase(dbTransaction, tx.getId().toString());
-
-		replayTxs.insert(tx);
     }
 
-    const dbBlock tipDB = getBlockDB(dbTransaction, "tip");
+    if(reorging) {
+        reorgRemovedOutputs.insert(removedOutputs.begin(), removedOutputs.end());
+    } else {
+        unconfirmedTransactions->outputsRemoved(removedOutputs);
+    }
 
+    undo->erase(dbTransaction, tipId);
     blocks->erase(dbTransaction, std::to_string(tipDB.getHeight()), 0);
     blocks->put(dbTransaction, "tip", getBlockDB(dbTransaction,
                 tip.getPreviousBlockId().toString()).toJson());
 
     candidates->put(dbTransaction, tip.getId().toString(), tip.toJson());
 
-	unconfirmedTransactions.rescanMempool(dbTransaction, this);
+    // The coins written with this commit must match the new tip, as
+    // loadChain only replays blocks forward from the coins tip
+    coins->requireFlush();
 
-	for(const auto& tx : replayTxs) {
-		if(!std::get<0>(submitTransaction(dbTransaction, tx))) {
-            log->printf(LOG_LEVEL_WARN,
-                        "Blockchain::reverseBlock(): previously moved transaction is now invalid");
-        }
-	}
+    return tip.getTransactions();
 }
 
 CryptoKernel::Blockchain::dbTransaction CryptoKernel::Blockchain::getTransactionDB(
     Storage::Transaction* transaction, const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    const Json::Value jsonTx = transactions->get(transaction, id);
-    if(!jsonTx.isObject()) {
+    const auto jsonTx = transactions->getShared(transaction, id);
+    if(!jsonTx->isObject()) {
         throw NotFoundException("Transaction " + id);
     }
 
-    return dbTransaction(jsonTx);
+    return dbTransaction(*jsonTx);
 }
 
 CryptoKernel::Blockchain::transaction CryptoKernel::Blockchain::getTransaction(
     Storage::Transaction* transaction, const std::string& id) {
-    std::lock_guard<std::recursive_mutex> lock(chainLock);
-    const Json::Value jsonTx = transactions->get(transaction, id);
-    if(!jsonTx.isObject()) {
+    const auto jsonTx = transactions->getShared(transaction, id);
+    if(!jsonTx->isObject()) {
         throw NotFoundException("Transaction " + id);
     }
 
-    const dbTransaction tx = dbTransaction(jsonTx);
+    const dbTransaction tx = dbTransaction(*jsonTx);
     std::set<output> outputs;
     for(const BigNum& id : tx.getOutputs()) {
         outputs.insert(getOutput(transaction, id.toString()));
@@ -869,7 +1516,7 @@ CryptoKernel::Blockchain::transaction CryptoKernel::Blockchain::getTransaction(
 
     std::set<input> inps;
     for(const BigNum& id : tx.getInputs()) {
-        inps.insert(input(inputs->get(transaction, id.toString())));
+        inps.insert(input(*inputs->getShared(transaction, id.toString())));
     }
 
     return CryptoKernel::Blockchain::transaction(inps, outputs, tx.getTimestamp(),
@@ -878,8 +1525,18 @@ CryptoKernel::Blockchain::transaction CryptoKernel::Blockchain::getTransaction(
 
 void CryptoKernel::Blockchain::emptyDB() {
     blockdb.reset();
-    CryptoKernel::Storage::destroy("./blockdb");
-    blockdb.reset(new CryptoKernel::Storage("./blockdb"));
+    CryptoKernel::Storage::destroy(dbDir);
+    blockdb.reset(new CryptoKernel::Storage(dbDir, storageOptions));
+    enableFilters();
+    coins->clear();
+}
+
+void CryptoKernel::Blockchain::enableFilters() {
+    // Verifying a transaction expects its id and new output ids not to
+    // exist yet, filters answer those lookups without reading the disk
+    blockdb->enableFilter(*transactions);
+    blockdb->enableFilter(*utxos);
+    blockdb->enableFilter(*stxos);
 }
 
 CryptoKernel::Storage::Transaction* CryptoKernel::Blockchain::getTxHandle() {
@@ -888,102 +1545,23 @@ CryptoKernel::Storage::Transaction* CryptoKernel::Blockchain::getTxHandle() {
     return dbTx;
 }
 
-CryptoKernel::Blockchain::Mempool::Mempool() {
-	bytes = 0;
-}
-
-bool CryptoKernel::Blockchain::Mempool::insert(const transaction& tx) {
-	// Check if any inputs or outputs conflict
-	if(txs.find(tx.getId()) != txs.end()) {
-		return false;
-	}
-
-	for(const input& inp : tx.getInputs()) {
-		if(inputs.find(inp.getId()) != inputs.end()) {
-			return false;
-		}
-	}
-
-	for(const output& out : tx.getOutputs()) {
-		if(outputs.find(out.getId()) != outputs.end()) {
-			return false;
-		}
-	}
-
-	txs.insert(std::pair<BigNum, transaction>(tx.getId(), tx));
-
-    bytes += tx.size();
-
-	for(const input& inp : tx.getInputs()) {
-		inputs.insert(std::pair<BigNum, BigNum>(inp.getId(), tx.getId()));
-	}
-
-	for(const output& out : tx.getOutputs()) {
-		outputs.insert(std::pair<BigNum, BigNum>(out.getId(), tx.getId()));
-	}
-
-	return true;
-}
-
-void CryptoKernel::Blockchain::Mempool::remove(const transaction& tx) {
-	if(txs.find(tx.getId()) != txs.end()) {
-		txs.erase(tx.getId());
-
-        bytes -= tx.size();
-
-		for(const input& inp : tx.getInputs()) {
-			inputs.erase(inp.getId());
-		}
-
-		for(const output& out : tx.getOutputs()) {
-			outputs.erase(out.getId());
-		}
-	}
-}
-
-void CryptoKernel::Blockchain::Mempool::rescanMempool(Storage::Transaction* dbTx, Blockchain* blockchain) {
-	std::set<transaction> removals;
-
-	for(const auto& it : txs) {
-		if(!std::get<0>(blockchain->verifyTransaction(dbTx, it.second))) {
-			removals.insert(it.second);
-		}
-	}
-
-	for(const auto& tx : removals) {
-		remove(tx);
-	}
-}
-
-std::set<CryptoKernel::Blockchain::transaction> CryptoKernel::Blockchain::Mempool::getTransactions() const {
-	uint64_t totalSize = 0;
-	std::set<transaction> returning;
-
-	for(const auto& it : txs) {
-		if(totalSize + it.second.size() < 3.9 * 1024 * 1024) {
-			returning.insert(it.second);
-			totalSize += it.second.size();
-			continue;
-		}
-
-		break;
-	}
-
-	return returning;
-}
-
-unsigned int CryptoKernel::Blockchain::Mempool::count() const {
-    return txs.size();
-}
-
-unsigned int CryptoKernel::Blockchain::Mempool::size() const {
-    return bytes;
+CryptoKernel::Storage::Transaction* CryptoKernel::Blockchain::getReadTxHandle() {
+    // The snapshot is only taken under the commit lock, so it is never
+    // between a database commit and the coins cache commit. Afterwards the
+    // coins cache keeps what it needs, so no lock is held while it is open.
+    std::lock_guard<std::mutex> gate(commitGate);
+    std::shared_lock<std::shared_timed_mutex> lock(commitMutex);
+    return blockdb->beginReadOnly();
 }
 
 unsigned int CryptoKernel::Blockchain::mempoolCount() const {
-    return unconfirmedTransactions.count();
+    return unconfirmedTransactions->count();
 }
 
 unsigned int CryptoKernel::Blockchain::mempoolSize() const {
-    return unconfirmedTransactions.size();
+    return unconfirmedTransactions->size();
+}
+
+Json::Value CryptoKernel::Blockchain::getMempoolStats() {
+    return unconfirmedTransactions->getStats();
 }
@@ -22,6 +22,8 @@
 #include <set>
 #include <memory>
 #include <map>
+#include <atomic>
+#include <shared_mutex>
 
 #include "storage.h"
 #include "log.h"
@@ -31,10 +33,31 @@ namespace CryptoKernel {
 class Consensus;
 class Blockchain {
 public:
+    /**
+    * Constructs a blockchain backed by the database in the given directory
+    *
+    * @param GlobalLog the log to use
+    * @param dbDir the directory of the block database
+    * @param storageOptions the storage options of the block database,
+    *        see CryptoKernel::Storage::Storage. storageOptions["coinsCacheSize"]
+    *        also sets the memory budget in MiB of the coins cache, default
+    *        64, and storageOptions["coinsFlushInterval"] the blocks
+    *        connected before it is flushed, default 1000.
+    *        storageOptions["validationThreads"] sets the threads that
+    *        validate block transactions besides the submitting thread,
+    *        default one less than the hardware threads, and
+    *        storageOptions["importBatchSize"] the blocks submitBlocks
+    *        connects per database transaction, default 100
+    */
     Blockchain(CryptoKernel::Log* GlobalLog,
-               const std::string& dbDir);
+               const std::string& dbDir,
+               const Json::Value& storageOptions = Json::Value());
     ~Blockchain();
 
+    class CoinsCache;
+    class ValidationPool;
+    class Mempool;
+
     class InvalidElementException : public std::exception {
     public:
         InvalidElementException(const std::string& message) {
@@ -274,6 +297,19 @@ public:
     std::tuple<bool, bool> submitTransaction(const transaction& tx);
     std::tuple<bool, bool> submitBlock(const block& newBlock, bool genesisBlock = false);
 
+    /**
+    * Submits a run of blocks, each following the one before it, such as
+    * the blocks downloaded during initial sync. The blocks are connected
+    * in one database transaction per importBatchSize blocks, and the
+    * mempool is only rescanned once at the end. Blocks submitted before an
+    * invalid block are kept.
+    *
+    * @param newBlocks the blocks in chain order
+    * @return a tuple of whether every block was submitted and whether the
+    *         block that was not was invalid, as from submitBlock
+    */
+    std::tuple<bool, bool> submitBlocks(const std::vector<block>& newBlocks);
+
     block generateVerifyingBlock(const std::string& publicKey);
 
     block getBlock(Storage::Transaction* transaction, const std::string& id);
@@ -340,8 +376,25 @@ public:
 
     std::set<output> getSpentOutputs(const std::string& publicKey);
 
+    /**
+    * Returns the mempool transactions the next block template would hold,
+    * see getProjectedBlock
+    */
     std::set<transaction> getUnconfirmedTransactions();
 
+    /**
+    * Returns the block the mempool would currently produce. Transactions
+    * without unconfirmed parents are picked in order of fee rate until the
+    * template is full, those spending unconfirmed outputs wait for a later
+    * block.
+    *
+    * @return a json object with the height, previous block id and reward
+    *         of the block, the total fees and size of its transactions,
+    *         and each transaction's id, fee, size and fee rate in the order
+    *         they were picked
+    */
+    Json::Value getProjectedBlock();
+
     /**
     * Loads the chain from disk using the given consensus class
     *
@@ -353,9 +406,96 @@ public:
 
     Storage::Transaction* getTxHandle();
 
+    /**
+    * Returns a read-only database transaction over a snapshot of the
+    * current chain state. Unlike getTxHandle() it does not hold the chain
+    * lock, so blocks can be connected while it is open. Coin reads through
+    * it see the coins cache as of its snapshot, see CoinsCache.
+    *
+    * @return a read-only transaction over the blockchain database
+    */
+    Storage::Transaction* getReadTxHandle();
+
     unsigned int mempoolCount() const;
     unsigned int mempoolSize() const;
 
+    /**
+    * Returns the mempool counters, see Mempool::getStats. The mempool is
+    * limited to about mempoolSize MiB of memory (300 by default) and keeps
+    * transactions for mempoolExpiry hours (336 by default), both read from
+    * the storage options.
+    *
+    * @return a json object of mempool statistics
+    */
+    Json::Value getMempoolStats();
+
+    /**
+    * Enters or leaves initial sync mode. While syncing, block database
+    * commits are not synced to disk. The last tip known to be durable is
+    * recorded periodically, and if the node crashes during the sync the
+    * chain is rolled back to that tip on the next load.
+    *
+    * @param initialSync true to enter initial sync mode, false to leave it
+    */
+    void setInitialSync(const bool initialSync);
+
+    /**
+    * Returns true if the blockchain is in initial sync mode
+    */
+    bool isInitialSync();
+
+    /**
+    * Returns the statistics of the block database, see Storage::getStats.
+    * "coins" holds the hit rate, size and flush counters of the coins
+    * cache, and "validation" the counters of the pool validating block
+    * transactions, see ValidationPool::getStats. "readLatency" and
+    * "readLatencyDuringConnect" are histograms in microseconds of the
+    * public accessors, split by whether a block was being connected while
+    * they ran. "import" holds the blocks and transactions connected by
+    * submitBlocks, with their rates per second overall and for the last
+    * call.
+    *
+    * @return a json object of storage statistics
+    */
+    Json::Value getStorageStats();
+
+    /**
+    * Starts writing a consistent checkpoint of the block database to the
+    * given directory in the background, see Storage::checkpoint. The node
+    * keeps running while it is written, and the checkpoint can be used as
+    * the block database of a new node instead of syncing from peers.
+    *
+    * @param directory the directory to write the checkpoint to, which must
+    *        not exist
+    * @throw std::runtime_error if a checkpoint is already being written
+    */
+    void startCheckpoint(const std::string& directory);
+
+    /**
+    * Returns the progress of the last checkpoint
+    *
+    * @return a json object with the checkpoint directory, whether it is
+    *         running, the keys and bytes copied, the approximate total
+    *         bytes, the progress out of 1.0, start and finish times and an
+    *         error message if it failed
+    */
+    Json::Value getCheckpointStatus();
+
+    /**
+    * Queues a background compaction of tables of the block database, see
+    * Storage::compact
+    *
+    * @param tables the names of the tables to compact, such as "utxos" or
+    *        "blocks", or empty to compact the whole database
+    */
+    void compactStorage(const std::vector<std::string>& tables);
+
+    /**
+    * Returns the progress of block database compactions, see
+    * Storage::getCompactionStatus
+    */
+    Json::Value getCompactionStatus();
+
 private:
     std::unique_ptr<Storage::Table> blocks;
     std::unique_ptr<Storage::Table> candidates;
@@ -363,50 +503,92 @@ private:
     std::unique_ptr<Storage::Table> utxos;
     std::unique_ptr<Storage::Table> stxos;
     std::unique_ptr<Storage::Table> inputs;
+    std::unique_ptr<Storage::Table> undo;
 
     std::unique_ptr<Storage> blockdb;
+    std::string dbDir;
+    Json::Value storageOptions;
+
+    std::unique_ptr<CoinsCache> coins;
+    std::unique_ptr<ValidationPool> validationPool;
+
+    /* The public accessors read through a ReadView, a snapshot of the
+       last commit, and never take the chain lock. Only committing the
+       database together with the coins cache excludes them. */
+    class ReadView;
+    struct ReadStats;
+    std::shared_timed_mutex commitMutex;
+    std::mutex commitGate;
+    std::atomic<uint64_t> connects;
+    std::unique_ptr<ReadStats> readStats;
+    void commitChain(Storage::Transaction* dbTx, const bool flushing);
+
+    uint64_t importBatchSize;
+    bool importing;
+    std::mutex importMutex;
+    Json::Value importStats;
+    void connectCoins(Storage::Transaction* dbTx, const transaction& tx,
+                      Json::Value* spentOutputs = nullptr);
+
+    static std::string getAddressKey(const std::string& publicKey, const std::string& outputId);
+    std::set<output> getAddressOutputs(Storage::Table* table, const std::string& publicKey);
+    void migrateAddressIndex();
+    void commitCoins(Storage::Transaction* dbTx);
+    bool replayCoins();
+
+    bool initialSync;
+    uint64_t blocksSinceDurable;
+    Storage::Durability normalDurability;
+    void markDurableTip();
+    bool recoverDurableTip();
+
+    void checkpointFunc(const std::string directory);
+    std::unique_ptr<std::thread> checkpointThread;
+    std::mutex checkpointMutex;
+    Json::Value checkpointStatus;
+    bool cancelCheckpoint;
+
     BigNum genesisBlockId;
     Log *log;
 
-	class Mempool {
-		public:
-			Mempool();
-
-			bool insert(const transaction& tx);
-			void remove(const transaction& tx);
-			std::set<transaction> getTransactions() const;
-			void rescanMempool(Storage::Transaction* dbTx, Blockchain* blockchain);
-
-            unsigned int count() const;
-            unsigned int size() const;
-
-		private:
-			std::map<BigNum, transaction> txs;
-			std::map<BigNum, BigNum> outputs;
-			std::map<BigNum, BigNum> inputs;
-
-            unsigned int bytes;
-	};
-
-    Mempool unconfirmedTransactions;
+    std::unique_ptr<Mempool> unconfirmedTransactions;
 
+    /* mempoolInputs lets inputs spend outputs of transactions in the
+       mempool, for transactions entering it */
     std::tuple<bool, bool> verifyTransaction(Storage::Transaction* dbTransaction, const transaction& tx,
-                           const bool coinbaseTx = false);
+                           const bool coinbaseTx = false, const bool mempoolInputs = false);
     void confirmTransaction(Storage::Transaction* dbTransaction, const transaction& tx,
-                            const BigNum& confirmingBlock, const bool coinbaseTx = false);
+                            const BigNum& confirmingBlock, Json::Value& spentOutputs,
+                            const bool coinbaseTx = false);
     uint64_t getTransactionFee(const transaction& tx);
-    uint64_t calculateTransactionFee(Storage::Transaction* dbTx, const transaction& tx);
+    uint64_t calculateTransactionFee(Storage::Transaction* dbTx, const transaction& tx,
+                                     const bool mempoolInputs = false);
     bool status;
-    void reverseBlock(Storage::Transaction* dbTransaction);
+    std::set<transaction> reverseBlock(Storage::Transaction* dbTransaction);
     bool reorgChain(Storage::Transaction* dbTransaction, const BigNum& newTipId);
+
+    /* While a reorg runs, the outputs it removes and the blocks it
+       connects are collected here and applied to the mempool once it
+       has succeeded */
+    bool reorging;
+    std::set<BigNum> reorgRemovedOutputs;
+    std::vector<block> reorgConnectedBlocks;
+    void endReorg();
     std::recursive_mutex chainLock;
     virtual uint64_t getBlockReward(const uint64_t height) = 0;
     virtual std::string getCoinbaseOwner(const std::string& publicKey) = 0;
     Consensus* consensus;
     void emptyDB();
+
+    /* Enables the Bloom filters of the block database, called whenever
+       blockdb is opened */
+    void enableFilters();
     std::tuple<bool, bool> submitTransaction(Storage::Transaction* dbTx, const transaction& tx);
     std::tuple<bool, bool> submitBlock(Storage::Transaction* dbTx, const block& newBlock,
                      bool genesisBlock = false);
+    std::tuple<bool, bool> applyBlock(Storage::Transaction* dbTx, const block& newBlock,
+                     bool genesisBlock);
+    void prefetchBlock(Storage::Transaction* dbTx, const block& newBlock);
     friend class Consensus;
     friend class ContractRunner;
 };
@@ -0,0 +1,425 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctime>
+
+#include "blockchaincoinscache.h"
+
+/* Approximate bytes used by an entry besides its key and value: the hash
+   node, the entry and the shared value's control block */
+static const size_t entryOverhead = 96;
+
+CryptoKernel::Blockchain::CoinsCache::CoinsCache(const uint64_t budget,
+        const uint64_t flushInterval) {
+    this->budget = budget;
+    this->flushInterval = flushInterval;
+    bytes = 0;
+    blocksSinceFlush = 0;
+    flushRequired = false;
+    hits = 0;
+    misses = 0;
+    writesAvoided = 0;
+    flushes = 0;
+    flushedPuts = 0;
+    flushedErases = 0;
+    flushMicros = 0;
+}
+
+size_t CryptoKernel::Blockchain::CoinsCache::entrySize(const std::string& key,
+        const Json::Value& value) {
+    return key.size() + Storage::toBinary(value).size() + entryOverhead;
+}
+
+const CryptoKernel::Blockchain::CoinsCache::Entry* CryptoKernel::Blockchain::CoinsCache::find(
+    const std::string& key, const bool committed, const uint64_t sequence) {
+    // The first commit after the reader's snapshot that changed the key
+    // holds its entry as of the snapshot
+    if(committed) {
+        for(const Version& version : history) {
+            if(version.sequence <= sequence) {
+                continue;
+            }
+
+            const auto it = version.before.find(key);
+            if(it != version.before.end()) {
+                return it->second.existed ? &it->second.entry : nullptr;
+            }
+        }
+    }
+
+    // The first change to a key since the last commit holds its committed
+    // entry, if it had one
+    if(committed) {
+        const auto it = journaled.find(key);
+        if(it != journaled.end()) {
+            const Change& change = journal[it->second];
+            return change.existed ? &change.entry : nullptr;
+        }
+    }
+
+    const auto it = entries.find(key);
+    return it != entries.end() ? &it->second : nullptr;
+}
+
+std::shared_ptr<const Json::Value> CryptoKernel::Blockchain::CoinsCache::get(
+    Storage::Transaction* dbTx, const std::string& key) {
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        const Entry* entry = find(key, dbTx->isReadOnly(), dbTx->getSequence());
+        if(entry != nullptr) {
+            hits++;
+            return entry->value;
+        }
+    }
+
+    misses++;
+    const std::shared_ptr<const Json::Value> value = dbTx->getShared(key);
+
+    if(!dbTx->isReadOnly()) {
+        const size_t size = entrySize(key, *value);
+
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        if(entries.find(key) == entries.end()) {
+            entries[key] = {value, size, false, false};
+            bytes += size;
+        }
+    }
+
+    return value;
+}
+
+std::vector<std::shared_ptr<const Json::Value>> CryptoKernel::Blockchain::CoinsCache::getMany(
+            Storage::Transaction* dbTx, const std::vector<std::string>& keys) {
+    std::vector<std::shared_ptr<const Json::Value>> values(keys.size());
+    std::vector<std::string> missing;
+    std::vector<size_t> missingPos;
+
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        for(size_t i = 0; i < keys.size(); i++) {
+            const Entry* entry = find(keys[i], dbTx->isReadOnly(), dbTx->getSequence());
+            if(entry != nullptr) {
+                values[i] = entry->value;
+            } else {
+                missing.push_back(keys[i]);
+                missingPos.push_back(i);
+            }
+        }
+    }
+
+    hits += keys.size() - missing.size();
+    if(missing.empty()) {
+        return values;
+    }
+    misses += missing.size();
+
+    const std::vector<Json::Value> read = dbTx->getMany(missing);
+    std::vector<size_t> sizes(missing.size());
+    for(size_t i = 0; i < missing.size(); i++) {
+        values[missingPos[i]] = std::make_shared<const Json::Value>(read[i]);
+        if(!dbTx->isReadOnly()) {
+            sizes[i] = entrySize(missing[i], read[i]);
+        }
+    }
+
+    if(!dbTx->isReadOnly()) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        for(size_t i = 0; i < missing.size(); i++) {
+            if(entries.find(missing[i]) == entries.end()) {
+                entries[missing[i]] = {values[missingPos[i]], sizes[i], false, false};
+                bytes += sizes[i];
+            }
+        }
+    }
+
+    return values;
+}
+
+bool CryptoKernel::Blockchain::CoinsCache::contains(const std::string& key) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return entries.find(key) != entries.end();
+}
+
+void CryptoKernel::Blockchain::CoinsCache::record(const std::string& key) {
+    if(journaled.find(key) == journaled.end()) {
+        journaled[key] = journal.size();
+    }
+
+    const auto it = entries.find(key);
+    if(it != entries.end()) {
+        journal.push_back({key, true, it->second});
+    } else {
+        journal.push_back({key, false, {nullptr, 0, false, false}});
+    }
+}
+
+void CryptoKernel::Blockchain::CoinsCache::set(const std::string& key, const Entry& entry) {
+    const auto it = entries.find(key);
+    if(it != entries.end()) {
+        bytes -= it->second.size;
+        it->second = entry;
+    } else {
+        entries[key] = entry;
+    }
+    bytes += entry.size;
+
+    if(entry.dirty) {
+        dirtyKeys.insert(key);
+    } else {
+        dirtyKeys.erase(key);
+    }
+}
+
+void CryptoKernel::Blockchain::CoinsCache::remove(const std::string& key) {
+    const auto it = entries.find(key);
+    if(it != entries.end()) {
+        bytes -= it->second.size;
+        entries.erase(it);
+    }
+    dirtyKeys.erase(key);
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<const Json::Value>>>
+CryptoKernel::Blockchain::CoinsCache::getDirty(const std::string& begin,
+        const std::string& end, const bool committed) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+
+    // Keys changed since the last commit may have been dirty before it,
+    // so they are checked against their committed entries
+    std::set<std::string> keys;
+    for(auto it = dirtyKeys.lower_bound(begin); it != dirtyKeys.end() && *it < end; it++) {
+        keys.insert(*it);
+    }
+    if(committed) {
+        for(const auto& change : journaled) {
+            if(change.first >= begin && change.first < end) {
+                keys.insert(change.first);
+            }
+        }
+    }
+
+    std::vector<std::pair<std::string, std::shared_ptr<const Json::Value>>> returning;
+    for(const std::string& key : keys) {
+        const Entry* entry = find(key, committed);
+        if(entry != nullptr && entry->dirty) {
+            returning.push_back(std::make_pair(key, entry->value));
+        }
+    }
+
+    return returning;
+}
+
+void CryptoKernel::Blockchain::CoinsCache::put(const std::string& key,
+        const Json::Value& value, const bool created) {
+    std::shared_ptr<const Json::Value> shared(new Json::Value(value));
+    const size_t size = entrySize(key, value);
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    record(key);
+
+    // A key known to be missing from the database, or already fresh,
+    // stays fresh. A key that was never read may exist, so it is not
+    // unless the caller knows it was just created.
+    bool fresh = created;
+    const auto it = entries.find(key);
+    if(it != entries.end()) {
+        fresh = it->second.fresh || (!it->second.dirty && it->second.value->isNull());
+    }
+
+    set(key, {shared, size, true, fresh});
+}
+
+void CryptoKernel::Blockchain::CoinsCache::erase(const std::string& key) {
+    static const std::shared_ptr<const Json::Value> nullValue(new Json::Value());
+    const size_t size = entrySize(key, *nullValue);
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    record(key);
+
+    const auto it = entries.find(key);
+    if(it != entries.end() && it->second.fresh) {
+        // The key was never written to the database, so it is simply
+        // known to be missing again
+        set(key, {nullValue, size, false, false});
+        writesAvoided++;
+    } else {
+        set(key, {nullValue, size, true, false});
+    }
+}
+
+size_t CryptoKernel::Blockchain::CoinsCache::savepoint() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return journal.size();
+}
+
+void CryptoKernel::Blockchain::CoinsCache::rollbackTo(const size_t savepoint) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    while(journal.size() > savepoint) {
+        const Change& change = journal.back();
+        const auto it = journaled.find(change.key);
+        if(it != journaled.end() && it->second == journal.size() - 1) {
+            journaled.erase(it);
+        }
+
+        if(change.existed) {
+            set(change.key, change.entry);
+        } else {
+            remove(change.key);
+        }
+        journal.pop_back();
+    }
+}
+
+void CryptoKernel::Blockchain::CoinsCache::commit(const uint64_t sequence,
+        const uint64_t oldestSnapshot) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if(oldestSnapshot < sequence) {
+        Version version;
+        version.sequence = sequence;
+        for(const auto& change : journaled) {
+            version.before.emplace(change.first, journal[change.second]);
+        }
+        history.push_back(std::move(version));
+    }
+
+    journal.clear();
+    journaled.clear();
+
+    while(!history.empty() && history.front().sequence <= oldestSnapshot) {
+        history.pop_front();
+    }
+}
+
+void CryptoKernel::Blockchain::CoinsCache::abort() {
+    rollbackTo(0);
+}
+
+void CryptoKernel::Blockchain::CoinsCache::recordBlock() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    blocksSinceFlush++;
+}
+
+void CryptoKernel::Blockchain::CoinsCache::requireFlush() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    flushRequired = true;
+}
+
+bool CryptoKernel::Blockchain::CoinsCache::needsFlush() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return flushRequired || bytes >= budget ||
+           (flushInterval > 0 && blocksSinceFlush >= flushInterval);
+}
+
+void CryptoKernel::Blockchain::CoinsCache::flush(Storage::Transaction* dbTx) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    flushStart = std::chrono::steady_clock::now();
+
+    uint64_t puts = 0;
+    uint64_t erases = 0;
+    for(const auto& entry : entries) {
+        if(!entry.second.dirty) {
+            continue;
+        }
+
+        if(entry.second.value->isNull()) {
+            dbTx->erase(entry.first);
+            erases++;
+        } else {
+            dbTx->put(entry.first, *entry.second.value);
+            puts++;
+        }
+    }
+
+    lastFlush = Json::Value();
+    lastFlush["puts"] = static_cast<Json::UInt64>(puts);
+    lastFlush["erases"] = static_cast<Json::UInt64>(erases);
+    lastFlush["blocks"] = static_cast<Json::UInt64>(blocksSinceFlush);
+    lastFlush["bytes"] = static_cast<Json::UInt64>(bytes);
+}
+
+void CryptoKernel::Blockchain::CoinsCache::flushed() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    for(auto& entry : entries) {
+        entry.second.dirty = false;
+        entry.second.fresh = false;
+    }
+    dirtyKeys.clear();
+
+    // Every entry is clean now, so an oversized cache is emptied rather
+    // than flushed again on the next block. Older readers may not see the
+    // flush in their snapshot, so the last commit keeps what they need.
+    if(bytes >= budget) {
+        if(!history.empty()) {
+            for(const auto& entry : entries) {
+                history.back().before.emplace(entry.first,
+                                              Change{entry.first, true, entry.second});
+            }
+        }
+
+        entries.clear();
+        bytes = 0;
+    }
+
+    const uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - flushStart).count();
+    flushes++;
+    flushedPuts += lastFlush["puts"].asUInt64();
+    flushedErases += lastFlush["erases"].asUInt64();
+    flushMicros += micros;
+    lastFlush["micros"] = static_cast<Json::UInt64>(micros);
+    lastFlush["finished"] = static_cast<Json::UInt64>(std::time(0));
+
+    blocksSinceFlush = 0;
+    flushRequired = false;
+}
+
+void CryptoKernel::Blockchain::CoinsCache::clear() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    entries.clear();
+    dirtyKeys.clear();
+    journal.clear();
+    journaled.clear();
+    history.clear();
+    bytes = 0;
+    blocksSinceFlush = 0;
+    flushRequired = false;
+}
+
+Json::Value CryptoKernel::Blockchain::CoinsCache::getStats() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    const uint64_t lookups = hits + misses;
+
+    Json::Value returning;
+    returning["hits"] = static_cast<Json::UInt64>(hits);
+    returning["misses"] = static_cast<Json::UInt64>(misses);
+    returning["hitRate"] = lookups > 0 ? static_cast<double>(hits) / lookups : 0.0;
+    returning["entries"] = static_cast<Json::UInt64>(entries.size());
+    returning["dirty"] = static_cast<Json::UInt64>(dirtyKeys.size());
+    returning["bytes"] = static_cast<Json::UInt64>(bytes);
+    returning["budget"] = static_cast<Json::UInt64>(budget);
+    returning["flushInterval"] = static_cast<Json::UInt64>(flushInterval);
+    returning["blocksSinceFlush"] = static_cast<Json::UInt64>(blocksSinceFlush);
+    returning["versions"] = static_cast<Json::UInt64>(history.size());
+    returning["writesAvoided"] = static_cast<Json::UInt64>(writesAvoided);
+    returning["flushes"] = static_cast<Json::UInt64>(flushes);
+    returning["flushedPuts"] = static_cast<Json::UInt64>(flushedPuts);
+    returning["flushedErases"] = static_cast<Json::UInt64>(flushedErases);
+    returning["flushMicros"] = static_cast<Json::UInt64>(flushMicros);
+    returning["lastFlush"] = lastFlush;
+
+    return returning;
+}
@@ -0,0 +1,242 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOCKCHAINCOINSCACHE_H_INCLUDED
+#define BLOCKCHAINCOINSCACHE_H_INCLUDED
+
+#include <unordered_map>
+#include <set>
+#include <deque>
+#include <atomic>
+
+#include "blockchain.h"
+
+namespace CryptoKernel {
+/**
+* A write-back cache of the coin tables, utxos and stxos, kept above the
+* block database. Spends and new outputs are applied to the cache only,
+* and the cache is written to the database in one large batch once it
+* outgrows its memory budget or enough blocks have been connected since
+* the last flush.
+*
+* Entries are keyed by database key. A dirty entry differs from the
+* database. A fresh entry is a dirty entry whose key does not exist in the
+* database, so erasing it, such as spending an output created since the
+* last flush, drops the write entirely instead of writing and then erasing
+* the key.
+*
+* Changes are journaled until commit() so they can be undone with the
+* database transaction they were made in, through savepoints or abort().
+* The cache is only written by the thread holding the chain lock but may
+* be read from any thread. Reads with a read-only transaction see the
+* cache as of the commit its snapshot was taken at, so they never observe
+* a block that is still being connected or one connected after their
+* snapshot. The entries each commit changes or drops are kept as they were
+* before it for as long as an older read-only transaction is open.
+*/
+class Blockchain::CoinsCache {
+public:
+    /**
+    * Constructs an empty cache
+    *
+    * @param budget the approximate memory in bytes the entries may use
+    *        before the cache is flushed
+    * @param flushInterval the blocks connected before the cache is
+    *        flushed, zero for no limit
+    */
+    CoinsCache(const uint64_t budget, const uint64_t flushInterval);
+
+    /**
+    * Reads a key through the cache. Keys missing from the cache are read
+    * with the given transaction, and are cached unless it is read-only,
+    * as a read-only transaction may see an older database than the cache.
+    * A read-only transaction reads the cache as of the commit its snapshot
+    * was taken at.
+    *
+    * @param dbTx the transaction to read missing keys with
+    * @param key the database key to read
+    * @return the value of the key, a null value if it does not exist
+    */
+    std::shared_ptr<const Json::Value> get(Storage::Transaction* dbTx,
+                                           const std::string& key);
+
+    /**
+    * Reads many keys through the cache, reading the keys it misses from
+    * the database in one batch, see Storage::Transaction::getMany
+    */
+    std::vector<std::shared_ptr<const Json::Value>> getMany(Storage::Transaction* dbTx,
+            const std::vector<std::string>& keys);
+
+    /**
+    * Returns true if the key is cached, so reading it needs no database
+    * read
+    */
+    bool contains(const std::string& key);
+
+    /**
+    * Returns the dirty entries with keys from begin up to but not
+    * including end in key order, so range scans of the database can be
+    * merged with the writes not flushed yet. Erased keys have null values.
+    *
+    * @param committed true to return the entries that were dirty as of the
+    *        last commit(), for scans with a read-only transaction taken
+    *        since, optional
+    */
+    std::vector<std::pair<std::string, std::shared_ptr<const Json::Value>>> getDirty(
+                const std::string& begin, const std::string& end,
+                const bool committed = false);
+
+    /**
+    * Writes a key
+    *
+    * @param key the database key to write
+    * @param value the value to write
+    * @param created true if the caller knows the key does not exist in the
+    *        database even though it was never read, such as a key derived
+    *        from a new output id, so the entry can be fresh, optional
+    */
+    void put(const std::string& key, const Json::Value& value, const bool created = false);
+    void erase(const std::string& key);
+
+    /**
+    * Marks the journal so changes made after it can be undone, see
+    * Storage::Transaction::savepoint
+    */
+    size_t savepoint();
+
+    /**
+    * Undoes every change made since the given savepoint
+    */
+    void rollbackTo(const size_t savepoint);
+
+    /**
+    * Keeps the journaled changes, called once the database transaction
+    * they were made in has committed. The entries they replaced are kept
+    * for the read-only transactions older than the commit.
+    *
+    * @param sequence the database commit sequence number of the commit
+    * @param oldestSnapshot the sequence number the oldest open read-only
+    *        transaction reads at, see Storage::getOldestSnapshot
+    */
+    void commit(const uint64_t sequence, const uint64_t oldestSnapshot);
+
+    /**
+    * Undoes every journaled change
+    */
+    void abort();
+
+    /**
+    * Records that a block was connected
+    */
+    void recordBlock();
+
+    /**
+    * Makes the next needsFlush() return true, used when the database
+    * must hold the current coins, such as after blocks were disconnected
+    */
+    void requireFlush();
+
+    /**
+    * Returns true if the cache is over its memory budget, the flush
+    * interval was reached or a flush was required
+    */
+    bool needsFlush();
+
+    /**
+    * Stages every dirty entry as a write in the given transaction. The
+    * entries stay dirty until flushed() is called after the transaction
+    * commits.
+    *
+    * @param dbTx the write transaction to stage the writes in
+    */
+    void flush(Storage::Transaction* dbTx);
+
+    /**
+    * Marks the entries staged by flush() as clean. If the cache is still
+    * over its budget every entry is dropped.
+    */
+    void flushed();
+
+    /**
+    * Drops every entry, used when the database is replaced
+    */
+    void clear();
+
+    /**
+    * Returns the cache counters as json: hits, misses and hit rate,
+    * entries, dirty entries, bytes, budget, blocks since the last flush,
+    * commits kept for older read-only transactions,
+    * writes avoided by fresh entries, flushes with the keys written and
+    * time taken, and the most recent flush
+    */
+    Json::Value getStats();
+
+private:
+    struct Entry {
+        std::shared_ptr<const Json::Value> value;
+        size_t size;
+        bool dirty;
+        bool fresh;
+    };
+
+    struct Change {
+        std::string key;
+        bool existed;
+        Entry entry;
+    };
+
+    /* The entries a commit changed or dropped as they were before it,
+       kept while a read-only transaction older than the commit is open */
+    struct Version {
+        uint64_t sequence;
+        std::unordered_map<std::string, Change> before;
+    };
+
+    const Entry* find(const std::string& key, const bool committed,
+                      const uint64_t sequence = UINT64_MAX);
+    void set(const std::string& key, const Entry& entry);
+    void remove(const std::string& key);
+    void record(const std::string& key);
+    static size_t entrySize(const std::string& key, const Json::Value& value);
+
+    std::unordered_map<std::string, Entry> entries;
+    std::set<std::string> dirtyKeys;
+    std::vector<Change> journal;
+    std::unordered_map<std::string, size_t> journaled;
+    std::deque<Version> history;
+
+    uint64_t budget;
+    uint64_t flushInterval;
+    uint64_t bytes;
+    uint64_t blocksSinceFlush;
+    bool flushRequired;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    uint64_t writesAvoided;
+    uint64_t flushes;
+    uint64_t flushedPuts;
+    uint64_t flushedErases;
+    uint64_t flushMicros;
+    Json::Value lastFlush;
+    std::chrono::steady_clock::time_point flushStart;
+
+    std::mutex cacheMutex;
+};
+}
+
+#endif // BLOCKCHAINCOINSCACHE_H_INCLUDED
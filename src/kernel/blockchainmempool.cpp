@@ -0,0 +1,572 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+#include "blockchainmempool.h"
+
+/* Bytes of transactions the mempool puts in a block template */
+static const uint64_t maxBlockBytes = static_cast<uint64_t>(3.9 * 1024 * 1024);
+
+/* Unconfirmed ancestors, or descendants, a transaction may have counting
+   itself, and their total bytes */
+static const uint64_t maxChainLength = 25;
+static const uint64_t maxChainBytes = 101 * 1024;
+
+/* Fee per byte added to the rate of an evicted package to get the new
+   minimum, so a replacement must pay more than what it displaced */
+static const double incrementalFeeRate = 1.0;
+
+/* Seconds for the minimum fee rate to halve once blocks are connected */
+static const uint64_t minFeeHalfLife = 12 * 60 * 60;
+
+/* Heap memory is estimated from the layout of the containers: glibc adds a
+   16 byte header to every allocation, a red-black tree node holds three
+   pointers and a colour before its value, and a BigNum owns an OpenSSL
+   BIGNUM and its words, four of them for a 256 bit id */
+static const uint64_t mallocOverhead = 16;
+static const uint64_t treeNodeOverhead = 4 * sizeof(void*) + mallocOverhead;
+static const uint64_t bigNumHeap = 24 + mallocOverhead + 4 * sizeof(uint64_t) + mallocOverhead;
+static const uint64_t idSize = sizeof(CryptoKernel::BigNum) + bigNumHeap;
+
+static uint64_t jsonHeap(const Json::Value& value) {
+    if(value.isString()) {
+        // The length prefix, the characters and a terminator
+        return sizeof(unsigned) + value.asString().size() + 1 + mallocOverhead;
+    }
+
+    if(value.isObject() || value.isArray()) {
+        // Members are nodes of a heap allocated std::map keyed by a
+        // CZString, which owns a copy of the member name
+        uint64_t bytes = sizeof(std::map<int, int>) + mallocOverhead;
+        for(auto it = value.begin(); it != value.end(); ++it) {
+            bytes += treeNodeOverhead + 2 * sizeof(void*) + sizeof(Json::Value) + jsonHeap(*it);
+            if(value.isObject()) {
+                bytes += it.name().size() + 1 + mallocOverhead;
+            }
+        }
+
+        return bytes;
+    }
+
+    return 0;
+}
+
+uint64_t CryptoKernel::Blockchain::Mempool::entryMemory(const Entry& entry,
+        const bool scripted) {
+    const std::set<input> txInputs = entry.tx.getInputs();
+    const std::set<output> txOutputs = entry.tx.getOutputs();
+
+    // The node of txs and what the transaction owns
+    uint64_t bytes = treeNodeOverhead + idSize + sizeof(Entry) + bigNumHeap;
+    for(const input& inp : txInputs) {
+        bytes += treeNodeOverhead + sizeof(input) + 2 * bigNumHeap + jsonHeap(inp.getData());
+    }
+    for(const output& out : txOutputs) {
+        bytes += treeNodeOverhead + sizeof(output) + bigNumHeap + jsonHeap(out.getData());
+    }
+
+    // Its nodes in inputs, spends and outputs, the links to its parents
+    // in both directions, and its nodes in the rate and time indexes
+    bytes += (2 * txInputs.size() + txOutputs.size()) * (treeNodeOverhead + 2 * idSize);
+    bytes += 2 * entry.parents.size() * (treeNodeOverhead + idSize);
+    bytes += 3 * (treeNodeOverhead + sizeof(std::pair<double, BigNum>) + bigNumHeap);
+    if(scripted) {
+        bytes += treeNodeOverhead + idSize;
+    }
+
+    return bytes;
+}
+
+/* Transactions are ranked by fee per byte. Sizes are never zero, as every
+   transaction has at least one output. */
+static double feeRate(const uint64_t fee, const uint64_t size) {
+    return static_cast<double>(fee) / std::max(size, static_cast<uint64_t>(1));
+}
+
+CryptoKernel::Blockchain::Mempool::Mempool(const uint64_t maxMemory, const uint64_t expiry) {
+    this->maxMemory = maxMemory;
+    this->expiry = expiry;
+    bytes = 0;
+    memory = 0;
+    rollingMinFeeRate = 0;
+    lastRollingUpdate = 0;
+    blockSinceEviction = false;
+    conflicts = 0;
+    lowFee = 0;
+    chainLimit = 0;
+    evicted = 0;
+    expired = 0;
+}
+
+bool CryptoKernel::Blockchain::Mempool::insert(const transaction& tx, const uint64_t fee,
+        const bool scripted) {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    // Check if any inputs or outputs conflict
+    if(txs.find(tx.getId()) != txs.end()) {
+        conflicts++;
+        return false;
+    }
+
+    // Including with itself, by spending one output twice
+    std::set<BigNum> spent;
+    for(const input& inp : tx.getInputs()) {
+        if(inputs.find(inp.getId()) != inputs.end() ||
+           spends.find(inp.getOutputId()) != spends.end() ||
+           !spent.insert(inp.getOutputId()).second) {
+            conflicts++;
+            return false;
+        }
+    }
+
+    for(const output& out : tx.getOutputs()) {
+        if(outputs.find(out.getId()) != outputs.end()) {
+            conflicts++;
+            return false;
+        }
+    }
+
+    const uint64_t size = tx.size();
+    const uint64_t now = std::time(0);
+    if(feeRate(fee, size) < minFeeRate(now)) {
+        lowFee++;
+        return false;
+    }
+
+    Entry entry = {tx, fee, size, {}, {}, size, fee, size, now, 0};
+
+    // Entries creating the outputs this one spends are its parents
+    for(const input& inp : tx.getInputs()) {
+        const auto creator = outputs.find(inp.getOutputId());
+        if(creator != outputs.end()) {
+            entry.parents.insert(creator->second);
+        }
+    }
+
+    // Every ancestor gains a descendant, so each of their descendant
+    // packages must stay within the limits too
+    std::set<BigNum> ancestors = entry.parents;
+    for(const BigNum& parent : entry.parents) {
+        const std::set<BigNum> related = getRelated(parent, true);
+        ancestors.insert(related.begin(), related.end());
+    }
+
+    uint64_t ancestorSize = size;
+    bool withinLimits = ancestors.size() + 1 <= maxChainLength;
+    for(const BigNum& id : ancestors) {
+        const Entry& ancestor = txs.at(id);
+        ancestorSize += ancestor.size;
+        if(getRelated(id, false).size() + 2 > maxChainLength ||
+           ancestor.descendantSize + size > maxChainBytes) {
+            withinLimits = false;
+        }
+    }
+
+    if(!withinLimits || ancestorSize > maxChainBytes) {
+        chainLimit++;
+        return false;
+    }
+
+    entry.ancestorSize = ancestorSize;
+    entry.memory = entryMemory(entry, scripted);
+    txs.insert(std::pair<BigNum, Entry>(tx.getId(), entry));
+
+    bytes += size;
+    memory += entry.memory;
+
+    for(const input& inp : tx.getInputs()) {
+        inputs.insert(std::pair<BigNum, BigNum>(inp.getId(), tx.getId()));
+        spends.insert(std::pair<BigNum, BigNum>(inp.getOutputId(), tx.getId()));
+    }
+
+    for(const output& out : tx.getOutputs()) {
+        outputs.insert(std::pair<BigNum, BigNum>(out.getId(), tx.getId()));
+    }
+
+    for(const BigNum& parent : entry.parents) {
+        txs.at(parent).children.insert(tx.getId());
+    }
+
+    if(scripted) {
+        this->scripted.insert(tx.getId());
+    }
+
+    byFeeRate.insert(std::make_pair(feeRate(fee, size), tx.getId()));
+    byDescendantRate.insert(std::make_pair(feeRate(fee, size), tx.getId()));
+    byTime.insert(std::make_pair(now, tx.getId()));
+
+    ancestors.insert(tx.getId());
+    refresh(ancestors);
+
+    trim();
+
+    return txs.find(tx.getId()) != txs.end();
+}
+
+void CryptoKernel::Blockchain::Mempool::remove(const transaction& tx) {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    erase(tx.getId());
+}
+
+Json::Value CryptoKernel::Blockchain::Mempool::getOutput(const BigNum& outputId) const {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    const auto creator = outputs.find(outputId);
+    if(creator == outputs.end()) {
+        return Json::Value();
+    }
+
+    for(const output& out : txs.at(creator->second).tx.getOutputs()) {
+        if(out.getId() == outputId) {
+            return dbOutput(out, creator->second).toJson();
+        }
+    }
+
+    return Json::Value();
+}
+
+std::set<CryptoKernel::BigNum> CryptoKernel::Blockchain::Mempool::getRelated(
+    const BigNum& txid, const bool ancestors) const {
+    std::set<BigNum> returning;
+    std::vector<BigNum> pending = {txid};
+    while(!pending.empty()) {
+        const Entry& entry = txs.at(pending.back());
+        pending.pop_back();
+
+        for(const BigNum& id : ancestors ? entry.parents : entry.children) {
+            if(returning.insert(id).second) {
+                pending.push_back(id);
+            }
+        }
+    }
+
+    return returning;
+}
+
+void CryptoKernel::Blockchain::Mempool::refresh(const std::set<BigNum>& txids) {
+    // Package totals are summed again rather than adjusted, so they stay
+    // right whichever order the members of a package leave in
+    for(const BigNum& id : txids) {
+        Entry& entry = txs.at(id);
+        byDescendantRate.erase(std::make_pair(feeRate(entry.descendantFee, entry.descendantSize),
+                                              id));
+
+        entry.descendantFee = entry.fee;
+        entry.descendantSize = entry.size;
+        for(const BigNum& descendant : getRelated(id, false)) {
+            entry.descendantFee += txs.at(descendant).fee;
+            entry.descendantSize += txs.at(descendant).size;
+        }
+
+        byDescendantRate.insert(std::make_pair(feeRate(entry.descendantFee, entry.descendantSize),
+                                               id));
+    }
+}
+
+void CryptoKernel::Blockchain::Mempool::erase(const BigNum& txid) {
+    const auto it = txs.find(txid);
+    if(it == txs.end()) {
+        return;
+    }
+
+    // Only the descendant packages of its ancestors include it
+    const std::set<BigNum> affected = getRelated(txid, true);
+
+    const Entry& entry = it->second;
+    bytes -= entry.size;
+    memory -= entry.memory;
+
+    for(const input& inp : entry.tx.getInputs()) {
+        inputs.erase(inp.getId());
+        spends.erase(inp.getOutputId());
+    }
+
+    for(const output& out : entry.tx.getOutputs()) {
+        outputs.erase(out.getId());
+    }
+
+    for(const BigNum& parent : entry.parents) {
+        txs.at(parent).children.erase(txid);
+    }
+
+    for(const BigNum& child : entry.children) {
+        txs.at(child).parents.erase(txid);
+    }
+
+    byFeeRate.erase(std::make_pair(feeRate(entry.fee, entry.size), txid));
+    byDescendantRate.erase(std::make_pair(feeRate(entry.descendantFee, entry.descendantSize),
+                                          txid));
+    byTime.erase(std::make_pair(entry.time, txid));
+    scripted.erase(txid);
+    txs.erase(it);
+
+    refresh(affected);
+}
+
+std::vector<CryptoKernel::Blockchain::transaction> CryptoKernel::Blockchain::Mempool::evict(
+    const BigNum& txid) {
+    // Transactions spending the outputs of an evicted transaction are
+    // evicted with it, children first. A child's ancestor size at insert
+    // is always larger than its parent's, so it orders them.
+    std::set<BigNum> descendants = getRelated(txid, false);
+    std::vector<BigNum> ordered(descendants.begin(), descendants.end());
+    std::sort(ordered.begin(), ordered.end(), [&](const BigNum& a, const BigNum& b) {
+        return txs.at(a).ancestorSize > txs.at(b).ancestorSize;
+    });
+    ordered.push_back(txid);
+
+    std::vector<transaction> returning;
+    for(const BigNum& id : ordered) {
+        returning.push_back(txs.at(id).tx);
+        erase(id);
+    }
+
+    return returning;
+}
+
+void CryptoKernel::Blockchain::Mempool::trim() {
+    if(maxMemory == 0) {
+        return;
+    }
+
+    // A package is only as attractive to miners as its descendant fee
+    // rate, so the lowest one goes first, with its descendants
+    while(memory > maxMemory && !byDescendantRate.empty()) {
+        const std::pair<double, BigNum> lowest = *byDescendantRate.begin();
+        rollingMinFeeRate = std::max(rollingMinFeeRate, lowest.first + incrementalFeeRate);
+        blockSinceEviction = false;
+        evicted += evict(lowest.second).size();
+    }
+}
+
+double CryptoKernel::Blockchain::Mempool::minFeeRate(const uint64_t now) {
+    if(rollingMinFeeRate == 0 || !blockSinceEviction || now <= lastRollingUpdate) {
+        lastRollingUpdate = std::max(lastRollingUpdate, now);
+        return rollingMinFeeRate;
+    }
+
+    // Decay faster while the mempool is far from full, as the minimum is
+    // then holding back transactions it has room for
+    double halfLife = minFeeHalfLife;
+    if(memory < maxMemory / 4) {
+        halfLife /= 4;
+    } else if(memory < maxMemory / 2) {
+        halfLife /= 2;
+    }
+
+    rollingMinFeeRate /= std::pow(2.0, (now - lastRollingUpdate) / halfLife);
+    lastRollingUpdate = now;
+    if(rollingMinFeeRate < incrementalFeeRate / 2) {
+        rollingMinFeeRate = 0;
+    }
+
+    return rollingMinFeeRate;
+}
+
+double CryptoKernel::Blockchain::Mempool::getMinFeeRate() {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    return minFeeRate(std::time(0));
+}
+
+void CryptoKernel::Blockchain::Mempool::blockConnected(const block& newBlock) {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    std::set<transaction> blockTxs = newBlock.getTransactions();
+    blockTxs.insert(newBlock.getCoinbaseTx());
+
+    // Confirmed transactions leave first, so their own spends and outputs
+    // are not taken for conflicts. Their dependants stay, as they now
+    // spend confirmed outputs.
+    for(const transaction& tx : blockTxs) {
+        erase(tx.getId());
+    }
+
+    for(const transaction& tx : blockTxs) {
+        for(const input& inp : tx.getInputs()) {
+            const auto spender = spends.find(inp.getOutputId());
+            if(spender != spends.end()) {
+                evict(spender->second);
+            }
+        }
+
+        for(const output& out : tx.getOutputs()) {
+            const auto creator = outputs.find(out.getId());
+            if(creator != outputs.end()) {
+                evict(creator->second);
+            }
+        }
+    }
+
+    // The minimum fee rate only decays once a block has made room
+    minFeeRate(std::time(0));
+    blockSinceEviction = true;
+}
+
+std::vector<CryptoKernel::Blockchain::transaction>
+CryptoKernel::Blockchain::Mempool::outputsRemoved(const std::set<BigNum>& outputIds) {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    std::vector<transaction> returning;
+    for(const BigNum& id : outputIds) {
+        const auto spender = spends.find(id);
+        if(spender != spends.end()) {
+            const std::vector<transaction> removed = evict(spender->second);
+            returning.insert(returning.end(), removed.begin(), removed.end());
+        }
+    }
+
+    return returning;
+}
+
+unsigned int CryptoKernel::Blockchain::Mempool::expire(const uint64_t now) {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    if(expiry == 0) {
+        return 0;
+    }
+
+    unsigned int removed = 0;
+    while(!byTime.empty() && byTime.begin()->first + expiry < now) {
+        removed += evict(byTime.begin()->second).size();
+    }
+    expired += removed;
+
+    return removed;
+}
+
+void CryptoKernel::Blockchain::Mempool::rescanScripted(Storage::Transaction* dbTx,
+        Blockchain* blockchain) {
+    // Contracts may read the chain, so only their result can change
+    // without an output being spent or removed
+    std::vector<BigNum> removals;
+
+    for(const BigNum& id : scripted) {
+        if(!std::get<0>(blockchain->verifyTransaction(dbTx, txs.at(id).tx, false, true))) {
+            removals.push_back(id);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    for(const BigNum& id : removals) {
+        if(txs.find(id) != txs.end()) {
+            evict(id);
+        }
+    }
+}
+
+std::vector<CryptoKernel::BigNum> CryptoKernel::Blockchain::Mempool::selectTransactions() const {
+    std::vector<BigNum> returning;
+    uint64_t totalSize = 0;
+
+    // Block transactions may only spend outputs confirmed before the
+    // block, so only transactions without unconfirmed parents are taken
+    for(auto it = byFeeRate.rbegin(); it != byFeeRate.rend(); it++) {
+        const Entry& entry = txs.at(it->second);
+        if(!entry.parents.empty() || totalSize + entry.size >= maxBlockBytes) {
+            continue;
+        }
+
+        returning.push_back(it->second);
+        totalSize += entry.size;
+    }
+
+    return returning;
+}
+
+std::set<CryptoKernel::Blockchain::transaction> CryptoKernel::Blockchain::Mempool::getTransactions() const {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    std::set<transaction> returning;
+
+    for(const BigNum& id : selectTransactions()) {
+        returning.insert(txs.at(id).tx);
+    }
+
+    return returning;
+}
+
+Json::Value CryptoKernel::Blockchain::Mempool::getProjectedBlock() const {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    Json::Value returning;
+    returning["transactions"] = Json::Value(Json::arrayValue);
+    uint64_t fees = 0;
+    uint64_t totalSize = 0;
+
+    for(const BigNum& id : selectTransactions()) {
+        const Entry& entry = txs.at(id);
+
+        Json::Value tx;
+        tx["id"] = id.toString();
+        tx["fee"] = static_cast<Json::UInt64>(entry.fee);
+        tx["size"] = static_cast<Json::UInt64>(entry.size);
+        tx["feeRate"] = feeRate(entry.fee, entry.size);
+        returning["transactions"].append(tx);
+
+        fees += entry.fee;
+        totalSize += entry.size;
+    }
+
+    returning["count"] = returning["transactions"].size();
+    returning["fees"] = static_cast<Json::UInt64>(fees);
+    returning["size"] = static_cast<Json::UInt64>(totalSize);
+    returning["maxSize"] = static_cast<Json::UInt64>(maxBlockBytes);
+    returning["mempoolCount"] = static_cast<Json::UInt64>(txs.size());
+
+    return returning;
+}
+
+unsigned int CryptoKernel::Blockchain::Mempool::count() const {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    return txs.size();
+}
+
+unsigned int CryptoKernel::Blockchain::Mempool::size() const {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    return bytes;
+}
+
+Json::Value CryptoKernel::Blockchain::Mempool::getStats() {
+    std::lock_guard<std::mutex> lock(mempoolMutex);
+    const uint64_t now = std::time(0);
+
+    Json::Value returning;
+    returning["count"] = static_cast<Json::UInt64>(txs.size());
+    returning["bytes"] = static_cast<Json::UInt64>(bytes);
+    returning["memory"] = static_cast<Json::UInt64>(memory);
+    returning["maxMemory"] = static_cast<Json::UInt64>(maxMemory);
+    returning["usage"] = maxMemory > 0 ? static_cast<double>(memory) / maxMemory : 0.0;
+    returning["memoryPerByte"] = bytes > 0 ? static_cast<double>(memory) / bytes : 0.0;
+    returning["minFeeRate"] = minFeeRate(now);
+    returning["incrementalFeeRate"] = incrementalFeeRate;
+    returning["expiry"] = static_cast<Json::UInt64>(expiry);
+    returning["oldest"] = byTime.empty() ? 0 :
+                          static_cast<Json::UInt64>(now - std::min(now, byTime.begin()->first));
+
+    uint64_t chained = 0;
+    for(const auto& it : txs) {
+        if(!it.second.parents.empty()) {
+            chained++;
+        }
+    }
+
+    returning["scripted"] = static_cast<Json::UInt64>(scripted.size());
+    returning["unconfirmedParents"] = static_cast<Json::UInt64>(chained);
+    returning["conflicts"] = static_cast<Json::UInt64>(conflicts);
+    returning["lowFee"] = static_cast<Json::UInt64>(lowFee);
+    returning["chainLimit"] = static_cast<Json::UInt64>(chainLimit);
+    returning["evicted"] = static_cast<Json::UInt64>(evicted);
+    returning["expired"] = static_cast<Json::UInt64>(expired);
+
+    return returning;
+}
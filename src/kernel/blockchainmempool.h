@@ -0,0 +1,204 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOCKCHAINMEMPOOL_H_INCLUDED
+#define BLOCKCHAINMEMPOOL_H_INCLUDED
+
+#include "blockchain.h"
+
+namespace CryptoKernel {
+/**
+* The unconfirmed transactions, indexed by the outputs they spend and
+* create and ordered by their own fee rate and by the fee rate of their
+* descendant packages.
+*
+* The memory each entry costs is estimated from the heap allocations of
+* the transaction and of the indexes that refer to it. Once the total
+* passes the limit the package with the lowest descendant fee rate is
+* evicted until it fits again, and the minimum fee rate for new
+* transactions is raised above the evicted rate. That minimum decays back
+* to zero with a half-life of twelve hours once blocks are connected, and
+* faster while the mempool is mostly empty. Transactions older than the
+* expiry are dropped with their descendants.
+*
+* Transactions may spend the outputs of other transactions in the mempool.
+* A transaction may have at most 25 unconfirmed ancestors and descendants
+* counting itself, each group at most 101 KiB, so a chain cannot make
+* the package updates slow.
+*
+* Only the holder of the chain lock changes the mempool, and any thread may
+* read it.
+*/
+class Blockchain::Mempool {
+public:
+    /**
+    * Constructs an empty mempool
+    *
+    * @param maxMemory the approximate memory in bytes the entries may use,
+    *        zero for no limit
+    * @param expiry the seconds a transaction may stay unconfirmed, zero to
+    *        keep transactions until they confirm
+    */
+    Mempool(const uint64_t maxMemory, const uint64_t expiry);
+
+    /**
+    * Adds a transaction, then evicts the lowest fee rate packages until
+    * the mempool is back under its memory limit
+    *
+    * @param tx the transaction to add
+    * @param fee the fee the transaction pays
+    * @param scripted true if it spends an output with a contract, whose
+    *        validity may change with the chain, optional
+    * @return false if it conflicts with a transaction in the mempool, pays
+    *         less than the minimum fee rate, would exceed the chain limits
+    *         or was evicted straight away
+    */
+    bool insert(const transaction& tx, const uint64_t fee, const bool scripted = false);
+    void remove(const transaction& tx);
+
+    /**
+    * Returns an output created by a transaction in the mempool, so that
+    * transactions spending it can be verified before it confirms
+    *
+    * @param outputId the id of the output
+    * @return the output as a dbOutput json object, a null value if no
+    *         transaction in the mempool creates it
+    */
+    Json::Value getOutput(const BigNum& outputId) const;
+
+    /**
+    * Returns the transactions of the next block template, taken by fee
+    * rate up to the block size limit. Block transactions are verified
+    * against the chain before the block, so transactions spending
+    * unconfirmed outputs wait for their parents to confirm.
+    */
+    std::set<transaction> getTransactions() const;
+
+    /**
+    * Returns the next block template as json, see
+    * Blockchain::getProjectedBlock
+    */
+    Json::Value getProjectedBlock() const;
+
+    /**
+    * Removes the transactions a connected block confirms, those spending
+    * the same outputs or creating the same outputs as it, and every
+    * transaction depending on them
+    */
+    void blockConnected(const block& newBlock);
+
+    /**
+    * Removes the transactions spending outputs that no longer exist, and
+    * every transaction depending on them
+    *
+    * @return the transactions removed, descendants before their ancestors,
+    *         so a reorg can submit them again once the outputs return
+    */
+    std::vector<transaction> outputsRemoved(const std::set<BigNum>& outputIds);
+
+    /**
+    * Removes the transactions that have been in the mempool longer than
+    * the expiry, and every transaction depending on them
+    *
+    * @param now the current unix time
+    * @return the number of transactions removed
+    */
+    unsigned int expire(const uint64_t now);
+
+    /**
+    * Reverifies the scripted transactions against the chain and removes
+    * those no longer valid. Only the holder of the chain lock changes the
+    * mempool, so the scan reads it without taking the mempool mutex.
+    */
+    void rescanScripted(Storage::Transaction* dbTx, Blockchain* blockchain);
+
+    /**
+    * Returns the fee per byte a new transaction must pay, zero unless
+    * transactions were evicted for space recently
+    */
+    double getMinFeeRate();
+
+    unsigned int count() const;
+    unsigned int size() const;
+
+    /**
+    * Returns the mempool counters as json: transactions, serialized bytes,
+    * estimated memory against the limit, the minimum fee rate, the age of
+    * the oldest transaction, the transactions spending unconfirmed
+    * outputs, and the transactions rejected for conflicts, a low fee or
+    * the chain limits, evicted for space and expired
+    */
+    Json::Value getStats();
+
+private:
+    /* An unconfirmed transaction with the size of its unconfirmed ancestors
+       when it arrived, which orders descendants before their ancestors,
+       and the totals of its package of unconfirmed descendants */
+    struct Entry {
+        transaction tx;
+        uint64_t fee;
+        uint64_t size;
+        std::set<BigNum> parents;
+        std::set<BigNum> children;
+        uint64_t ancestorSize;
+        uint64_t descendantFee;
+        uint64_t descendantSize;
+        uint64_t time;
+        uint64_t memory;
+    };
+
+    std::map<BigNum, Entry> txs;
+    std::map<BigNum, BigNum> outputs;
+    std::map<BigNum, BigNum> inputs;
+    std::map<BigNum, BigNum> spends;
+    std::set<BigNum> scripted;
+
+    /* Entries ordered by their own fee rate, by the fee rate of their
+       descendant packages, and by the time they arrived */
+    std::set<std::pair<double, BigNum>> byFeeRate;
+    std::set<std::pair<double, BigNum>> byDescendantRate;
+    std::set<std::pair<uint64_t, BigNum>> byTime;
+
+    void erase(const BigNum& txid);
+    std::vector<transaction> evict(const BigNum& txid);
+    void trim();
+    double minFeeRate(const uint64_t now);
+    std::set<BigNum> getRelated(const BigNum& txid, const bool ancestors) const;
+    void refresh(const std::set<BigNum>& txids);
+    std::vector<BigNum> selectTransactions() const;
+    static uint64_t entryMemory(const Entry& entry, const bool scripted);
+
+    uint64_t maxMemory;
+    uint64_t expiry;
+    uint64_t bytes;
+    uint64_t memory;
+
+    double rollingMinFeeRate;
+    uint64_t lastRollingUpdate;
+    bool blockSinceEviction;
+
+    uint64_t conflicts;
+    uint64_t lowFee;
+    uint64_t chainLimit;
+    uint64_t evicted;
+    uint64_t expired;
+
+    mutable std::mutex mempoolMutex;
+};
+}
+
+#endif // BLOCKCHAINMEMPOOL_H_INCLUDED
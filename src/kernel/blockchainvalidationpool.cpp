@@ -0,0 +1,248 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "blockchainvalidationpool.h"
+
+static uint64_t microsSince(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start).count();
+}
+
+CryptoKernel::Blockchain::ValidationPool::ValidationPool(const unsigned int threads) {
+    this->threads = threads;
+    running = true;
+    batch = nullptr;
+    generation = 0;
+    working = 0;
+    batches = 0;
+    cancelled = 0;
+    tasks = 0;
+    skipped = 0;
+    steals = 0;
+    busyMicros = 0;
+    wallMicros = 0;
+
+    // Slot 0 is the calling thread's
+    for(unsigned int i = 1; i <= threads; i++) {
+        workers.push_back(std::thread(&CryptoKernel::Blockchain::ValidationPool::workerFunc,
+                                      this, i));
+    }
+}
+
+CryptoKernel::Blockchain::ValidationPool::~ValidationPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+    workCondition.notify_all();
+    for(auto& worker : workers) {
+        worker.join();
+    }
+}
+
+bool CryptoKernel::Blockchain::ValidationPool::run(const size_t count,
+        const std::function<bool(const size_t)>& task) {
+    if(count == 0) {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> runLock(runMutex);
+    const auto start = std::chrono::steady_clock::now();
+
+    const unsigned int slots = threads + 1;
+    Batch current;
+    current.task = &task;
+    current.ranges.reset(new Range[slots]);
+    for(unsigned int i = 0; i < slots; i++) {
+        current.ranges[i].begin = count * i / slots;
+        current.ranges[i].end = count * (i + 1) / slots;
+    }
+    current.failed = false;
+    current.tasks = 0;
+    current.steals = 0;
+    current.busyMicros = 0;
+
+    if(threads > 0) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batch = &current;
+            generation++;
+        }
+        workCondition.notify_all();
+    }
+
+    work(current, 0);
+
+    if(threads > 0) {
+        // Every range is empty now, but workers may still be running the
+        // last tasks they claimed
+        std::unique_lock<std::mutex> lock(mutex);
+        batch = nullptr;
+        doneCondition.wait(lock, [&] {
+            return working == 0;
+        });
+    }
+
+    const uint64_t micros = microsSince(start);
+    const double parallelism = micros > 0 ?
+                               static_cast<double>(current.busyMicros) / micros : 0.0;
+
+    std::lock_guard<std::mutex> lock(statsMutex);
+    batches++;
+    if(current.failed) {
+        cancelled++;
+    }
+    tasks += current.tasks;
+    skipped += count - current.tasks;
+    steals += current.steals;
+    busyMicros += current.busyMicros;
+    wallMicros += micros;
+
+    lastBatch = Json::Value();
+    lastBatch["tasks"] = static_cast<Json::UInt64>(count);
+    lastBatch["skipped"] = static_cast<Json::UInt64>(count - current.tasks);
+    lastBatch["steals"] = static_cast<Json::UInt64>(current.steals);
+    lastBatch["micros"] = static_cast<Json::UInt64>(micros);
+    lastBatch["parallelism"] = parallelism;
+    lastBatch["failed"] = current.failed.load();
+
+    return !current.failed;
+}
+
+bool CryptoKernel::Blockchain::ValidationPool::claim(Batch& batch, const unsigned int slot,
+        size_t& index) {
+    Range& own = batch.ranges[slot];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(own.begin < own.end) {
+            index = own.begin++;
+            return true;
+        }
+    }
+
+    // Only one range lock is ever held at a time, so thieves cannot
+    // deadlock each other
+    const unsigned int slots = threads + 1;
+    while(true) {
+        unsigned int victim = slot;
+        size_t victimSize = 0;
+        for(unsigned int i = 0; i < slots; i++) {
+            if(i == slot) {
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(batch.ranges[i].mutex);
+            const size_t size = batch.ranges[i].end - batch.ranges[i].begin;
+            if(size > victimSize) {
+                victim = i;
+                victimSize = size;
+            }
+        }
+
+        if(victimSize == 0) {
+            return false;
+        }
+
+        size_t begin;
+        size_t end;
+        {
+            std::lock_guard<std::mutex> lock(batch.ranges[victim].mutex);
+            Range& range = batch.ranges[victim];
+            if(range.begin == range.end) {
+                continue;
+            }
+
+            // The victim keeps the front half, which it works through next
+            begin = range.begin + (range.end - range.begin) / 2;
+            end = range.end;
+            range.end = begin;
+        }
+        batch.steals++;
+
+        index = begin;
+        std::lock_guard<std::mutex> lock(own.mutex);
+        own.begin = begin + 1;
+        own.end = end;
+        return true;
+    }
+}
+
+void CryptoKernel::Blockchain::ValidationPool::work(Batch& batch, const unsigned int slot) {
+    size_t index;
+    while(!batch.failed && claim(batch, slot, index)) {
+        const auto start = std::chrono::steady_clock::now();
+
+        bool valid;
+        try {
+            valid = (*batch.task)(index);
+        } catch(const std::exception&) {
+            valid = false;
+        }
+
+        batch.busyMicros += microsSince(start);
+        batch.tasks++;
+
+        if(!valid) {
+            batch.failed = true;
+        }
+    }
+}
+
+void CryptoKernel::Blockchain::ValidationPool::workerFunc(const unsigned int slot) {
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64_t seen = generation;
+    while(running) {
+        if(batch == nullptr || generation == seen) {
+            workCondition.wait(lock);
+            continue;
+        }
+
+        seen = generation;
+        Batch* current = batch;
+        working++;
+
+        lock.unlock();
+        work(*current, slot);
+        lock.lock();
+
+        working--;
+        if(working == 0) {
+            doneCondition.notify_all();
+        }
+    }
+}
+
+Json::Value CryptoKernel::Blockchain::ValidationPool::getStats() {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    const double parallelism = wallMicros > 0 ?
+                               static_cast<double>(busyMicros) / wallMicros : 0.0;
+
+    Json::Value returning;
+    returning["threads"] = threads + 1;
+    returning["batches"] = static_cast<Json::UInt64>(batches);
+    returning["cancelled"] = static_cast<Json::UInt64>(cancelled);
+    returning["tasks"] = static_cast<Json::UInt64>(tasks);
+    returning["skipped"] = static_cast<Json::UInt64>(skipped);
+    returning["steals"] = static_cast<Json::UInt64>(steals);
+    returning["busyMicros"] = static_cast<Json::UInt64>(busyMicros);
+    returning["wallMicros"] = static_cast<Json::UInt64>(wallMicros);
+    returning["parallelism"] = parallelism;
+    returning["efficiency"] = parallelism / (threads + 1);
+    returning["lastBatch"] = lastBatch;
+
+    return returning;
+}
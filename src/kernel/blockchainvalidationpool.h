@@ -0,0 +1,117 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOCKCHAINVALIDATIONPOOL_H_INCLUDED
+#define BLOCKCHAINVALIDATIONPOOL_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+#include "blockchain.h"
+
+namespace CryptoKernel {
+/**
+* Long-lived worker threads that validate the transactions of a block in
+* parallel. Each batch of tasks is split into one range per worker, the
+* calling thread included. A worker runs the tasks of its own range in
+* order and, once it is empty, steals the back half of the fullest other
+* range, so a batch finishes when the slowest task does rather than when
+* the slowest of a fixed group of tasks does.
+*
+* The first task to fail cancels the batch, and tasks not started yet are
+* skipped. Tasks run concurrently, so they may only read shared state; a
+* write transaction may be read from several threads as long as nothing
+* is written to it until the batch returns.
+*/
+class Blockchain::ValidationPool {
+public:
+    /**
+    * Constructs a pool and starts its threads
+    *
+    * @param threads the number of worker threads besides the calling
+    *        thread, zero runs every batch on the calling thread
+    */
+    ValidationPool(const unsigned int threads);
+
+    ~ValidationPool();
+
+    /**
+    * Calls task once for every index from 0 to count - 1, spread over the
+    * workers and the calling thread, until a call returns false. A task
+    * that throws counts as failed. Batches are run one at a time.
+    *
+    * @param count the number of tasks
+    * @param task the task to call with each index
+    * @return true if every task returned true
+    */
+    bool run(const size_t count, const std::function<bool(const size_t)>& task);
+
+    /**
+    * Returns the pool counters as json: threads, batches and tasks run,
+    * batches cancelled and tasks skipped by a failure, ranges stolen, the
+    * time spent in tasks and in batches, the average number of tasks
+    * running at once during a batch and that as a share of the threads,
+    * and the same for the most recent batch
+    */
+    Json::Value getStats();
+
+private:
+    struct Range {
+        std::mutex mutex;
+        size_t begin;
+        size_t end;
+    };
+
+    struct Batch {
+        const std::function<bool(const size_t)>* task;
+        std::unique_ptr<Range[]> ranges;
+        std::atomic<bool> failed;
+        std::atomic<uint64_t> tasks;
+        std::atomic<uint64_t> steals;
+        std::atomic<uint64_t> busyMicros;
+    };
+
+    void work(Batch& batch, const unsigned int slot);
+    bool claim(Batch& batch, const unsigned int slot, size_t& index);
+    void workerFunc(const unsigned int slot);
+
+    unsigned int threads;
+    std::vector<std::thread> workers;
+    bool running;
+
+    Batch* batch;
+    uint64_t generation;
+    unsigned int working;
+    std::mutex mutex;
+    std::mutex runMutex;
+    std::condition_variable workCondition;
+    std::condition_variable doneCondition;
+
+    uint64_t batches;
+    uint64_t cancelled;
+    uint64_t tasks;
+    uint64_t skipped;
+    uint64_t steals;
+    uint64_t busyMicros;
+    uint64_t wallMicros;
+    Json::Value lastBatch;
+    std::mutex statsMutex;
+};
+}
+
+#endif // BLOCKCHAINVALIDATIONPOOL_H_INCLUDED
@@ -2,6 +2,7 @@
 #include "base64.h"
 
 #include "contract.h"
+#include "blockchaincoinscache.h"
 
 CryptoKernel::ContractRunner::ContractRunner(CryptoKernel::Blockchain* blockchain,
         const uint64_t memoryLimit, const uint64_t instructionLimit) {
@@ -104,7 +105,7 @@ bool CryptoKernel::ContractRunner::evaluateValid(Storage::Transaction* dbTx,
         const CryptoKernel::Blockchain::transaction& tx) {
     for(const CryptoKernel::Blockchain::input& inp : tx.getInputs()) {
         const CryptoKernel::Blockchain::output out = CryptoKernel::Blockchain::dbOutput(
-                    blockchain->utxos->get(dbTx, inp.getOutputId().toString()));
+                    *blockchain->coins->get(dbTx, blockchain->utxos->getKey(inp.getOutputId().toString())));
         const Json::Value data = out.getData();
         if(!data["contract"].empty()) {
             setupEnvironment(dbTx, tx, inp);
@@ -4,10 +4,15 @@
 
 #include <list>
 
+/* Blocks behind the best known peer before the blockchain is switched to
+   initial sync mode */
+static const uint64_t initialSyncThreshold = 1000;
+
 CryptoKernel::Network::Network(CryptoKernel::Log* log,
                                CryptoKernel::Blockchain* blockchain,
                                const unsigned int port,
-                               const std::string& dbDir) {
+                               const std::string& dbDir,
+                               const Json::Value& storageOptions) {
     this->log = log;
     this->blockchain = blockchain;
     this->port = port;
@@ -15,7 +20,7 @@ CryptoKernel::Network::Network(CryptoKernel::Log* log,
 
     myAddress = sf::IpAddress::getPublicAddress();
 
-    networkdb.reset(new CryptoKernel::Storage(dbDir));
+    networkdb.reset(new CryptoKernel::Storage(dbDir, storageOptions));
     peers.reset(new Storage::Table("peers"));
 
     std::unique_ptr<Storage::Transaction> dbTx(networkdb->begin());
@@ -283,6 +288,10 @@ void CryptoKernel::Network::networkFunc() {
 
         //Detect if we are behind
         if(bestHeight > currentHeight) {
+            if(bestHeight - currentHeight > initialSyncThreshold) {
+                blockchain->setInitialSync(true);
+            }
+
             connectedMutex.lock();
 
             for(std::map<std::string, std::unique_ptr<PeerInfo>>::iterator it = connected.begin();
@@ -368,17 +377,16 @@ void CryptoKernel::Network::networkFunc() {
                     blockProcessor.reset(new std::thread([&, blocks](const std::string& peer){
                         failure = false;
 
-                        for(auto rit = blocks.rbegin(); rit != blocks.rend(); ++rit) {
-                            const auto blockResult = blockchain->submitBlock(*rit);
+                        const std::vector<CryptoKernel::Blockchain::block> run(blocks.rbegin(),
+                                                                               blocks.rend());
+                        const auto blockResult = blockchain->submitBlocks(run);
 
-                            if(std::get<1>(blockResult)) {
-                                changeScore(peer, 50);
-                            }
+                        if(std::get<1>(blockResult)) {
+                            changeScore(peer, 50);
+                        }
 
-                            if(!std::get<0>(blockResult)) {
-                                failure = true;
-                                break;
-                            }
+                        if(!std::get<0>(blockResult)) {
+                            failure = true;
                         }
                     }, it->first));
                 }
@@ -388,10 +396,20 @@ void CryptoKernel::Network::networkFunc() {
         }
 
         if(bestHeight <= currentHeight || connected.size() == 0) {
+            // Losing every peer does not mean the chain has caught up, so
+            // initial sync only ends, and the best height is only
+            // forgotten, once we reach it
+            const bool caughtUp = bestHeight <= currentHeight;
+            if(caughtUp) {
+                blockchain->setInitialSync(false);
+            }
+
             std::this_thread::sleep_for(std::chrono::milliseconds(20000));
             currentHeight = blockchain->getBlockDB("tip").getHeight();
             startHeight = currentHeight;
-            bestHeight = currentHeight;
+            if(caughtUp || currentHeight > bestHeight) {
+                bestHeight = currentHeight;
+            }
             this->currentHeight = currentHeight;
         }
     }
@@ -532,6 +550,10 @@ std::set<std::string> CryptoKernel::Network::getConnectedPeers() {
     return peerUrls;
 }
 
+Json::Value CryptoKernel::Network::getStorageStats() {
+    return networkdb->getStats();
+}
+
 uint64_t CryptoKernel::Network::getCurrentHeight() {
     return currentHeight;
 }
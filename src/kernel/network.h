@@ -23,9 +23,12 @@ public:
     * @param blockchain a pointer to the blockchain to sync
     * @param port the port to listen on
     * @param dbDir the directory of the peers database
+    * @param storageOptions the storage options of the peers database,
+    *        see CryptoKernel::Storage::Storage
     */
     Network(CryptoKernel::Log* log, CryptoKernel::Blockchain* blockchain,
-            const unsigned int port, const std::string& dbDir);
+            const unsigned int port, const std::string& dbDir,
+            const Json::Value& storageOptions = Json::Value());
 
     /**
     * Default destructor
@@ -93,6 +96,13 @@ public:
      */
      std::map<std::string, peerStats> getPeerStats();
 
+    /**
+    * Returns the statistics of the peer database, see Storage::getStats
+    *
+    * @return a json object of storage statistics
+    */
+    Json::Value getStorageStats();
+
 private:
     class Peer;
 
@@ -16,33 +16,570 @@
 */
 
 #include <sstream>
+#include <cstring>
+#include <memory>
+#include <map>
+#include <cstdint>
+#include <algorithm>
 
 #include <json/writer.h>
 #include <json/reader.h>
 
 #include <leveldb/write_batch.h>
+#include <leveldb/env.h>
 
-#include "storage.h"
+#include "storagebackend.h"
+#include "storagecache.h"
+#include "storagecompactor.h"
+#include "storagefilter.h"
+#include "storagereadpool.h"
+#include "storagestats.h"
+#include "storagewriteset.h"
 
-CryptoKernel::Storage::Storage(const std::string& filename) {
-    leveldb::Options options;
-    options.create_if_missing = true;
+/* Binary values start with a NUL byte, which can never begin a json text
+   value, so both encodings can be told apart while a database is migrated. */
+static const char binaryMarker = '\0';
+
+/* Keys starting with a NUL byte are reserved for storage metadata and never
+   collide with table keys. */
+static const std::string formatKey = std::string(1, '\0') + "format";
+static const unsigned int formatVersion = 2;
+
+/* Returned for keys that do not exist, so reading them allocates nothing */
+static const std::shared_ptr<const Json::Value> nullValue = std::make_shared<const Json::Value>();
+
+/* Filters are first sized for one key per minFilterRowSize bytes of the
+   table, and never for fewer than minFilterKeys keys */
+static const uint64_t minFilterRowSize = 64;
+static const uint64_t minFilterKeys = 65536;
+
+/* Table keys start with a table id byte. Ids up to lastBuiltinTableId are
+   given to the tables CryptoKernel uses, ids up to lastTableId can be
+   chosen by other tables and any other table is keyed by its name after
+   namedTableId. None of these are printable characters, so keys in the
+   legacy "table/index/key" format are recognised during migration. */
+static const uint8_t lastBuiltinTableId = 0x0f;
+static const uint8_t lastTableId = 0x1f;
+static const uint8_t namedTableId = 0xff;
+
+static const std::map<std::string, uint8_t> builtinTableIds = {
+    {"blocks", 1},
+    {"transactions", 2},
+    {"utxos", 3},
+    {"stxos", 4},
+    {"inputs", 5},
+    {"candidates", 6},
+    {"peers", 7},
+    {"accounts", 8},
+    {"params", 9},
+    {"undo", 10}
+};
+
+enum KeyType {
+    KEY_UINT = 1,
+    KEY_HEX,
+    KEY_STRING
+};
+
+static bool isCanonicalDecimal(const std::string& key, uint64_t& value) {
+    if(key.empty() || key.size() > 20 || (key[0] == '0' && key.size() > 1)) {
+        return false;
+    }
+
+    value = 0;
+    for(const char c : key) {
+        if(c < '0' || c > '9') {
+            return false;
+        }
+        const uint64_t digit = c - '0';
+        if(value > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+
+    return true;
+}
+
+static bool isCanonicalHex(const std::string& key) {
+    if(key.empty() || key.size() > 64 || key[0] == '0') {
+        return false;
+    }
+
+    for(const char c : key) {
+        if(!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint8_t hexValue(const char c) {
+    return c <= '9' ? c - '0' : c - 'a' + 10;
+}
+
+/* Encodes a key within a table. Encoding is a bijection on strings:
+   decimals and hex ids only take the compact forms when they are written
+   without leading zeros, so decoding always gives back the original. */
+static void writeKey(std::string& out, const std::string& key) {
+    uint64_t value;
+    if(isCanonicalDecimal(key, value)) {
+        out.push_back(KEY_UINT);
+        for(int i = 7; i >= 0; i--) {
+            out.push_back(static_cast<char>(value >> (i * 8)));
+        }
+    } else if(isCanonicalHex(key)) {
+        // The digit count comes first so hex ids sort numerically among
+        // themselves. They all sort after the decimal keys, whatever their
+        // value.
+        out.push_back(KEY_HEX);
+        out.push_back(static_cast<char>(key.size()));
+        for(size_t i = 0; i < key.size(); i += 2) {
+            const uint8_t low = i + 1 < key.size() ? hexValue(key[i + 1]) : 0;
+            out.push_back(static_cast<char>((hexValue(key[i]) << 4) | low));
+        }
+    } else {
+        out.push_back(KEY_STRING);
+        out.append(key);
+    }
+}
+
+static std::string readKey(const char* data, const size_t size) {
+    if(size == 0) {
+        return "";
+    }
+
+    switch(data[0]) {
+    case KEY_UINT: {
+        uint64_t value = 0;
+        for(size_t i = 1; i < 9 && i < size; i++) {
+            value = (value << 8) | static_cast<uint8_t>(data[i]);
+        }
+        return std::to_string(value);
+    }
+    case KEY_HEX: {
+        static const char digits[] = "0123456789abcdef";
+        const size_t nDigits = size > 1 ? static_cast<uint8_t>(data[1]) : 0;
+        std::string returning;
+        returning.reserve(nDigits);
+        for(size_t i = 0; i < nDigits && 2 + i / 2 < size; i++) {
+            const uint8_t byte = static_cast<uint8_t>(data[2 + i / 2]);
+            returning.push_back(digits[i % 2 == 0 ? byte >> 4 : byte & 0xf]);
+        }
+        return returning;
+    }
+    default:
+        return std::string(data + 1, size - 1);
+    }
+}
+
+/* Checkpoints are written in batches of about this many bytes */
+static const uint64_t checkpointBatchBytes = 4 * 1024 * 1024;
+
+static uint64_t microsSince(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string tableKeyPrefix(const std::string& name) {
+    const auto it = builtinTableIds.find(name);
+    if(it != builtinTableIds.end()) {
+        return std::string(1, static_cast<char>(it->second));
+    }
+
+    return std::string(1, static_cast<char>(namedTableId)) + name + std::string(1, '\0');
+}
+
+enum BinaryType {
+    TYPE_NULL = 0,
+    TYPE_FALSE,
+    TYPE_TRUE,
+    TYPE_INT,
+    TYPE_UINT,
+    TYPE_REAL,
+    TYPE_STRING,
+    TYPE_ARRAY,
+    TYPE_OBJECT
+};
+
+static void writeVarint(std::string& out, uint64_t value) {
+    while(value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static bool readVarint(const char*& pos, const char* end, uint64_t& value) {
+    value = 0;
+    for(unsigned int shift = 0; shift < 64 && pos < end; shift += 7) {
+        const uint8_t byte = static_cast<uint8_t>(*pos++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void writeString(std::string& out, const char* str, const size_t size) {
+    writeVarint(out, size);
+    out.append(str, size);
+}
+
+static void writeValue(std::string& out, const Json::Value& json) {
+    switch(json.type()) {
+    case Json::nullValue:
+        out.push_back(TYPE_NULL);
+        break;
+    case Json::booleanValue:
+        out.push_back(json.asBool() ? TYPE_TRUE : TYPE_FALSE);
+        break;
+    case Json::intValue: {
+        // Zigzag encode so small negative numbers stay short
+        const int64_t value = json.asInt64();
+        out.push_back(TYPE_INT);
+        writeVarint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+        break;
+    }
+    case Json::uintValue:
+        out.push_back(TYPE_UINT);
+        writeVarint(out, json.asUInt64());
+        break;
+    case Json::realValue: {
+        const double value = json.asDouble();
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        out.push_back(TYPE_REAL);
+        for(unsigned int i = 0; i < 8; i++) {
+            out.push_back(static_cast<char>(bits >> (i * 8)));
+        }
+        break;
+    }
+    case Json::stringValue: {
+        const char* begin;
+        const char* end;
+        json.getString(&begin, &end);
+        out.push_back(TYPE_STRING);
+        writeString(out, begin, end - begin);
+        break;
+    }
+    case Json::arrayValue:
+        out.push_back(TYPE_ARRAY);
+        writeVarint(out, json.size());
+        for(const Json::Value& element : json) {
+            writeValue(out, element);
+        }
+        break;
+    case Json::objectValue:
+        out.push_back(TYPE_OBJECT);
+        writeVarint(out, json.size());
+        for(auto it = json.begin(); it != json.end(); it++) {
+            const char* end;
+            const char* begin = it.memberName(&end);
+            writeString(out, begin, end - begin);
+            writeValue(out, *it);
+        }
+        break;
+    }
+}
+
+static bool readValue(const char*& pos, const char* end, Json::Value& json) {
+    if(pos >= end) {
+        return false;
+    }
+
+    const uint8_t type = static_cast<uint8_t>(*pos++);
+    uint64_t value;
+    switch(type) {
+    case TYPE_NULL:
+        json = Json::Value();
+        return true;
+    case TYPE_FALSE:
+        json = false;
+        return true;
+    case TYPE_TRUE:
+        json = true;
+        return true;
+    case TYPE_INT:
+        if(!readVarint(pos, end, value)) {
+            return false;
+        }
+        json = static_cast<Json::Int64>((value >> 1) ^ (~(value & 1) + 1));
+        return true;
+    case TYPE_UINT:
+        if(!readVarint(pos, end, value)) {
+            return false;
+        }
+        json = static_cast<Json::UInt64>(value);
+        return true;
+    case TYPE_REAL: {
+        if(end - pos < 8) {
+            return false;
+        }
+        uint64_t bits = 0;
+        for(unsigned int i = 0; i < 8; i++) {
+            bits |= static_cast<uint64_t>(static_cast<uint8_t>(*pos++)) << (i * 8);
+        }
+        double real;
+        std::memcpy(&real, &bits, sizeof(real));
+        json = real;
+        return true;
+    }
+    case TYPE_STRING:
+        if(!readVarint(pos, end, value) || static_cast<uint64_t>(end - pos) < value) {
+            return false;
+        }
+        json = Json::Value(pos, pos + value);
+        pos += value;
+        return true;
+    case TYPE_ARRAY: {
+        // Every element takes at least its type byte, so a count larger
+        // than what is left cannot be valid
+        if(!readVarint(pos, end, value) || static_cast<uint64_t>(end - pos) < value) {
+            return false;
+        }
+        json = Json::Value(Json::arrayValue);
+        if(value > 0) {
+            json.resize(value);
+        }
+        for(Json::ArrayIndex i = 0; i < value; i++) {
+            if(!readValue(pos, end, json[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case TYPE_OBJECT: {
+        if(!readVarint(pos, end, value)) {
+            return false;
+        }
+        json = Json::Value(Json::objectValue);
+        for(uint64_t i = 0; i < value; i++) {
+            uint64_t keySize;
+            if(!readVarint(pos, end, keySize) || static_cast<uint64_t>(end - pos) < keySize) {
+                return false;
+            }
+            const char* key = pos;
+            pos += keySize;
+            if(!readValue(pos, end, json[std::string(key, keySize)])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+CryptoKernel::Storage::Storage(const std::string& filename,
+                                const Json::Value& options) {
+    const std::string engine = options.get("engine", "leveldb").asString();
+    cache.reset(new Cache(static_cast<uint64_t>(options.get("cacheSize", 16).asDouble() * 1024 * 1024)));
+    stats.reset(new Stats());
+    writeSetBudget = static_cast<uint64_t>(options.get("writeSetSize", 64).asDouble() * 1024 * 1024);
+    readPool.reset(new ReadPool(options.get("readThreads", 4).asUInt()));
+    filterFalsePositiveRate = options.get("filterFalsePositiveRate", 0.01).asDouble();
+    for(auto& filter : filters) {
+        filter = nullptr;
+    }
+
+    const std::string durabilityMode = options.get("durability", "sync").asString();
+    if(durabilityMode == "sync") {
+        durability = DURABILITY_SYNC;
+    } else if(durabilityMode == "group") {
+        durability = DURABILITY_GROUP;
+    } else if(durabilityMode == "none") {
+        durability = DURABILITY_NONE;
+    } else {
+        throw std::runtime_error("Unknown storage durability \"" + durabilityMode + "\"");
+    }
+
+    const std::string valueEncoding = options.get("valueEncoding", "binary").asString();
+    if(valueEncoding != "binary" && valueEncoding != "json") {
+        throw std::runtime_error("Unknown storage value encoding \"" + valueEncoding + "\"");
+    }
+    jsonValues = valueEncoding == "json";
+    groupCommitInterval = std::chrono::milliseconds(options.get("groupCommitInterval", 100).asUInt64());
+    groupCommitBytes = options.get("groupCommitBytes", 4 * 1024 * 1024).asUInt64();
+    unsynced = false;
+    unsyncedBytes = 0;
+    running = true;
 
     dbMutex.lock();
-    leveldb::Status dbstatus = leveldb::DB::Open(options, filename, &db);
+    try {
+        if(engine == "leveldb") {
+            db.reset(new LevelDBBackend(filename));
+        } else if(engine == "memory") {
+            db.reset(new MemoryBackend(filename));
+        } else {
+            throw std::runtime_error("Unknown storage engine \"" + engine + "\"");
+        }
+    } catch(const std::runtime_error& e) {
+        dbMutex.unlock();
+        throw;
+    }
     dbMutex.unlock();
 
-    if(!dbstatus.ok()) {
-        throw std::runtime_error("Failed to open the database");
+    migrate();
+
+    compactor.reset(new Compactor(db.get(),
+                                  static_cast<uint64_t>(options.get("compactionRate", 16).asDouble() * 1024 * 1024),
+                                  std::chrono::milliseconds(options.get("compactionIdle", 5000).asUInt64()),
+                                  static_cast<uint64_t>(options.get("compactionThreshold", 256).asDouble() * 1024 * 1024)));
+
+    if(durability == DURABILITY_GROUP) {
+        syncThread.reset(new std::thread(&CryptoKernel::Storage::syncFunc, this));
+    }
+}
+
+void CryptoKernel::Storage::migrate() {
+    std::lock_guard<std::mutex> lock(dbMutex);
+
+    std::string version;
+    if(db->get(leveldb::ReadOptions(), formatKey, &version).ok()
+       && fromBinary(version).asUInt() >= formatVersion) {
+        return;
+    }
+
+    // Re-encode legacy json text values and legacy text keys in bounded
+    // batches. Values and keys each carry their own format so an
+    // interrupted migration is simply resumed on the next open.
+    std::unique_ptr<leveldb::Iterator> it(db->newIterator(leveldb::ReadOptions()));
+    leveldb::WriteBatch batch;
+    unsigned int batchSize = 0;
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        const std::string key = it->key().ToString();
+        const leveldb::Slice value = it->value();
+        const bool binaryValue = value.size() > 0 && value[0] == binaryMarker;
+        const std::string newKey = fromLegacyKey(key);
+        if(binaryValue && newKey.empty()) {
+            continue;
+        }
+
+        const std::string newValue = binaryValue ? value.ToString() :
+                                     toBinary(toJson(value.ToString()));
+        if(newKey.empty()) {
+            batch.Put(key, newValue);
+        } else {
+            batch.Delete(key);
+            batch.Put(newKey, newValue);
+        }
+        batchSize++;
+
+        if(batchSize >= 10000) {
+            const leveldb::Status status = db->write(leveldb::WriteOptions(), &batch);
+            if(!status.ok()) {
+                throw std::runtime_error("Failed to migrate the database " + status.ToString());
+            }
+            batch.Clear();
+            batchSize = 0;
+        }
+    }
+
+    batch.Put(formatKey, toBinary(Json::Value(formatVersion)));
+
+    leveldb::WriteOptions options;
+    options.sync = true;
+
+    const leveldb::Status status = db->write(options, &batch);
+    if(!status.ok()) {
+        throw std::runtime_error("Failed to migrate the database " + status.ToString());
     }
 }
 
 CryptoKernel::Storage::~Storage() {
+    {
+        std::lock_guard<std::mutex> lock(syncMutex);
+        running = false;
+    }
+    syncCondition.notify_all();
+    if(syncThread) {
+        syncThread->join();
+    }
+
+    compactor.reset();
+    readPool.reset();
+
+    try {
+        flush();
+    } catch(const std::runtime_error& e) {
+        // Nothing more can be done while closing the database
+    }
+
     dbMutex.lock();
-    delete db;
+    db.reset();
     dbMutex.unlock();
 }
 
+void CryptoKernel::Storage::setDurability(const Durability durability) {
+    {
+        std::lock_guard<std::mutex> lock(syncMutex);
+        this->durability = durability;
+        if(durability == DURABILITY_SYNC) {
+            flushLocked();
+        }
+
+        if(durability == DURABILITY_GROUP && !syncThread) {
+            syncThread.reset(new std::thread(&CryptoKernel::Storage::syncFunc, this));
+        }
+    }
+    syncCondition.notify_all();
+}
+
+CryptoKernel::Storage::Durability CryptoKernel::Storage::getDurability() {
+    std::lock_guard<std::mutex> lock(syncMutex);
+    return durability;
+}
+
+void CryptoKernel::Storage::flush() {
+    std::lock_guard<std::mutex> lock(syncMutex);
+    flushLocked();
+}
+
+void CryptoKernel::Storage::flushLocked() {
+    if(!unsynced) {
+        return;
+    }
+
+    // A synced write also syncs every unsynced write before it, so an
+    // empty batch is enough to make all earlier commits durable
+    leveldb::WriteBatch batch;
+    leveldb::WriteOptions options;
+    options.sync = true;
+
+    const leveldb::Status status = db->write(options, &batch);
+    if(!status.ok()) {
+        throw std::runtime_error("Could not sync the database " + status.ToString());
+    }
+
+    unsynced = false;
+    unsyncedBytes = 0;
+}
+
+void CryptoKernel::Storage::syncFunc() {
+    std::unique_lock<std::mutex> lock(syncMutex);
+    while(running) {
+        if(durability == DURABILITY_GROUP && unsynced) {
+            const auto deadline = firstUnsynced + groupCommitInterval;
+            if(std::chrono::steady_clock::now() >= deadline) {
+                try {
+                    flushLocked();
+                } catch(const std::runtime_error& e) {
+                    // Retried on the next commit or interval
+                }
+            } else {
+                syncCondition.wait_until(lock, deadline);
+            }
+        } else {
+            syncCondition.wait(lock);
+        }
+    }
+}
+
 Json::Value CryptoKernel::Storage::toJson(const std::string& json) {
     Json::Value returning;
     Json::CharReaderBuilder rbuilder;
@@ -69,9 +606,43 @@ std::string CryptoKernel::Storage::toString(const Json::Value& json, const bool
     }
 }
 
+std::string CryptoKernel::Storage::toBinary(const Json::Value& json) {
+    std::string returning;
+    appendBinary(returning, json);
+
+    return returning;
+}
+
+void CryptoKernel::Storage::appendBinary(std::string& out, const Json::Value& json) {
+    out.push_back(binaryMarker);
+    writeValue(out, json);
+}
+
+Json::Value CryptoKernel::Storage::fromBinary(const std::string& data) {
+    return fromBinary(data.data(), data.size());
+}
+
+Json::Value CryptoKernel::Storage::fromBinary(const char* data, const size_t size) {
+    if(size == 0) {
+        return Json::Value();
+    }
+
+    if(data[0] != binaryMarker) {
+        return toJson(std::string(data, size));
+    }
+
+    const char* pos = data + 1;
+    Json::Value returning;
+    if(!readValue(pos, data + size, returning)) {
+        return Json::Value();
+    }
+
+    return returning;
+}
+
 bool CryptoKernel::Storage::destroy(const std::string& filename) {
-    leveldb::Options options;
-    leveldb::DestroyDB(filename, options);
+    LevelDBBackend::destroy(filename);
+    MemoryBackend::destroy(filename);
 
     return true;
 }
@@ -85,19 +656,224 @@ CryptoKernel::Storage::Transaction* CryptoKernel::Storage::begin(
     return new Transaction(this, mut);
 }
 
-CryptoKernel::Storage::Transaction::Transaction(CryptoKernel::Storage* db) {
-    db->dbMutex.lock();
+CryptoKernel::Storage::Transaction* CryptoKernel::Storage::beginReadOnly() {
+    return new Transaction(this, true);
+}
+
+uint64_t CryptoKernel::Storage::getSequence() {
+    return cache->getSequence();
+}
+
+uint64_t CryptoKernel::Storage::getOldestSnapshot() {
+    std::lock_guard<std::mutex> lock(snapshotsMutex);
+    return snapshots.empty() ? cache->getSequence() : *snapshots.begin();
+}
+
+Json::Value CryptoKernel::Storage::getCacheStats() {
+    return cache->getStats();
+}
+
+Json::Value CryptoKernel::Storage::getStats() {
+    Json::Value returning = stats->getStats();
+    returning["cache"] = cache->getStats();
+    returning["engine"] = db->getProperties();
+    returning["compaction"] = compactor->getStatus();
+
+    returning["filters"] = Json::Value(Json::objectValue);
+    for(unsigned int id = 0; id < 256; id++) {
+        const Filter* filter = filters[id];
+        if(filter != nullptr) {
+            returning["filters"][getTableName(std::string(1, static_cast<char>(id)))] =
+                filter->getStats();
+        }
+    }
+
+    return returning;
+}
+
+uint64_t CryptoKernel::Storage::getApproximateSize() {
+    return db->getApproximateSize();
+}
+
+void CryptoKernel::Storage::compact(const std::vector<std::string>& tables,
+                                    const bool whenIdle) {
+    if(tables.empty()) {
+        compactor->queue("database", "", "", whenIdle);
+    }
+
+    for(const std::string& name : tables) {
+        // Prefixes end in an id byte below namedTableId or the NUL after a
+        // table name, so incrementing it gives the end of the table
+        const std::string begin = tableKeyPrefix(name);
+        std::string end = begin;
+        end.back()++;
+        compactor->queue(name, begin, end, whenIdle);
+    }
+}
+
+Json::Value CryptoKernel::Storage::getCompactionStatus() {
+    return compactor->getStatus();
+}
+
+void CryptoKernel::Storage::enableFilter(Table& table) {
+    // Every key of a table with an id starts with the id byte
+    const std::string prefix = table.getKey("").substr(0, 1);
+    const uint8_t id = static_cast<uint8_t>(prefix[0]);
+    if(id == namedTableId) {
+        throw std::runtime_error("Filters can only be kept for tables with an id");
+    }
+
+    // Commits wait while the filter is built, so it holds exactly the keys
+    // of the latest commit
+    std::lock_guard<std::mutex> lock(dbMutex);
+    if(filters[id] != nullptr) {
+        return;
+    }
+
+    std::string end = prefix;
+    end.back()++;
+    const uint64_t expectedKeys = std::max(db->getApproximateSize(prefix, end) / minFilterRowSize,
+                                           minFilterKeys);
+    std::unique_ptr<Filter> filter(new Filter(expectedKeys, filterFalsePositiveRate,
+                                   cache->getSequence()));
+
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    std::unique_ptr<leveldb::Iterator> it(db->newIterator(options));
+    for(it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+        filter->insert(it->key().ToString());
+    }
+
+    filters[id] = filter.get();
+    ownedFilters.push_back(std::move(filter));
+}
+
+CryptoKernel::Storage::Filter* CryptoKernel::Storage::getFilter(const std::string& key) {
+    return key.empty() ? nullptr : filters[static_cast<uint8_t>(key[0])].load();
+}
+
+Json::Value CryptoKernel::Storage::checkpoint(const std::string& directory,
+        const std::function<bool(const uint64_t keys, const uint64_t bytes)>& progress) {
+    if(leveldb::Env::Default()->FileExists(directory)) {
+        throw std::runtime_error("Checkpoint directory " + directory + " already exists");
+    }
+
+    // Readers never block writers, so copying from a snapshot lets commits
+    // carry on while the checkpoint is written
+    const leveldb::Snapshot* snapshot = db->getSnapshot();
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    try {
+        std::unique_ptr<LevelDBBackend> target(new LevelDBBackend(directory));
+
+        leveldb::ReadOptions options;
+        options.snapshot = snapshot;
+        options.fill_cache = false;
+        std::unique_ptr<leveldb::Iterator> it(db->newIterator(options));
+
+        leveldb::WriteBatch batch;
+        uint64_t batchSize = 0;
+        for(it->SeekToFirst(); it->Valid(); it->Next()) {
+            batch.Put(it->key(), it->value());
+            batchSize += it->key().size() + it->value().size();
+            keys++;
+
+            if(batchSize >= checkpointBatchBytes) {
+                const leveldb::Status status = target->write(leveldb::WriteOptions(), &batch);
+                if(!status.ok()) {
+                    throw std::runtime_error("Failed to write checkpoint " + status.ToString());
+                }
+                batch.Clear();
+                bytes += batchSize;
+                batchSize = 0;
+
+                if(progress && !progress(keys, bytes)) {
+                    throw std::runtime_error("Checkpoint cancelled");
+                }
+            }
+        }
+
+        if(!it->status().ok()) {
+            throw std::runtime_error("Failed to read database for checkpoint " + it->status().ToString());
+        }
+
+        leveldb::WriteOptions writeOptions;
+        writeOptions.sync = true;
+        const leveldb::Status status = target->write(writeOptions, &batch);
+        if(!status.ok()) {
+            throw std::runtime_error("Failed to write checkpoint " + status.ToString());
+        }
+        bytes += batchSize;
+
+        if(progress) {
+            progress(keys, bytes);
+        }
+    } catch(const std::runtime_error& e) {
+        db->releaseSnapshot(snapshot);
+        LevelDBBackend::destroy(directory);
+        throw;
+    }
+    db->releaseSnapshot(snapshot);
+
+    Json::Value returning;
+    returning["keys"] = static_cast<Json::UInt64>(keys);
+    returning["bytes"] = static_cast<Json::UInt64>(bytes);
+
+    return returning;
+}
+
+std::string CryptoKernel::Storage::getTableName(const std::string& key) {
+    const uint8_t id = key.empty() ? 0 : static_cast<uint8_t>(key[0]);
+    if(id == 0) {
+        return "metadata";
+    } else if(id == namedTableId) {
+        return key.substr(1, key.find('\0', 1) - 1);
+    }
+
+    for(const auto& table : builtinTableIds) {
+        if(table.second == id) {
+            return table.first;
+        }
+    }
+
+    return "table" + std::to_string(id);
+}
+
+CryptoKernel::Storage::Transaction::Transaction(CryptoKernel::Storage* db,
+        const bool readonly) {
+    if(readonly) {
+        // Read the sequence before taking the snapshot so the snapshot is
+        // never older than the cache entries this transaction accepts
+        std::lock_guard<std::mutex> lock(db->snapshotsMutex);
+        sequence = db->cache->getSequence();
+        snapshot = db->db->getSnapshot();
+        db->snapshots.insert(sequence);
+    } else {
+        const auto start = std::chrono::steady_clock::now();
+        db->dbMutex.lock();
+        db->stats->recordLockWait(microsSince(start));
+        sequence = db->cache->getSequence();
+        snapshot = nullptr;
+    }
     this->db = db;
+    this->readonly = readonly;
     mut = nullptr;
     finished = false;
+    writeSet.reset(new WriteSet(db->writeSetBudget, db->jsonValues));
 }
 
 CryptoKernel::Storage::Transaction::Transaction(CryptoKernel::Storage* db,
         std::recursive_mutex& mut) {
+    const auto start = std::chrono::steady_clock::now();
     db->dbMutex.lock();
+    db->stats->recordLockWait(microsSince(start));
     this->db = db;
     this->mut = &mut;
+    readonly = false;
+    snapshot = nullptr;
+    sequence = db->cache->getSequence();
     finished = false;
+    writeSet.reset(new WriteSet(db->writeSetBudget, db->jsonValues));
 }
 
 CryptoKernel::Storage::Transaction::~Transaction() {
@@ -114,26 +890,126 @@ bool CryptoKernel::Storage::Transaction::ended() {
     return finished;
 }
 
+bool CryptoKernel::Storage::Transaction::isReadOnly() const {
+    return readonly;
+}
+
+uint64_t CryptoKernel::Storage::Transaction::getSequence() const {
+    return sequence;
+}
+
 void CryptoKernel::Storage::Transaction::commit() {
     if(!finished) {
+        if(readonly) {
+            abort();
+            return;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+
+        // Values were encoded when they were staged
         leveldb::WriteBatch batch;
-        for(auto& update : dbStateCache) {
+        std::vector<std::string> keys;
+        std::vector<size_t> sizes;
+        uint64_t batchSize = 0;
+        const auto& entries = writeSet->getEntries();
+        keys.reserve(entries.size());
+        sizes.reserve(entries.size());
+        for(const auto& update : entries) {
             if(update.second.erased) {
                 batch.Delete(update.first);
             } else {
-                batch.Put(update.first, CryptoKernel::Storage::toString(update.second.data));
+                batch.Put(update.first, writeSet->getEncoded(update.second));
             }
+            keys.push_back(update.first);
+            sizes.push_back(update.second.size);
+            batchSize += update.first.size() + update.second.size;
         }
 
         leveldb::WriteOptions options;
-        options.sync = true;
+        {
+            std::lock_guard<std::mutex> lock(db->syncMutex);
+            switch(db->durability) {
+            case DURABILITY_SYNC:
+                options.sync = true;
+                break;
+            case DURABILITY_GROUP:
+                // This commit closes the group if the group would grow too
+                // large or its first commit has waited long enough
+                options.sync = db->unsyncedBytes + batchSize >= db->groupCommitBytes
+                               || (db->unsynced && std::chrono::steady_clock::now() >=
+                                   db->firstUnsynced + db->groupCommitInterval);
+                break;
+            case DURABILITY_NONE:
+                options.sync = false;
+                break;
+            }
+        }
+
+        // Keys are added to the filters before they can be read from the
+        // engine, so a filter never misses a committed key
+        for(const auto& update : entries) {
+            Filter* filter = db->getFilter(update.first);
+            if(filter != nullptr) {
+                if(update.second.erased) {
+                    filter->recordErase();
+                } else {
+                    filter->insert(update.first);
+                }
+            }
+        }
 
-        leveldb::Status status = db->db->Write(options, &batch);
+        db->cache->beginCommit(keys);
+
+        leveldb::Status status = db->db->write(options, &batch);
 
         if(!status.ok()) {
+            db->cache->abortCommit();
             throw std::runtime_error("Could not commit transaction " + status.ToString());
         }
 
+        {
+            std::lock_guard<std::mutex> lock(db->syncMutex);
+            if(options.sync) {
+                db->unsynced = false;
+                db->unsyncedBytes = 0;
+            } else {
+                if(!db->unsynced) {
+                    db->unsynced = true;
+                    db->firstUnsynced = std::chrono::steady_clock::now();
+                }
+                db->unsyncedBytes += batchSize;
+            }
+        }
+        db->syncCondition.notify_all();
+
+        // Staged values that are still decoded are shared with the cache
+        // rather than copied. Spilled values are left to be read again.
+        std::vector<Cache::Update> updates;
+        updates.reserve(entries.size());
+        for(const auto& update : entries) {
+            if(update.second.erased) {
+                updates.push_back(Cache::Update{update.first, std::make_shared<const Json::Value>(), 0});
+            } else if(update.second.value) {
+                updates.push_back(Cache::Update{update.first, update.second.value, update.second.size});
+            }
+        }
+        db->cache->endCommit(updates);
+
+        // Erases are the only updates without an encoded value
+        for(size_t i = 0; i < keys.size(); i++) {
+            if(sizes[i] == 0) {
+                db->stats->recordErase(keys[i]);
+                db->compactor->recordErase(keys[i]);
+            } else {
+                db->stats->recordPut(keys[i], keys[i].size() + sizes[i]);
+                db->compactor->recordPut(keys[i], keys[i].size() + sizes[i]);
+            }
+        }
+        db->stats->recordCommit(microsSince(start), keys.size(), batchSize);
+        db->compactor->recordCommit();
+        db->stats->recordSpills(writeSet->getSpills());
+
         abort();
     } else {
         throw std::runtime_error("Attempted to commit finished transaction");
@@ -142,36 +1018,231 @@ void CryptoKernel::Storage::Transaction::commit() {
 
 void CryptoKernel::Storage::Transaction::abort() {
     finished = true;
-    db->dbMutex.unlock();
+    if(readonly) {
+        db->db->releaseSnapshot(snapshot);
+        snapshot = nullptr;
+
+        std::lock_guard<std::mutex> lock(db->snapshotsMutex);
+        db->snapshots.erase(db->snapshots.find(sequence));
+    } else {
+        db->dbMutex.unlock();
+    }
+}
+
+unsigned int CryptoKernel::Storage::Transaction::savepoint() {
+    if(readonly) {
+        throw std::runtime_error("Attempted to take a savepoint in a read-only transaction");
+    }
+
+    if(finished) {
+        throw std::runtime_error("Attempted to take a savepoint in a finished transaction");
+    }
+
+    return writeSet->savepoint();
+}
+
+void CryptoKernel::Storage::Transaction::rollbackTo(const unsigned int savepoint) {
+    if(finished) {
+        throw std::runtime_error("Attempted to roll back a finished transaction");
+    }
+
+    writeSet->rollbackTo(savepoint);
+}
+
+void CryptoKernel::Storage::Transaction::release(const unsigned int savepoint) {
+    if(finished) {
+        throw std::runtime_error("Attempted to release a savepoint of a finished transaction");
+    }
+
+    writeSet->release(savepoint);
 }
 
 void CryptoKernel::Storage::Transaction::put(const std::string& key,
         const Json::Value& data) {
-    dbStateCache[key] = dbObject{data, false};
+    if(readonly) {
+        throw std::runtime_error("Attempted to write in a read-only transaction");
+    }
+
+    writeSet->put(key, data);
 }
 
 void CryptoKernel::Storage::Transaction::erase(const std::string& key) {
-    dbStateCache[key] = dbObject{Json::Value(), true};
+    if(readonly) {
+        throw std::runtime_error("Attempted to write in a read-only transaction");
+    }
+
+    writeSet->erase(key);
 }
 
 Json::Value CryptoKernel::Storage::Transaction::get(const std::string& key) {
-    const auto it = dbStateCache.find(key);
-    if(it != dbStateCache.end()) {
-        return it->second.data;
+    return *getShared(key);
+}
+
+std::shared_ptr<const Json::Value> CryptoKernel::Storage::Transaction::getShared(
+    const std::string& key) {
+    const WriteSet::Entry* entry = writeSet->find(key);
+    if(entry != nullptr) {
+        db->stats->recordGet(key, true, 0);
+        if(entry->erased) {
+            return nullValue;
+        }
+        return writeSet->getValue(*entry);
     } else {
+        std::shared_ptr<const Json::Value> value;
+        if(db->cache->get(key, sequence, value)) {
+            db->stats->recordGet(key, true, 0);
+            return value;
+        }
+
+        Filter* filter = db->getFilter(key);
+        if(filter != nullptr && sequence < filter->getValidFrom()) {
+            filter = nullptr;
+        }
+        if(filter != nullptr && !filter->mayContain(key)) {
+            filter->recordLookup(false, false);
+            db->stats->recordGet(key, true, 0);
+            return nullValue;
+        }
+
+        leveldb::ReadOptions options;
+        options.snapshot = snapshot;
         std::string data;
-        db->db->Get(leveldb::ReadOptions(), key, &data);
-        return CryptoKernel::Storage::toJson(data);
+        const bool found = db->db->get(options, key, &data).ok();
+        db->stats->recordGet(key, false, data.size());
+        if(filter != nullptr) {
+            filter->recordLookup(true, found);
+        }
+
+        value = std::make_shared<const Json::Value>(CryptoKernel::Storage::fromBinary(data));
+        db->cache->insert(key, sequence, value, data.size());
+
+        return value;
     }
 }
 
+void CryptoKernel::Storage::Transaction::read(const std::vector<std::string>& keys,
+        std::vector<std::shared_ptr<const Json::Value>>& values) {
+    values.resize(keys.size());
+
+    std::vector<size_t> misses;
+    for(size_t i = 0; i < keys.size(); i++) {
+        const WriteSet::Entry* entry = writeSet->find(keys[i]);
+        if(entry != nullptr) {
+            db->stats->recordGet(keys[i], true, 0);
+            values[i] = entry->erased ? nullValue : writeSet->getValue(*entry);
+        } else if(db->cache->get(keys[i], sequence, values[i])) {
+            db->stats->recordGet(keys[i], true, 0);
+        } else {
+            Filter* filter = db->getFilter(keys[i]);
+            if(filter != nullptr && sequence >= filter->getValidFrom()
+               && !filter->mayContain(keys[i])) {
+                filter->recordLookup(false, false);
+                db->stats->recordGet(keys[i], true, 0);
+                values[i] = nullValue;
+            } else {
+                misses.push_back(i);
+            }
+        }
+    }
+
+    // Write transactions hold the write lock, so reading the latest
+    // commit is the same as reading a snapshot
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot;
+    db->readPool->run(misses.size(), [&](const size_t miss) {
+        const std::string& key = keys[misses[miss]];
+        std::string data;
+        const bool found = db->db->get(options, key, &data).ok();
+        db->stats->recordGet(key, false, data.size());
+
+        Filter* filter = db->getFilter(key);
+        if(filter != nullptr && sequence >= filter->getValidFrom()) {
+            filter->recordLookup(true, found);
+        }
+
+        const auto value = std::make_shared<const Json::Value>(
+                               CryptoKernel::Storage::fromBinary(data));
+        db->cache->insert(key, sequence, value, data.size());
+        values[misses[miss]] = value;
+    });
+}
+
+std::vector<Json::Value> CryptoKernel::Storage::Transaction::getMany(
+    const std::vector<std::string>& keys) {
+    std::vector<std::shared_ptr<const Json::Value>> values;
+    read(keys, values);
+
+    std::vector<Json::Value> returning;
+    returning.reserve(values.size());
+    for(const auto& value : values) {
+        returning.push_back(*value);
+    }
+
+    return returning;
+}
+
+void CryptoKernel::Storage::Transaction::prefetch(const std::vector<std::string>& keys) {
+    std::vector<std::shared_ptr<const Json::Value>> values;
+    read(keys, values);
+}
+
+std::string CryptoKernel::Storage::fromLegacyKey(const std::string& key) {
+    if(key.empty() || static_cast<uint8_t>(key[0]) <= lastTableId
+       || static_cast<uint8_t>(key[0]) == namedTableId) {
+        return "";
+    }
+
+    const size_t nameEnd = key.find('/');
+    if(nameEnd == std::string::npos) {
+        return "";
+    }
+
+    const size_t indexEnd = key.find('/', nameEnd + 1);
+    uint64_t index;
+    if(indexEnd == std::string::npos
+       || !isCanonicalDecimal(key.substr(nameEnd + 1, indexEnd - nameEnd - 1), index)
+       || index > 255) {
+        return "";
+    }
+
+    std::string returning = tableKeyPrefix(key.substr(0, nameEnd));
+    returning.push_back(static_cast<char>(index));
+    writeKey(returning, key.substr(indexEnd + 1));
+
+    return returning;
+}
+
 CryptoKernel::Storage::Table::Table(const std::string& name) {
     tableName = name;
+    tablePrefix = tableKeyPrefix(name);
+}
+
+CryptoKernel::Storage::Table::Table(const std::string& name, const unsigned int id) {
+    if(id <= lastBuiltinTableId || id > lastTableId) {
+        throw std::runtime_error("Table id " + std::to_string(id) + " is out of range");
+    }
+
+    tableName = name;
+    tablePrefix = std::string(1, static_cast<char>(id));
+}
+
+std::string CryptoKernel::Storage::Table::getPrefix(const int index) {
+    if(index < -1 || index > 254) {
+        throw std::runtime_error("Table index " + std::to_string(index) + " is out of range");
+    }
+
+    std::string returning = tablePrefix;
+    returning.push_back(static_cast<char>(index + 1));
+
+    return returning;
 }
 
 std::string CryptoKernel::Storage::Table::getKey(const std::string& key,
         const int index) {
-    return tableName + "/" + std::to_string(index + 1) + "/" + key;
+    std::string returning = getPrefix(index);
+    writeKey(returning, key);
+
+    return returning;
 }
 
 void CryptoKernel::Storage::Table::put(Transaction* transaction, const std::string& key,
@@ -189,41 +1260,338 @@ Json::Value CryptoKernel::Storage::Table::get(Transaction* transaction,
     return transaction->get(getKey(key, index));
 }
 
-CryptoKernel::Storage::Table::Iterator::Iterator(Table* table, Storage* db) {
+std::shared_ptr<const Json::Value> CryptoKernel::Storage::Table::getShared(
+    Transaction* transaction, const std::string& key, const int index) {
+    return transaction->getShared(getKey(key, index));
+}
+
+std::vector<Json::Value> CryptoKernel::Storage::Table::getMany(Transaction* transaction,
+        const std::vector<std::string>& keys, const int index) {
+    std::vector<std::string> dbKeys;
+    dbKeys.reserve(keys.size());
+    for(const std::string& key : keys) {
+        dbKeys.push_back(getKey(key, index));
+    }
+
+    return transaction->getMany(dbKeys);
+}
+
+void CryptoKernel::Storage::Table::prefetch(Transaction* transaction,
+        const std::vector<std::string>& keys, const int index) {
+    std::vector<std::string> dbKeys;
+    dbKeys.reserve(keys.size());
+    for(const std::string& key : keys) {
+        dbKeys.push_back(getKey(key, index));
+    }
+
+    transaction->prefetch(dbKeys);
+}
+
+CryptoKernel::Storage::Table::Iterator::Iterator(Table* table, Storage* db,
+        const int index) {
+    transaction = nullptr;
+    overlay = nullptr;
+
+    it = db->db->newIterator(leveldb::ReadOptions());
+
+    init(table, db, index);
+}
+
+CryptoKernel::Storage::Table::Iterator::Iterator(Table* table, Transaction* transaction,
+        const int index) {
+    this->transaction = transaction;
+    overlay = transaction->writeSet.get();
+
+    leveldb::ReadOptions options;
+    options.snapshot = transaction->snapshot;
+    it = transaction->db->db->newIterator(options);
+
+    init(table, transaction->db, index);
+}
+
+void CryptoKernel::Storage::Table::Iterator::init(Table* table, Storage* db,
+        const int index) {
     this->table = table;
     this->db = db;
-    db->dbMutex.lock();
+    this->index = index;
 
-    it = db->db->NewIterator(leveldb::ReadOptions());
+    prefix = table->getPrefix(index);
+    lowerBound = prefix;
 
-    prefix = table->getKey("");
+    // The smallest key greater than every key starting with the prefix
+    upperBound = prefix;
+    while(!upperBound.empty() && static_cast<uint8_t>(upperBound.back()) == 0xff) {
+        upperBound.pop_back();
+    }
+    if(!upperBound.empty()) {
+        upperBound.back() = static_cast<char>(static_cast<uint8_t>(upperBound.back()) + 1);
+    }
+
+    forward = true;
+    valid = false;
+    fromOverlay = false;
+    keyDecoded = false;
+    valueDecoded = false;
+    overlayPos = 0;
 }
 
 CryptoKernel::Storage::Table::Iterator::~Iterator() {
     delete it;
-    db->dbMutex.unlock();
+}
+
+void CryptoKernel::Storage::Table::Iterator::setLowerBound(const std::string& key) {
+    lowerBound = table->getKey(key, index);
+}
+
+void CryptoKernel::Storage::Table::Iterator::setUpperBound(const std::string& key) {
+    upperBound = table->getKey(key, index);
+}
+
+bool CryptoKernel::Storage::Table::Iterator::overlayValid() {
+    return overlayKeys && overlayPos < overlayKeys->size();
+}
+
+const std::string& CryptoKernel::Storage::Table::Iterator::overlayKey() {
+    return *(*overlayKeys)[overlayPos];
+}
+
+/* Positions the staged writes at the first key at or after the target, or
+   strictly after it. Seeking refreshes the sorted staged keys, so writes
+   staged since the last seek become visible. */
+void CryptoKernel::Storage::Table::Iterator::overlaySeek(const std::string& target,
+        const bool after) {
+    if(overlay == nullptr) {
+        return;
+    }
+
+    overlayKeys = overlay->getSortedKeys();
+    const auto compare = [](const std::string* lhs, const std::string& rhs) {
+        return *lhs < rhs;
+    };
+    const auto compareAfter = [](const std::string& lhs, const std::string* rhs) {
+        return lhs < *rhs;
+    };
+    const auto it = after ?
+                    std::upper_bound(overlayKeys->begin(), overlayKeys->end(), target, compareAfter) :
+                    std::lower_bound(overlayKeys->begin(), overlayKeys->end(), target, compare);
+    overlayPos = it - overlayKeys->begin();
+}
+
+/* Positions the staged writes at the last key before the target, or the
+   last key if the target is empty */
+void CryptoKernel::Storage::Table::Iterator::overlaySeekBefore(const std::string& target) {
+    if(overlay == nullptr) {
+        return;
+    }
+
+    if(target.empty()) {
+        overlayKeys = overlay->getSortedKeys();
+        overlayPos = overlayKeys->size();
+    } else {
+        overlaySeek(target, false);
+    }
+
+    // Stepping back from the first key leaves the position past the end
+    overlayPos = overlayPos == 0 ? overlayKeys->size() : overlayPos - 1;
+}
+
+void CryptoKernel::Storage::Table::Iterator::setCurrent(const bool fromOverlay) {
+    this->fromOverlay = fromOverlay;
+    if(fromOverlay) {
+        currentKey = overlayKey();
+    } else {
+        const leveldb::Slice key = it->key();
+        currentKey.assign(key.data(), key.size());
+    }
+    valid = true;
+    keyDecoded = false;
+    valueDecoded = false;
+}
+
+void CryptoKernel::Storage::Table::Iterator::findSmallest() {
+    if(it->Valid() && overlayValid()) {
+        // Staged writes shadow the stored value of the same key
+        setCurrent(it->key().compare(overlayKey()) >= 0);
+    } else if(it->Valid() || overlayValid()) {
+        setCurrent(!it->Valid());
+    } else {
+        valid = false;
+    }
+}
+
+void CryptoKernel::Storage::Table::Iterator::findLargest() {
+    if(it->Valid() && overlayValid()) {
+        setCurrent(it->key().compare(overlayKey()) <= 0);
+    } else if(it->Valid() || overlayValid()) {
+        setCurrent(!it->Valid());
+    } else {
+        valid = false;
+    }
+}
+
+void CryptoKernel::Storage::Table::Iterator::skipForward() {
+    while(true) {
+        findSmallest();
+        if(!valid) {
+            return;
+        }
+
+        if(!upperBound.empty() && currentKey >= upperBound) {
+            valid = false;
+            return;
+        }
+
+        if(!fromOverlay || !overlay->find(currentKey)->erased) {
+            return;
+        }
+
+        stepForward();
+    }
+}
+
+void CryptoKernel::Storage::Table::Iterator::skipBackward() {
+    while(true) {
+        findLargest();
+        if(!valid) {
+            return;
+        }
+
+        if(currentKey < lowerBound) {
+            valid = false;
+            return;
+        }
+
+        if(!fromOverlay || !overlay->find(currentKey)->erased) {
+            return;
+        }
+
+        stepBackward();
+    }
+}
+
+void CryptoKernel::Storage::Table::Iterator::stepForward() {
+    if(it->Valid() && it->key() == leveldb::Slice(currentKey)) {
+        it->Next();
+    }
+
+    if(overlayValid() && overlayKey() == currentKey) {
+        overlayPos++;
+    }
+}
+
+void CryptoKernel::Storage::Table::Iterator::stepBackward() {
+    if(it->Valid() && it->key() == leveldb::Slice(currentKey)) {
+        it->Prev();
+    }
+
+    if(overlayValid() && overlayKey() == currentKey) {
+        overlayPos = overlayPos == 0 ? overlayKeys->size() : overlayPos - 1;
+    }
 }
 
 void CryptoKernel::Storage::Table::Iterator::SeekToFirst() {
-    it->Seek(prefix);
+    seekTo(lowerBound);
 }
 
-bool CryptoKernel::Storage::Table::Iterator::Valid() {
+void CryptoKernel::Storage::Table::Iterator::Seek(const std::string& key) {
+    seekTo(std::max(lowerBound, table->getKey(key, index)));
+}
+
+void CryptoKernel::Storage::Table::Iterator::seekTo(const std::string& target) {
+    forward = true;
+    it->Seek(target);
+    overlaySeek(target, false);
+
+    skipForward();
+}
+
+void CryptoKernel::Storage::Table::Iterator::SeekToLast() {
+    forward = false;
+    if(upperBound.empty()) {
+        it->SeekToLast();
+    } else {
+        seekBefore(upperBound);
+    }
+
+    overlaySeekBefore(upperBound);
+
+    skipBackward();
+}
+
+void CryptoKernel::Storage::Table::Iterator::seekBefore(const std::string& target) {
+    it->Seek(target);
     if(it->Valid()) {
-        return it->key().ToString().compare(0, prefix.size(), prefix) == 0;
+        it->Prev();
     } else {
-        return false;
+        it->SeekToLast();
     }
 }
 
+bool CryptoKernel::Storage::Table::Iterator::Valid() {
+    return valid;
+}
+
 void CryptoKernel::Storage::Table::Iterator::Next() {
-    it->Next();
+    if(!valid) {
+        return;
+    }
+
+    if(forward) {
+        stepForward();
+    } else {
+        // Move both sources to the first key after the current one
+        forward = true;
+        it->Seek(currentKey);
+        if(it->Valid() && it->key() == leveldb::Slice(currentKey)) {
+            it->Next();
+        }
+        overlaySeek(currentKey, true);
+    }
+
+    skipForward();
 }
 
-std::string CryptoKernel::Storage::Table::Iterator::key() {
-    return it->key().ToString().substr(prefix.size());
+void CryptoKernel::Storage::Table::Iterator::Prev() {
+    if(!valid) {
+        return;
+    }
+
+    if(!forward) {
+        stepBackward();
+    } else {
+        // Move both sources to the last key before the current one
+        forward = false;
+        seekBefore(currentKey);
+        overlaySeekBefore(currentKey);
+    }
+
+    skipBackward();
+}
+
+const std::string& CryptoKernel::Storage::Table::Iterator::key() {
+    if(!keyDecoded) {
+        decodedKey = readKey(currentKey.data() + prefix.size(), currentKey.size() - prefix.size());
+        keyDecoded = true;
+    }
+
+    return decodedKey;
 }
 
-Json::Value CryptoKernel::Storage::Table::Iterator::value() {
-    return CryptoKernel::Storage::toJson(it->value().ToString());
+const Json::Value& CryptoKernel::Storage::Table::Iterator::value() {
+    if(fromOverlay) {
+        if(!valueDecoded) {
+            overlayValue = overlay->getValue(*overlay->find(currentKey));
+            valueDecoded = true;
+        }
+        return *overlayValue;
+    }
+
+    if(!valueDecoded) {
+        const leveldb::Slice value = it->value();
+        decodedValue = CryptoKernel::Storage::fromBinary(value.data(), value.size());
+        valueDecoded = true;
+        db->stats->recordScan(currentKey, value.size());
+    }
+
+    return decodedValue;
 }
@@ -19,6 +19,14 @@
 #define STORAGE_H_INCLUDED
 
 #include <mutex>
+#include <set>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <functional>
+#include <atomic>
 
 #include <json/writer.h>
 #include <json/reader.h>
@@ -27,30 +35,137 @@
 namespace CryptoKernel {
 /**
 * The storage class provide a key-value json storage database
-* interface. This particular implementation uses LevelDB as the
-* underlying storage. It provides functions for saving, retrieving,
-* deleting and iterating over the database.
+* interface. The underlying key-value engine is pluggable, by default
+* LevelDB is used. It provides functions for saving, retrieving,
+* deleting and iterating over the database. Values are stored in a
+* compact binary encoding of their json representation.
 */
 class Storage {
 public:
+    class Backend;
+    class LevelDBBackend;
+    class MemoryBackend;
+    class Cache;
+    class Compactor;
+    class Filter;
+    class ReadPool;
+    class Stats;
+    class WriteSet;
+    class Table;
+
     /**
     * Constructs a storage database in the given directory. If no database
     * is found in the given directory then it is created. Otherwise open
-    * the existing database.
+    * the existing database. Databases written with json text values are
+    * migrated to the binary value encoding on first open.
+    *
+    * The engine is chosen with options["engine"]. "leveldb", the default,
+    * stores the database on disk in the given directory. "memory" keeps the
+    * database in memory, shared by every Storage opened with the same
+    * filename in this process and lost when the process exits.
+    *
+    * options["cacheSize"] sets the memory budget in MiB of the decoded
+    * value cache shared by all transactions, and defaults to 16. Zero
+    * disables the cache.
+    *
+    * options["durability"] sets the durability mode, one of "sync" (the
+    * default), "group" or "none", see Storage::Durability. In group mode
+    * options["groupCommitInterval"] (milliseconds, default 100) and
+    * options["groupCommitBytes"] (default 4 MiB) bound the window of
+    * commits that may be lost in a crash.
+    *
+    * options["writeSetSize"] sets the memory budget in MiB of the decoded
+    * values staged by each write transaction, and defaults to 64. Staged
+    * writes beyond the budget are kept only in their encoded form.
+    *
+    * Tables are compacted in the background once the bytes written to
+    * them reach options["compactionThreshold"] (MiB, default 256, zero
+    * disables it) and no commit has been made for
+    * options["compactionIdle"] (milliseconds, default 5000). Background
+    * compaction is limited to options["compactionRate"] MiB of stored data
+    * per second, default 16, zero for no limit. See Storage::compact.
+    *
+    * options["readThreads"] sets the number of threads reading keys for
+    * Transaction::getMany and Transaction::prefetch, and defaults to 4.
+    * Zero reads every key on the calling thread.
+    *
+    * options["filterFalsePositiveRate"] sets the target false positive
+    * rate of the filters kept by Storage::enableFilter, and defaults to
+    * 0.01.
     *
-    * @param filename the directory of the LevelDB database to use
-    * @throw std::runtime_error if there is a failure
+    * options["valueEncoding"] chooses how new values are written, "binary"
+    * (the default) or "json" for the legacy json text. Both are always
+    * read, so "json" is only useful to compare the two in benchmarks.
+    *
+    * @param filename the directory of the database to use, or the name of
+    *        the database for the memory engine
+    * @param options a json object of storage options, optional
+    * @throw std::runtime_error if there is a failure or the engine,
+    *        durability or value encoding is unknown
     */
-    Storage(const std::string& filename);
+    Storage(const std::string& filename, const Json::Value& options = Json::Value());
 
     /**
     * Default destructor, saves and closes the database
     */
     ~Storage();
 
+    /**
+    * How committed transactions are made durable. Commits are always
+    * applied atomically and in order, so after a crash the database holds
+    * every commit up to some point. The mode decides how recent that point
+    * is guaranteed to be.
+    */
+    enum Durability {
+        /** Every commit is synced to disk before commit() returns */
+        DURABILITY_SYNC,
+
+        /** Commits are written without syncing and synced together in one
+            write once the group commit interval or byte limit is reached */
+        DURABILITY_GROUP,
+
+        /** Commits are never synced, only flush() makes them durable */
+        DURABILITY_NONE
+    };
+
+    /**
+    * Changes the durability mode. Switching to DURABILITY_SYNC flushes any
+    * unsynced commits first.
+    *
+    * @param durability the new durability mode
+    */
+    void setDurability(const Durability durability);
+
+    /**
+    * Returns the current durability mode
+    */
+    Durability getDurability();
+
+    /**
+    * Makes every commit completed so far durable
+    *
+    * @throw std::runtime_error if the sync fails
+    */
+    void flush();
+
+    /**
+    * A set of reads and writes applied to the database atomically. Write
+    * transactions are serialised with each other and hold the database
+    * write lock until they are committed or aborted.
+    *
+    * Staged writes are kept in a hash-based write set, see
+    * Storage::WriteSet, whose memory use is bounded by the writeSetSize
+    * option.
+    *
+    * Read-only transactions take no lock. They read from a snapshot
+    * taken when they begin, so they observe the database exactly as it was
+    * after the last commit that completed before they began. Commits made
+    * while they are open are never visible to them, and they never observe
+    * a partially applied commit.
+    */
     class Transaction {
     public:
-        Transaction(Storage* db);
+        Transaction(Storage* db, const bool readonly = false);
         Transaction(Storage* db, std::recursive_mutex& mut);
 
         ~Transaction();
@@ -58,20 +173,111 @@ public:
         void commit();
         void abort();
 
+        /**
+        * Stages a write of the given value
+        *
+        * @throw std::runtime_error if the transaction is read-only
+        */
         void put(const std::string& key, const Json::Value& data);
+
+        /**
+        * Stages an erase of the given key
+        *
+        * @throw std::runtime_error if the transaction is read-only
+        */
         void erase(const std::string& key);
         Json::Value get(const std::string& key);
 
+        /**
+        * Reads a value without copying it. The value returned is shared
+        * with the cache or the staged write it came from and is never
+        * modified, so it stays valid after the key is written again or the
+        * transaction ends. Use it to inspect large values such as blocks.
+        *
+        * @param key the key to read
+        * @return the value of the key, a null value if it does not exist
+        */
+        std::shared_ptr<const Json::Value> getShared(const std::string& key);
+
+        /**
+        * Reads many keys at once. Keys that are not staged or cached are
+        * read from the engine by the read threads in parallel, and the
+        * values read are added to the shared cache.
+        *
+        * @param keys the keys to read
+        * @return the value of each key in the same order, null for keys
+        *         that do not exist
+        */
+        std::vector<Json::Value> getMany(const std::vector<std::string>& keys);
+
+        /**
+        * Reads the given keys into the shared cache in parallel without
+        * returning them, so the reads that follow are cache hits
+        *
+        * @param keys the keys to read
+        */
+        void prefetch(const std::vector<std::string>& keys);
+
         bool ended();
 
+        /**
+        * Marks the current state of the staged writes so later writes can
+        * be undone without aborting the transaction. Savepoints nest, and
+        * each one must be released or rolled back to before the next
+        * savepoint it encloses is used.
+        *
+        * @return the new savepoint
+        * @throw std::runtime_error if the transaction is read-only or
+        *        finished
+        */
+        unsigned int savepoint();
+
+        /**
+        * Undoes every write staged since the given savepoint. The
+        * savepoint stays held and savepoints taken after it are released.
+        * Iterators over this transaction must be repositioned with a seek
+        * before they are used again.
+        *
+        * @param savepoint the savepoint to roll back to
+        * @throw std::runtime_error if the savepoint is not held or the
+        *        transaction is finished
+        */
+        void rollbackTo(const unsigned int savepoint);
+
+        /**
+        * Releases the given savepoint and any savepoints taken after it,
+        * keeping the writes staged since
+        *
+        * @param savepoint the savepoint to release
+        * @throw std::runtime_error if the savepoint is not held or the
+        *        transaction is finished
+        */
+        void release(const unsigned int savepoint);
+
+        /**
+        * Returns true if this transaction reads from a snapshot and
+        * cannot write
+        */
+        bool isReadOnly() const;
+
+        /**
+        * Returns the commit sequence number this transaction reads at,
+        * see Storage::getSequence
+        */
+        uint64_t getSequence() const;
+
     private:
-        struct dbObject {
-            Json::Value data;
-            bool erased;
-        };
-        std::map<std::string, dbObject> dbStateCache;
+        friend class Table;
+
+        void read(const std::vector<std::string>& keys,
+                  std::vector<std::shared_ptr<const Json::Value>>& values);
+
+        std::unique_ptr<WriteSet> writeSet;
         Storage* db;
         bool finished;
+        bool readonly;
+        const leveldb::Snapshot* snapshot;
+        uint64_t sequence;
         std::recursive_mutex* mut;
     };
 
@@ -79,68 +285,336 @@ public:
 
     Transaction* begin(std::recursive_mutex& mut);
 
+    /**
+    * Begins a read-only transaction backed by a snapshot of the database.
+    * Any number of read-only transactions can be open alongside a write
+    * transaction.
+    *
+    * @return a new read-only transaction
+    */
+    Transaction* beginReadOnly();
+
+    /**
+    * Returns the sequence number of the last completed commit. Each
+    * commit increases it.
+    */
+    uint64_t getSequence();
+
+    /**
+    * Returns the sequence number the oldest open read-only transaction
+    * reads at, or the current sequence number if none is open, so state
+    * kept alongside the database for older snapshots can be released
+    */
+    uint64_t getOldestSnapshot();
+
+    /**
+    * Returns the counters of the shared value cache
+    *
+    * @return a json object with the cache hits, misses, evictions, entries,
+    *         approximate size in bytes and budget in bytes
+    */
+    Json::Value getCacheStats();
+
+    /**
+    * Returns every storage counter as json, to find which tables are
+    * busiest and where commits spend their time. "tables" holds the gets,
+    * cache hits and misses, iterator scans, puts, erases and bytes read and
+    * written of each table. "commitLatency" and "lockWait" are histograms
+    * in microseconds of commit() and of write transactions waiting for the
+    * database lock, "commitKeys" and "commitBytes" of the commit sizes.
+    * "writeSetSpills" counts how often write transactions spilled staged
+    * values to stay within their memory budget.
+    * "cache" holds the value cache counters and "engine" the statistics
+    * reported by the storage engine, such as LevelDB compactions and level
+    * sizes, and "compaction" the progress of background compactions.
+    * "filters" holds the size, estimated false positive rate and lookups
+    * skipped of the filter of each table with one.
+    *
+    * @return a json object of storage statistics
+    */
+    Json::Value getStats();
+
+    /**
+    * Returns the approximate size of the database in bytes
+    */
+    uint64_t getApproximateSize();
+
+    /**
+    * Writes a consistent copy of the database to a new LevelDB database in
+    * the given directory while the database stays in use. The copy is read
+    * from a snapshot, so it holds exactly the commits completed before the
+    * checkpoint began, and no lock is held so commits are not stalled. The
+    * copy is synced to disk before this returns and can be opened as a
+    * Storage with the leveldb engine. A failed or cancelled checkpoint
+    * removes the partial copy.
+    *
+    * @param directory the directory to write the copy to, which must not
+    *        exist
+    * @param progress called after every batch of keys is written with the
+    *        number of keys and bytes copied so far, returning false cancels
+    *        the checkpoint, optional
+    * @return a json object with the number of keys and bytes copied
+    * @throw std::runtime_error if the directory exists, the copy fails or
+    *        the checkpoint is cancelled
+    */
+    Json::Value checkpoint(const std::string& directory,
+                           const std::function<bool(const uint64_t keys, const uint64_t bytes)>&
+                           progress = nullptr);
+
+    /**
+    * Queues a background compaction of the given tables, which discards
+    * overwritten and erased values so reads of the tables touch fewer
+    * files. Each table is compacted in slices at the compactionRate limit,
+    * and commits carry on while it runs. Use after bulk writes or erases,
+    * such as an initial sync, to bring read latency back to its steady
+    * state sooner than the engine would on its own.
+    *
+    * @param tables the names of the tables to compact, or empty to compact
+    *        the whole database
+    * @param whenIdle true to compact only while no commits are being made,
+    *        optional and defaults to false
+    */
+    void compact(const std::vector<std::string>& tables = std::vector<std::string>(),
+                 const bool whenIdle = false);
+
+    /**
+    * Returns the progress of background compactions
+    *
+    * @return a json object with whether a compaction is running, the table
+    *         being compacted and its slices and bytes done out of the
+    *         total, the queued compactions, the bytes written to each table
+    *         since it was last compacted and the most recent compaction
+    */
+    Json::Value getCompactionStatus();
+
+    /**
+    * Keeps an in-memory Bloom filter over the keys of the given table, so
+    * reads of keys that do not exist usually return without reading the
+    * engine. The filter is built from the keys stored now, and every key
+    * committed to the table afterwards is added to it. Erased keys stay in
+    * the filter until the database is reopened. Read-only transactions
+    * that began before the filter was built do not use it. Enabling a
+    * filter twice has no effect.
+    *
+    * @param table the table to filter, which must have an id
+    * @throw std::runtime_error if the table has no id
+    */
+    void enableFilter(Table& table);
+
+    /**
+    * A named set of keys in the database. Keys are stored as a table id
+    * byte, an index byte and the key itself. Decimal integers are stored
+    * as 8 byte big-endian integers and hex ids as a digit count followed by
+    * the packed digits, so each sorts numerically within its own
+    * encoding. The encodings do not interleave: every decimal key sorts
+    * before every hex id. Any other key is stored as is, after both.
+    */
     class Table {
     public:
+        /**
+        * Constructs a table with the given name. The tables used by
+        * CryptoKernel have built-in ids. Other tables are keyed by their
+        * name, which costs a few bytes per key.
+        *
+        * @param name the name of the table
+        */
         Table(const std::string& name);
 
+        /**
+        * Constructs a table with an explicit id, which must be unique
+        * within the database
+        *
+        * @param name the name of the table
+        * @param id the id of the table, from 16 to 31
+        * @throw std::runtime_error if the id is out of range
+        */
+        Table(const std::string& name, const unsigned int id);
+
         void put(Transaction* transaction, const std::string& key, const Json::Value& data,
                  const int index = -1);
         void erase(Transaction* transaction, const std::string& key, const int index = -1);
         Json::Value get(Transaction* transaction, const std::string& key, const int index = -1);
 
+        /**
+        * Reads a value of this table without copying it, see
+        * Transaction::getShared
+        */
+        std::shared_ptr<const Json::Value> getShared(Transaction* transaction,
+                const std::string& key, const int index = -1);
+
+        /**
+        * Reads many keys of this table at once, see Transaction::getMany
+        *
+        * @param transaction the transaction to read with
+        * @param keys the keys within the table
+        * @param index the index the keys belong to
+        * @return the value of each key in the same order
+        */
+        std::vector<Json::Value> getMany(Transaction* transaction,
+                                         const std::vector<std::string>& keys,
+                                         const int index = -1);
+
+        /**
+        * Warms the shared cache with keys of this table, see
+        * Transaction::prefetch
+        */
+        void prefetch(Transaction* transaction, const std::vector<std::string>& keys,
+                      const int index = -1);
+
+        /**
+        * Iterates over the keys of one index of a table, in both directions
+        * and optionally within a range. Keys are visited in stored order:
+        * decimal integers in numeric order, then hex ids in numeric order,
+        * then any other keys bytewise.
+        *
+        * The iterator holds no lock on the database. When constructed from
+        * a transaction it reads from that transaction's snapshot, or the
+        * current database for a write transaction, with the transaction's
+        * uncommitted writes applied on top. Writes staged after the
+        * iterator is positioned may or may not be visited.
+        */
         class Iterator {
         public:
-            Iterator(Table* table, Storage* db);
+            /**
+            * Constructs an iterator over an implicit snapshot taken now
+            *
+            * @param table the table to iterate over
+            * @param db the database the table is stored in
+            * @param index the index to iterate over, optional
+            */
+            Iterator(Table* table, Storage* db, const int index = -1);
+
+            /**
+            * Constructs an iterator over the database as seen by the given
+            * transaction. The transaction must outlive the iterator.
+            *
+            * @param table the table to iterate over
+            * @param transaction the transaction to read through
+            * @param index the index to iterate over, optional
+            */
+            Iterator(Table* table, Transaction* transaction, const int index = -1);
 
             ~Iterator();
 
             /**
-            * Sets the iterator to the first key in the database
+            * Restricts the iterator to keys at or after the given key
+            */
+            void setLowerBound(const std::string& key);
+
+            /**
+            * Restricts the iterator to keys strictly before the given key
+            */
+            void setUpperBound(const std::string& key);
+
+            /**
+            * Sets the iterator to the first key in the range
             */
             void SeekToFirst();
 
             /**
-            * Determines whether there are additional keys still in the database
+            * Sets the iterator to the last key in the range
+            */
+            void SeekToLast();
+
+            /**
+            * Sets the iterator to the first key in the range at or after
+            * the given key
+            *
+            * @param key the key to seek to
+            */
+            void Seek(const std::string& key);
+
+            /**
+            * Determines whether the iterator points to a key in the range
             *
-            * @return true if there are keys after the current iterator, false otherwise
+            * @return true if the iterator points to a key, false otherwise
             */
             bool Valid();
 
             /**
-            * Shifts the iterator to the next key in the database
+            * Shifts the iterator to the next key in the range
             */
             void Next();
 
             /**
-            * Returns the current key the iterator points to
+            * Shifts the iterator to the previous key in the range
+            */
+            void Prev();
+
+            /**
+            * Returns the current key the iterator points to. The reference
+            * is valid until the iterator is moved.
             *
             * @return the key the iterator points to
             */
-            std::string key();
+            const std::string& key();
 
             /**
-            * Returns the current json value the iterator points to
+            * Returns the current json value the iterator points to. Values
+            * are only decoded when requested and the reference is valid
+            * until the iterator is moved.
             *
             * @return the json value the iterator points to
             */
-            Json::Value value();
+            const Json::Value& value();
         private:
+            void init(Table* table, Storage* db, const int index);
+            bool overlayValid();
+            const std::string& overlayKey();
+            void overlaySeek(const std::string& target, const bool after);
+            void overlaySeekBefore(const std::string& target);
+            void setCurrent(const bool fromOverlay);
+            void findSmallest();
+            void findLargest();
+            void skipForward();
+            void skipBackward();
+            void stepForward();
+            void stepBackward();
+            void seekTo(const std::string& target);
+            void seekBefore(const std::string& target);
+
             leveldb::Iterator* it;
             Table* table;
+            int index;
             Storage* db;
+            Transaction* transaction;
+            WriteSet* overlay;
+            std::shared_ptr<const std::vector<const std::string*>> overlayKeys;
+            size_t overlayPos;
+            std::shared_ptr<const Json::Value> overlayValue;
             std::string prefix;
+            std::string lowerBound;
+            std::string upperBound;
+            bool forward;
+            bool valid;
+            bool fromOverlay;
+            std::string currentKey;
+            std::string decodedKey;
+            bool keyDecoded;
+            Json::Value decodedValue;
+            bool valueDecoded;
         };
 
+        /**
+        * Returns the database key of a key in this table
+        *
+        * @param key the key within the table
+        * @param index the index the key belongs to, from -1 to 254
+        * @throw std::runtime_error if the index is out of range
+        */
         std::string getKey(const std::string& key, const int index = -1);
     private:
+        std::string getPrefix(const int index);
+
         std::string tableName;
+        std::string tablePrefix;
     };
 
 
     /**
-    * Deletes the LevelDB database in the given directory
+    * Deletes the database with the given filename from every engine
     *
-    * @param filename the directory of the database to delete
+    * @param filename the directory or name of the database to delete
     * @return true if the database was deleted successfully, false otherwise
     */
     static bool destroy(const std::string& filename);
@@ -163,9 +637,73 @@ public:
     */
     static std::string toString(const Json::Value& json, const bool pretty = false);
 
+    /**
+    * Converts a Json::Value to the compact binary encoding used for
+    * values stored in the database
+    *
+    * @param json a Json::Value to encode
+    * @return the binary encoding of the given json value
+    */
+    static std::string toBinary(const Json::Value& json);
+
+    /**
+    * Converts a stored database value back to a Json::Value. Accepts both
+    * the binary encoding and legacy json text values.
+    *
+    * @param data the stored value to decode
+    * @return a Json::Value representation of the given value, or a null
+    *         value if it could not be decoded
+    */
+    static Json::Value fromBinary(const std::string& data);
+
+    /**
+    * Converts a key in the legacy "table/index/key" text format to the
+    * binary key format
+    *
+    * @param key the legacy key to convert
+    * @return the binary key, or an empty string if the key is not a legacy
+    *         table key
+    */
+    static std::string fromLegacyKey(const std::string& key);
+
 private:
-    leveldb::DB* db;
+    static Json::Value fromBinary(const char* data, const size_t size);
+    static void appendBinary(std::string& out, const Json::Value& json);
+
+    static std::string getTableName(const std::string& key);
+
+    Filter* getFilter(const std::string& key);
+
+    void migrate();
+
+    void flushLocked();
+    void syncFunc();
+
+    std::unique_ptr<Backend> db;
+    std::unique_ptr<Cache> cache;
+    std::unique_ptr<Stats> stats;
+    std::unique_ptr<Compactor> compactor;
+    std::unique_ptr<ReadPool> readPool;
+    std::atomic<Filter*> filters[256];
+    std::vector<std::unique_ptr<Filter>> ownedFilters;
+    double filterFalsePositiveRate;
+    uint64_t writeSetBudget;
+    bool jsonValues;
     std::mutex dbMutex;
+
+    std::multiset<uint64_t> snapshots;
+    std::mutex snapshotsMutex;
+
+    Durability durability;
+    std::chrono::milliseconds groupCommitInterval;
+    uint64_t groupCommitBytes;
+    bool unsynced;
+    uint64_t unsyncedBytes;
+    std::chrono::steady_clock::time_point firstUnsynced;
+    bool running;
+    std::mutex syncMutex;
+    std::condition_variable syncCondition;
+    std::unique_ptr<std::thread> syncThread;
 };
 }
 
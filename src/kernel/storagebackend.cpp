@@ -0,0 +1,466 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+
+#include "storagebackend.h"
+
+CryptoKernel::Storage::LevelDBBackend::LevelDBBackend(const std::string& filename) {
+    leveldb::Options options;
+    options.create_if_missing = true;
+
+    leveldb::Status dbstatus = leveldb::DB::Open(options, filename, &db);
+
+    if(!dbstatus.ok()) {
+        throw std::runtime_error("Failed to open the database");
+    }
+}
+
+CryptoKernel::Storage::LevelDBBackend::~LevelDBBackend() {
+    delete db;
+}
+
+leveldb::Status CryptoKernel::Storage::LevelDBBackend::get(const leveldb::ReadOptions&
+        options, const leveldb::Slice& key, std::string* value) {
+    return db->Get(options, key, value);
+}
+
+leveldb::Status CryptoKernel::Storage::LevelDBBackend::write(const leveldb::WriteOptions&
+        options, leveldb::WriteBatch* batch) {
+    return db->Write(options, batch);
+}
+
+leveldb::Iterator* CryptoKernel::Storage::LevelDBBackend::newIterator(
+    const leveldb::ReadOptions& options) {
+    return db->NewIterator(options);
+}
+
+const leveldb::Snapshot* CryptoKernel::Storage::LevelDBBackend::getSnapshot() {
+    return db->GetSnapshot();
+}
+
+void CryptoKernel::Storage::LevelDBBackend::releaseSnapshot(const leveldb::Snapshot*
+        snapshot) {
+    db->ReleaseSnapshot(snapshot);
+}
+
+Json::Value CryptoKernel::Storage::LevelDBBackend::getProperties() {
+    Json::Value returning;
+    returning["engine"] = "leveldb";
+    returning["levels"] = Json::Value(Json::arrayValue);
+
+    double compactionTime = 0;
+    double compactionRead = 0;
+    double compactionWrite = 0;
+
+    std::string stats;
+    if(db->GetProperty("leveldb.stats", &stats)) {
+        returning["stats"] = stats;
+
+        // One row per level after the table header:
+        // Level Files Size(MB) Time(sec) Read(MB) Write(MB)
+        std::stringstream lines(stats);
+        std::string line;
+        while(std::getline(lines, line)) {
+            int level;
+            unsigned int files;
+            double size, time, read, write;
+            if(std::sscanf(line.c_str(), "%d %u %lf %lf %lf %lf", &level, &files, &size,
+                           &time, &read, &write) == 6) {
+                Json::Value levelStats;
+                levelStats["level"] = level;
+                levelStats["files"] = files;
+                levelStats["sizeMB"] = size;
+                levelStats["compactionTime"] = time;
+                levelStats["compactionReadMB"] = read;
+                levelStats["compactionWriteMB"] = write;
+                returning["levels"].append(levelStats);
+
+                compactionTime += time;
+                compactionRead += read;
+                compactionWrite += write;
+            }
+        }
+    }
+
+    returning["compaction"]["time"] = compactionTime;
+    returning["compaction"]["readMB"] = compactionRead;
+    returning["compaction"]["writeMB"] = compactionWrite;
+
+    std::string memoryUsage;
+    if(db->GetProperty("leveldb.approximate-memory-usage", &memoryUsage)) {
+        returning["memoryUsage"] = static_cast<Json::UInt64>(std::strtoull(memoryUsage.c_str(),
+                                   nullptr, 10));
+    }
+
+    return returning;
+}
+
+uint64_t CryptoKernel::Storage::LevelDBBackend::getApproximateSize() {
+    // Every key sorts before a run of 0xff bytes longer than any table
+    // prefix and key
+    const std::string limit(256, static_cast<char>(0xff));
+    const leveldb::Range range("", limit);
+    uint64_t size = 0;
+    db->GetApproximateSizes(&range, 1, &size);
+
+    return size;
+}
+
+uint64_t CryptoKernel::Storage::LevelDBBackend::getApproximateSize(const std::string& begin,
+        const std::string& end) {
+    const leveldb::Range range(begin, end);
+    uint64_t size = 0;
+    db->GetApproximateSizes(&range, 1, &size);
+
+    return size;
+}
+
+void CryptoKernel::Storage::LevelDBBackend::compactRange(const std::string& begin,
+        const std::string& end) {
+    const leveldb::Slice start(begin);
+    const leveldb::Slice limit(end);
+    db->CompactRange(&start, &limit);
+}
+
+void CryptoKernel::Storage::LevelDBBackend::destroy(const std::string& filename) {
+    leveldb::Options options;
+    leveldb::DestroyDB(filename, options);
+}
+
+std::map<std::string, std::shared_ptr<CryptoKernel::Storage::MemoryBackend::Database>>
+        CryptoKernel::Storage::MemoryBackend::databases;
+std::mutex CryptoKernel::Storage::MemoryBackend::databasesMutex;
+
+class CryptoKernel::Storage::MemoryBackend::Snapshot : public leveldb::Snapshot {
+public:
+    Snapshot(const uint64_t sequence) {
+        this->sequence = sequence;
+    }
+
+    uint64_t sequence;
+};
+
+/* Iterators copy the entry they point to and look up their neighbours by
+   key on every step, so writers are free to modify the map while an
+   iterator is open. The sequence number an iterator reads at is registered
+   as a snapshot by newIterator, so the versions it can see are never
+   pruned. */
+class CryptoKernel::Storage::MemoryBackend::Iterator : public leveldb::Iterator {
+public:
+    Iterator(std::shared_ptr<Database> database, const uint64_t sequence) {
+        this->database = database;
+        this->sequence = sequence;
+        valid = false;
+    }
+
+    ~Iterator() {
+        std::lock_guard<std::mutex> lock(database->mutex);
+        database->snapshots.erase(database->snapshots.find(sequence));
+    }
+
+    bool Valid() const {
+        return valid;
+    }
+
+    void SeekToFirst() {
+        std::lock_guard<std::mutex> lock(database->mutex);
+        forward(database->data.begin());
+    }
+
+    void SeekToLast() {
+        std::lock_guard<std::mutex> lock(database->mutex);
+        backward(database->data.end());
+    }
+
+    void Seek(const leveldb::Slice& target) {
+        std::lock_guard<std::mutex> lock(database->mutex);
+        forward(database->data.lower_bound(target.ToString()));
+    }
+
+    void Next() {
+        std::lock_guard<std::mutex> lock(database->mutex);
+        forward(database->data.upper_bound(currentKey));
+    }
+
+    void Prev() {
+        std::lock_guard<std::mutex> lock(database->mutex);
+        backward(database->data.lower_bound(currentKey));
+    }
+
+    leveldb::Slice key() const {
+        return currentKey;
+    }
+
+    leveldb::Slice value() const {
+        return currentValue;
+    }
+
+    leveldb::Status status() const {
+        return leveldb::Status::OK();
+    }
+
+private:
+    void forward(std::map<std::string, std::vector<Version>>::iterator it) {
+        for(; it != database->data.end(); it++) {
+            if(load(it)) {
+                return;
+            }
+        }
+        valid = false;
+    }
+
+    void backward(std::map<std::string, std::vector<Version>>::iterator it) {
+        while(it != database->data.begin()) {
+            it--;
+            if(load(it)) {
+                return;
+            }
+        }
+        valid = false;
+    }
+
+    bool load(std::map<std::string, std::vector<Version>>::iterator it) {
+        const Version* version = MemoryBackend::find(it->second, sequence);
+        if(version == nullptr || version->erased) {
+            return false;
+        }
+
+        currentKey = it->first;
+        currentValue = version->value;
+        valid = true;
+        return true;
+    }
+
+    std::shared_ptr<Database> database;
+    uint64_t sequence;
+    bool valid;
+    std::string currentKey;
+    std::string currentValue;
+};
+
+CryptoKernel::Storage::MemoryBackend::MemoryBackend(const std::string& name) {
+    std::lock_guard<std::mutex> lock(databasesMutex);
+    std::shared_ptr<Database>& db = databases[name];
+    if(!db) {
+        db.reset(new Database());
+        db->sequence = 0;
+    }
+    database = db;
+}
+
+CryptoKernel::Storage::MemoryBackend::~MemoryBackend() {
+
+}
+
+const CryptoKernel::Storage::MemoryBackend::Version*
+CryptoKernel::Storage::MemoryBackend::find(const std::vector<Version>& versions,
+        const uint64_t sequence) {
+    for(auto it = versions.rbegin(); it != versions.rend(); it++) {
+        if(it->sequence <= sequence) {
+            return &(*it);
+        }
+    }
+
+    return nullptr;
+}
+
+void CryptoKernel::Storage::MemoryBackend::prune(
+    std::map<std::string, std::vector<Version>>::iterator it) {
+    // Versions older than the newest one visible to the oldest open
+    // snapshot can never be read again
+    const uint64_t oldest = database->snapshots.empty() ? database->sequence :
+                            *database->snapshots.begin();
+
+    std::vector<Version>& versions = it->second;
+    size_t keep = 0;
+    for(size_t i = 0; i < versions.size(); i++) {
+        if(versions[i].sequence <= oldest) {
+            keep = i;
+        }
+    }
+
+    if(keep > 0) {
+        versions.erase(versions.begin(), versions.begin() + keep);
+    }
+
+    if(versions.size() == 1 && versions[0].erased && versions[0].sequence <= oldest) {
+        database->data.erase(it);
+    }
+}
+
+leveldb::Status CryptoKernel::Storage::MemoryBackend::get(const leveldb::ReadOptions&
+        options, const leveldb::Slice& key, std::string* value) {
+    std::lock_guard<std::mutex> lock(database->mutex);
+
+    const uint64_t sequence = options.snapshot != nullptr ?
+                              static_cast<const Snapshot*>(options.snapshot)->sequence :
+                              database->sequence;
+
+    const auto it = database->data.find(key.ToString());
+    if(it != database->data.end()) {
+        const Version* version = find(it->second, sequence);
+        if(version != nullptr && !version->erased) {
+            *value = version->value;
+            return leveldb::Status::OK();
+        }
+    }
+
+    return leveldb::Status::NotFound(key);
+}
+
+leveldb::Status CryptoKernel::Storage::MemoryBackend::write(const leveldb::WriteOptions&
+        options, leveldb::WriteBatch* batch) {
+    class Writer : public leveldb::WriteBatch::Handler {
+    public:
+        Writer(Database* database, const uint64_t sequence) {
+            this->database = database;
+            this->sequence = sequence;
+        }
+
+        void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+            database->data[key.ToString()].push_back(Version{sequence, false, value.ToString()});
+            keys.push_back(key.ToString());
+        }
+
+        void Delete(const leveldb::Slice& key) {
+            const auto it = database->data.find(key.ToString());
+            if(it != database->data.end()) {
+                it->second.push_back(Version{sequence, true, ""});
+                keys.push_back(key.ToString());
+            }
+        }
+
+        std::vector<std::string> keys;
+
+    private:
+        Database* database;
+        uint64_t sequence;
+    };
+
+    std::lock_guard<std::mutex> lock(database->mutex);
+
+    Writer writer(database.get(), database->sequence + 1);
+    const leveldb::Status status = batch->Iterate(&writer);
+    if(!status.ok()) {
+        return status;
+    }
+
+    database->sequence++;
+
+    for(const std::string& key : writer.keys) {
+        const auto it = database->data.find(key);
+        if(it != database->data.end()) {
+            prune(it);
+        }
+    }
+
+    return leveldb::Status::OK();
+}
+
+leveldb::Iterator* CryptoKernel::Storage::MemoryBackend::newIterator(
+    const leveldb::ReadOptions& options) {
+    std::lock_guard<std::mutex> lock(database->mutex);
+
+    const uint64_t sequence = options.snapshot != nullptr ?
+                              static_cast<const Snapshot*>(options.snapshot)->sequence :
+                              database->sequence;
+    database->snapshots.insert(sequence);
+
+    return new Iterator(database, sequence);
+}
+
+const leveldb::Snapshot* CryptoKernel::Storage::MemoryBackend::getSnapshot() {
+    std::lock_guard<std::mutex> lock(database->mutex);
+    database->snapshots.insert(database->sequence);
+    return new Snapshot(database->sequence);
+}
+
+void CryptoKernel::Storage::MemoryBackend::releaseSnapshot(const leveldb::Snapshot*
+        snapshot) {
+    const Snapshot* memorySnapshot = static_cast<const Snapshot*>(snapshot);
+
+    std::lock_guard<std::mutex> lock(database->mutex);
+    database->snapshots.erase(database->snapshots.find(memorySnapshot->sequence));
+    delete memorySnapshot;
+}
+
+Json::Value CryptoKernel::Storage::MemoryBackend::getProperties() {
+    std::lock_guard<std::mutex> lock(database->mutex);
+
+    uint64_t versions = 0;
+    for(const auto& entry : database->data) {
+        versions += entry.second.size();
+    }
+
+    Json::Value returning;
+    returning["engine"] = "memory";
+    returning["keys"] = static_cast<Json::UInt64>(database->data.size());
+    returning["versions"] = static_cast<Json::UInt64>(versions);
+    returning["snapshots"] = static_cast<Json::UInt64>(database->snapshots.size());
+
+    return returning;
+}
+
+uint64_t CryptoKernel::Storage::MemoryBackend::getApproximateSize() {
+    std::lock_guard<std::mutex> lock(database->mutex);
+
+    uint64_t size = 0;
+    for(const auto& entry : database->data) {
+        const Version& latest = entry.second.back();
+        if(!latest.erased) {
+            size += entry.first.size() + latest.value.size();
+        }
+    }
+
+    return size;
+}
+
+uint64_t CryptoKernel::Storage::MemoryBackend::getApproximateSize(const std::string& begin,
+        const std::string& end) {
+    std::lock_guard<std::mutex> lock(database->mutex);
+
+    uint64_t size = 0;
+    for(auto it = database->data.lower_bound(begin); it != database->data.end()
+        && it->first < end; ++it) {
+        const Version& latest = it->second.back();
+        if(!latest.erased) {
+            size += it->first.size() + latest.value.size();
+        }
+    }
+
+    return size;
+}
+
+void CryptoKernel::Storage::MemoryBackend::compactRange(const std::string& begin,
+        const std::string& end) {
+    std::lock_guard<std::mutex> lock(database->mutex);
+
+    auto it = database->data.lower_bound(begin);
+    while(it != database->data.end() && it->first < end) {
+        const auto next = std::next(it);
+        prune(it);
+        it = next;
+    }
+}
+
+void CryptoKernel::Storage::MemoryBackend::destroy(const std::string& name) {
+    std::lock_guard<std::mutex> lock(databasesMutex);
+    databases.erase(name);
+}
@@ -0,0 +1,196 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STORAGEBACKEND_H_INCLUDED
+#define STORAGEBACKEND_H_INCLUDED
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include <leveldb/write_batch.h>
+
+#include "storage.h"
+
+namespace CryptoKernel {
+/**
+* Key-value engine interface used by Storage. Engines are ordered by key
+* and must provide atomic batch writes and consistent snapshots. The
+* LevelDB types are used as the common vocabulary so engines can be
+* swapped without touching the transaction and table code.
+*/
+class Storage::Backend {
+public:
+    virtual ~Backend() {};
+
+    /**
+    * Reads the value stored under the given key
+    *
+    * @param options read options, including the snapshot to read from
+    * @param key the key to read
+    * @param value set to the stored value if the key exists
+    * @return OK if the key was found, NotFound if it was not
+    */
+    virtual leveldb::Status get(const leveldb::ReadOptions& options,
+                                const leveldb::Slice& key, std::string* value) = 0;
+
+    /**
+    * Atomically applies every update in the given batch
+    *
+    * @param options write options, sync requests a durable write
+    * @param batch the updates to apply
+    * @return OK if the batch was applied
+    */
+    virtual leveldb::Status write(const leveldb::WriteOptions& options,
+                                  leveldb::WriteBatch* batch) = 0;
+
+    /**
+    * Returns a new iterator over the engine. If no snapshot is given the
+    * iterator reads from an implicit snapshot taken now. The caller owns
+    * the iterator.
+    */
+    virtual leveldb::Iterator* newIterator(const leveldb::ReadOptions& options) = 0;
+
+    virtual const leveldb::Snapshot* getSnapshot() = 0;
+    virtual void releaseSnapshot(const leveldb::Snapshot* snapshot) = 0;
+
+    /**
+    * Returns engine specific statistics as json
+    */
+    virtual Json::Value getProperties() = 0;
+
+    /**
+    * Returns the approximate size in bytes of every key and value stored
+    */
+    virtual uint64_t getApproximateSize() = 0;
+
+    /**
+    * Returns the approximate size in bytes of the keys and values stored
+    * from begin up to but not including end
+    */
+    virtual uint64_t getApproximateSize(const std::string& begin, const std::string& end) = 0;
+
+    /**
+    * Compacts the stored keys from begin to end, discarding overwritten
+    * and erased values so later reads of the range touch less data. Blocks
+    * until the range is compacted.
+    */
+    virtual void compactRange(const std::string& begin, const std::string& end) = 0;
+};
+
+/**
+* Storage engine backed by an on-disk LevelDB database
+*/
+class Storage::LevelDBBackend : public Storage::Backend {
+public:
+    /**
+    * Opens or creates the LevelDB database in the given directory
+    *
+    * @throw std::runtime_error if the database could not be opened
+    */
+    LevelDBBackend(const std::string& filename);
+    ~LevelDBBackend();
+
+    leveldb::Status get(const leveldb::ReadOptions& options,
+                        const leveldb::Slice& key, std::string* value);
+    leveldb::Status write(const leveldb::WriteOptions& options,
+                          leveldb::WriteBatch* batch);
+    leveldb::Iterator* newIterator(const leveldb::ReadOptions& options);
+    const leveldb::Snapshot* getSnapshot();
+    void releaseSnapshot(const leveldb::Snapshot* snapshot);
+
+    /**
+    * Returns the LevelDB statistics. "levels" holds the files, size in MB
+    * and compaction time in seconds, MB read and MB written of every level
+    * LevelDB reports, "compaction" their totals, "memoryUsage" the
+    * approximate memory used by LevelDB in bytes and "stats" the raw
+    * leveldb.stats text.
+    */
+    Json::Value getProperties();
+    uint64_t getApproximateSize();
+    uint64_t getApproximateSize(const std::string& begin, const std::string& end);
+    void compactRange(const std::string& begin, const std::string& end);
+
+    static void destroy(const std::string& filename);
+
+private:
+    leveldb::DB* db;
+};
+
+/**
+* Storage engine that keeps every key in an in-process ordered map. Each
+* key holds a short list of versions so snapshots and iterators stay
+* consistent while writers commit. Databases are shared by name for the
+* lifetime of the process, so reopening a name sees earlier commits, but
+* nothing is ever written to disk.
+*/
+class Storage::MemoryBackend : public Storage::Backend {
+public:
+    MemoryBackend(const std::string& name);
+    ~MemoryBackend();
+
+    leveldb::Status get(const leveldb::ReadOptions& options,
+                        const leveldb::Slice& key, std::string* value);
+    leveldb::Status write(const leveldb::WriteOptions& options,
+                          leveldb::WriteBatch* batch);
+    leveldb::Iterator* newIterator(const leveldb::ReadOptions& options);
+    const leveldb::Snapshot* getSnapshot();
+    void releaseSnapshot(const leveldb::Snapshot* snapshot);
+
+    /**
+    * Returns the number of keys and stored versions
+    */
+    Json::Value getProperties();
+    uint64_t getApproximateSize();
+    uint64_t getApproximateSize(const std::string& begin, const std::string& end);
+
+    /**
+    * Drops the versions in the range that no open snapshot can read and
+    * the keys whose only remaining version is an erase
+    */
+    void compactRange(const std::string& begin, const std::string& end);
+
+    static void destroy(const std::string& name);
+
+private:
+    struct Version {
+        uint64_t sequence;
+        bool erased;
+        std::string value;
+    };
+
+    struct Database {
+        std::map<std::string, std::vector<Version>> data;
+        std::multiset<uint64_t> snapshots;
+        uint64_t sequence;
+        std::mutex mutex;
+    };
+
+    class Snapshot;
+    class Iterator;
+
+    static const Version* find(const std::vector<Version>& versions, const uint64_t sequence);
+    void prune(std::map<std::string, std::vector<Version>>::iterator it);
+
+    std::shared_ptr<Database> database;
+
+    static std::map<std::string, std::shared_ptr<Database>> databases;
+    static std::mutex databasesMutex;
+};
+}
+
+#endif // STORAGEBACKEND_H_INCLUDED
@@ -0,0 +1,131 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "storagecache.h"
+
+/* Rough per-entry bookkeeping cost on top of the key and value, covering
+   the list node, hash node and the decoded Json::Value tree. Decoded values
+   take roughly twice their encoded size. */
+static const size_t entryOverhead = 128;
+static const size_t decodedFactor = 2;
+
+CryptoKernel::Storage::Cache::Cache(const uint64_t budget) {
+    this->budget = budget;
+    bytes = 0;
+    sequence = 0;
+    committing = false;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+}
+
+uint64_t CryptoKernel::Storage::Cache::getSequence() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return sequence;
+}
+
+bool CryptoKernel::Storage::Cache::get(const std::string& key, const uint64_t sequence,
+                                       std::shared_ptr<const Json::Value>& value) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    const auto it = entries.find(key);
+    if(it == entries.end() || it->second->validFrom > sequence) {
+        misses++;
+        return false;
+    }
+
+    lru.splice(lru.begin(), lru, it->second);
+    value = it->second->value;
+    hits++;
+
+    return true;
+}
+
+void CryptoKernel::Storage::Cache::insert(const std::string& key, const uint64_t sequence,
+        const std::shared_ptr<const Json::Value>& value, const size_t size) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if(committing || sequence != this->sequence) {
+        return;
+    }
+
+    put(key, sequence, value, size);
+}
+
+void CryptoKernel::Storage::Cache::beginCommit(const std::vector<std::string>& keys) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    committing = true;
+    for(const std::string& key : keys) {
+        remove(key);
+    }
+}
+
+void CryptoKernel::Storage::Cache::endCommit(const std::vector<Update>& updates) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    sequence++;
+    committing = false;
+    for(const Update& update : updates) {
+        put(update.key, sequence, update.value, update.size);
+    }
+}
+
+void CryptoKernel::Storage::Cache::abortCommit() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    committing = false;
+}
+
+Json::Value CryptoKernel::Storage::Cache::getStats() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    Json::Value returning;
+    returning["hits"] = static_cast<Json::UInt64>(hits);
+    returning["misses"] = static_cast<Json::UInt64>(misses);
+    returning["evictions"] = static_cast<Json::UInt64>(evictions);
+    returning["entries"] = static_cast<Json::UInt64>(entries.size());
+    returning["bytes"] = static_cast<Json::UInt64>(bytes);
+    returning["budget"] = static_cast<Json::UInt64>(budget);
+
+    return returning;
+}
+
+void CryptoKernel::Storage::Cache::put(const std::string& key, const uint64_t validFrom,
+                                       const std::shared_ptr<const Json::Value>& value, const size_t size) {
+    remove(key);
+
+    const size_t entrySize = key.size() + size * decodedFactor + entryOverhead;
+    if(entrySize > budget) {
+        return;
+    }
+
+    lru.push_front(Entry{key, value, validFrom, entrySize});
+    entries[key] = lru.begin();
+    bytes += entrySize;
+
+    while(bytes > budget) {
+        const Entry& oldest = lru.back();
+        bytes -= oldest.size;
+        entries.erase(oldest.key);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+void CryptoKernel::Storage::Cache::remove(const std::string& key) {
+    const auto it = entries.find(key);
+    if(it != entries.end()) {
+        bytes -= it->second->size;
+        lru.erase(it->second);
+        entries.erase(it);
+    }
+}
@@ -0,0 +1,137 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STORAGECACHE_H_INCLUDED
+#define STORAGECACHE_H_INCLUDED
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+
+#include "storage.h"
+
+namespace CryptoKernel {
+/**
+* A bounded LRU cache of decoded values shared by every transaction of a
+* Storage. Entries remember the commit sequence number from which they are
+* known to be current, so read-only transactions only use entries that are
+* visible in their snapshot. The cache is updated under its own lock at the
+* end of every commit, so no transaction ever observes part of a commit.
+*/
+class Storage::Cache {
+public:
+    /**
+    * Constructs an empty cache
+    *
+    * @param budget the approximate maximum memory used by cached values in
+    *        bytes, zero disables caching
+    */
+    Cache(const uint64_t budget);
+
+    /**
+    * Returns the sequence number of the last completed commit
+    */
+    uint64_t getSequence();
+
+    /**
+    * Looks up a value
+    *
+    * @param key the database key to look up
+    * @param sequence the commit sequence number the caller reads at
+    * @param value set to the cached value on a hit
+    * @return true if a value current at the given sequence was found
+    */
+    bool get(const std::string& key, const uint64_t sequence,
+             std::shared_ptr<const Json::Value>& value);
+
+    /**
+    * Caches a value read from the database. The value is only cached if no
+    * commit completed or started since the caller's sequence number, so
+    * stale values read from an old snapshot are never cached.
+    *
+    * @param key the database key of the value
+    * @param sequence the commit sequence number the value was read at
+    * @param value the decoded value
+    * @param size the encoded size of the value in bytes
+    */
+    void insert(const std::string& key, const uint64_t sequence,
+                const std::shared_ptr<const Json::Value>& value, const size_t size);
+
+    /**
+    * Called before a commit is written. Evicts the given keys and stops
+    * values read by other transactions being cached until the commit ends.
+    */
+    void beginCommit(const std::vector<std::string>& keys);
+
+    /**
+    * A committed key with its decoded value and encoded size
+    */
+    struct Update {
+        std::string key;
+        std::shared_ptr<const Json::Value> value;
+        size_t size;
+    };
+
+    /**
+    * Called after a commit is written. Advances the commit sequence and
+    * caches the committed values. Erased keys are cached as null values.
+    *
+    * @param updates the committed values
+    */
+    void endCommit(const std::vector<Update>& updates);
+
+    /**
+    * Called when a commit failed to be written
+    */
+    void abortCommit();
+
+    /**
+    * Returns the cache counters: hits, misses, evictions, entries, bytes
+    * and budget
+    */
+    Json::Value getStats();
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const Json::Value> value;
+        uint64_t validFrom;
+        size_t size;
+    };
+
+    void put(const std::string& key, const uint64_t validFrom,
+             const std::shared_ptr<const Json::Value>& value, const size_t size);
+    void remove(const std::string& key);
+
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+
+    uint64_t budget;
+    uint64_t bytes;
+    uint64_t sequence;
+    bool committing;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    uint64_t evictions;
+
+    std::mutex cacheMutex;
+};
+}
+
+#endif // STORAGECACHE_H_INCLUDED
@@ -0,0 +1,314 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctime>
+
+#include "storagecompactor.h"
+#include "storagebackend.h"
+
+/* Every key sorts before a run of 0xff bytes longer than any table prefix
+   and key, so it stands in for the end of unbounded ranges */
+static const std::string lastKey(256, static_cast<char>(0xff));
+
+/* Ranges are split until their slices are no larger than sliceBytes, going
+   at most maxSplitDepth halvings deep and stopping at maxSlices slices */
+static const uint64_t sliceBytes = 32 * 1024 * 1024;
+static const unsigned int maxSplitDepth = 96;
+static const size_t maxSlices = 4096;
+
+/* Tombstones slow every later read of their range until they are
+   compacted away, so an erase counts for more than the bytes it writes */
+static const uint64_t eraseWeight = 256;
+
+CryptoKernel::Storage::Compactor::Compactor(Backend* db, const uint64_t rate,
+        const std::chrono::milliseconds idle, const uint64_t threshold) {
+    this->db = db;
+    this->rate = rate;
+    this->idle = idle;
+    this->threshold = threshold;
+    for(auto& bytes : debt) {
+        bytes = 0;
+    }
+    lastCommit = std::chrono::steady_clock::now().time_since_epoch().count();
+
+    status["running"] = false;
+    status["completed"] = static_cast<Json::UInt64>(0);
+    status["bytesCompacted"] = static_cast<Json::UInt64>(0);
+    running = true;
+}
+
+CryptoKernel::Storage::Compactor::~Compactor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+    condition.notify_all();
+    if(thread) {
+        thread->join();
+    }
+}
+
+std::string CryptoKernel::Storage::Compactor::getRangeName(const uint8_t id) {
+    // Tables without an id byte share the range after namedTableId
+    return id == 0xff ? "named tables" : getTableName(std::string(1, static_cast<char>(id)));
+}
+
+void CryptoKernel::Storage::Compactor::addDebt(const std::string& key, const uint64_t bytes) {
+    const uint8_t id = key.empty() ? 0 : static_cast<uint8_t>(key[0]);
+    const uint64_t total = debt[id] += bytes;
+
+    // Only the write that crosses the threshold wakes the thread
+    if(threshold > 0 && total >= threshold && total - bytes < threshold) {
+        start();
+    }
+}
+
+void CryptoKernel::Storage::Compactor::recordPut(const std::string& key, const size_t size) {
+    addDebt(key, size);
+}
+
+void CryptoKernel::Storage::Compactor::recordErase(const std::string& key) {
+    addDebt(key, key.size() + eraseWeight);
+}
+
+void CryptoKernel::Storage::Compactor::recordCommit() {
+    lastCommit = std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+void CryptoKernel::Storage::Compactor::start() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!thread) {
+            thread.reset(new std::thread(&CryptoKernel::Storage::Compactor::compactFunc, this));
+        }
+    }
+    condition.notify_all();
+}
+
+void CryptoKernel::Storage::Compactor::queue(const std::string& name, const std::string& begin,
+        const std::string& end, const bool whenIdle) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(Job{name, begin, end.empty() ? lastKey : end, whenIdle});
+    }
+    start();
+}
+
+Json::Value CryptoKernel::Storage::Compactor::getStatus() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Json::Value returning = status;
+    returning["queued"] = Json::Value(Json::arrayValue);
+    for(const Job& job : jobs) {
+        returning["queued"].append(job.name);
+    }
+
+    returning["pending"] = Json::Value(Json::objectValue);
+    for(unsigned int id = 0; id < 256; id++) {
+        if(debt[id] > 0) {
+            returning["pending"][getRangeName(id)] = static_cast<Json::UInt64>(debt[id]);
+        }
+    }
+
+    return returning;
+}
+
+bool CryptoKernel::Storage::Compactor::nextAutomatic(Job& job) {
+    if(threshold == 0) {
+        return false;
+    }
+
+    unsigned int largest = 0;
+    for(unsigned int id = 1; id < 256; id++) {
+        if(debt[id] > debt[largest]) {
+            largest = id;
+        }
+    }
+
+    if(debt[largest] < threshold) {
+        return false;
+    }
+
+    job.name = getRangeName(largest);
+    job.begin = std::string(1, static_cast<char>(largest));
+    job.end = largest == 0xff ? lastKey : std::string(1, static_cast<char>(largest + 1));
+    job.whenIdle = true;
+
+    return true;
+}
+
+bool CryptoKernel::Storage::Compactor::isIdle(std::chrono::steady_clock::time_point& idleAt) {
+    idleAt = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(
+                 lastCommit)) + idle;
+
+    return std::chrono::steady_clock::now() >= idleAt;
+}
+
+std::string CryptoKernel::Storage::Compactor::middleKey(const std::string& begin,
+        const std::string& end) {
+    // Treat both keys as base 256 fractions and halve their sum, keeping
+    // one more digit than the longest key so the halving is exact
+    const size_t size = std::max(begin.size(), end.size()) + 1;
+    std::vector<unsigned int> sum(size);
+    unsigned int carry = 0;
+    for(size_t i = size; i-- > 0;) {
+        const unsigned int digit = (i < begin.size() ? static_cast<uint8_t>(begin[i]) : 0)
+                                   + (i < end.size() ? static_cast<uint8_t>(end[i]) : 0) + carry;
+        sum[i] = digit & 0xff;
+        carry = digit >> 8;
+    }
+
+    std::string middle(size, '\0');
+    for(size_t i = 0; i < size; i++) {
+        const unsigned int value = (carry << 8) | sum[i];
+        middle[i] = static_cast<char>(value >> 1);
+        carry = value & 1;
+    }
+
+    // Trailing zeros only lengthen the key, drop them while it stays
+    // inside the range
+    while(middle.size() > 1 && middle.back() == '\0'
+          && middle.compare(0, middle.size() - 1, begin) > 0) {
+        middle.pop_back();
+    }
+
+    return middle;
+}
+
+void CryptoKernel::Storage::Compactor::split(const std::string& begin, const std::string& end,
+        const uint64_t size, const unsigned int depth, std::vector<Range>& slices) {
+    if(size == 0) {
+        return;
+    }
+
+    const std::string middle = middleKey(begin, end);
+    if(size <= sliceBytes || depth >= maxSplitDepth || slices.size() >= maxSlices
+       || middle <= begin || middle >= end) {
+        slices.push_back(Range{begin, end, size});
+        return;
+    }
+
+    split(begin, middle, db->getApproximateSize(begin, middle), depth + 1, slices);
+    split(middle, end, db->getApproximateSize(middle, end), depth + 1, slices);
+}
+
+void CryptoKernel::Storage::Compactor::run(const Job& job,
+        std::unique_lock<std::mutex>& lock) {
+    for(unsigned int id = 0; id < 256; id++) {
+        const std::string tableBegin(1, static_cast<char>(id));
+        const std::string tableEnd = id == 0xff ? lastKey : std::string(1,
+                                     static_cast<char>(id + 1));
+        if(job.begin <= tableBegin && tableEnd <= job.end) {
+            debt[id] = 0;
+        }
+    }
+
+    status["running"] = true;
+    status["table"] = job.name;
+    status["whenIdle"] = job.whenIdle;
+    status["started"] = static_cast<Json::UInt64>(std::time(nullptr));
+    status["slices"] = 0;
+    status["slicesDone"] = 0;
+    status["bytes"] = static_cast<Json::UInt64>(0);
+    status["bytesDone"] = static_cast<Json::UInt64>(0);
+    status["progress"] = 0.0;
+
+    lock.unlock();
+    std::vector<Range> slices;
+    split(job.begin, job.end, db->getApproximateSize(job.begin, job.end), 0, slices);
+    if(slices.empty()) {
+        // Recent writes may not be counted in the engine's estimates yet
+        slices.push_back(Range{job.begin, job.end, 0});
+    }
+    uint64_t bytes = 0;
+    for(const Range& slice : slices) {
+        bytes += slice.size;
+    }
+    lock.lock();
+
+    status["slices"] = static_cast<Json::UInt64>(slices.size());
+    status["bytes"] = static_cast<Json::UInt64>(bytes);
+
+    const auto started = std::chrono::steady_clock::now();
+    uint64_t bytesDone = 0;
+    for(size_t i = 0; i < slices.size(); i++) {
+        std::chrono::steady_clock::time_point idleAt;
+        while(running && job.whenIdle && !isIdle(idleAt)) {
+            condition.wait_until(lock, idleAt);
+        }
+
+        if(!running) {
+            status["running"] = false;
+            return;
+        }
+
+        lock.unlock();
+        const auto sliceStarted = std::chrono::steady_clock::now();
+        db->compactRange(slices[i].begin, slices[i].end);
+        lock.lock();
+
+        bytesDone += slices[i].size;
+        status["slicesDone"] = static_cast<Json::UInt64>(i + 1);
+        status["bytesDone"] = static_cast<Json::UInt64>(bytesDone);
+        status["progress"] = bytes > 0 ? static_cast<double>(bytesDone) / bytes :
+                             static_cast<double>(i + 1) / slices.size();
+
+        // Pause until the slice has taken as long as the rate allows
+        if(rate > 0) {
+            const auto due = sliceStarted + std::chrono::microseconds(slices[i].size * 1000000 /
+                             rate);
+            condition.wait_until(lock, due, [&] {
+                return !running;
+            });
+        }
+    }
+
+    status["running"] = false;
+    status["completed"] = status["completed"].asUInt64() + 1;
+    status["bytesCompacted"] = static_cast<Json::UInt64>(status["bytesCompacted"].asUInt64() +
+                               bytesDone);
+
+    Json::Value last;
+    last["table"] = job.name;
+    last["bytes"] = static_cast<Json::UInt64>(bytesDone);
+    last["slices"] = static_cast<Json::UInt64>(slices.size());
+    last["seconds"] = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                      started).count();
+    last["finished"] = static_cast<Json::UInt64>(std::time(nullptr));
+    status["last"] = last;
+}
+
+void CryptoKernel::Storage::Compactor::compactFunc() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(running) {
+        Job job;
+        std::chrono::steady_clock::time_point idleAt;
+        if(!jobs.empty()) {
+            job = jobs.front();
+            jobs.pop_front();
+            run(job, lock);
+        } else if(nextAutomatic(job)) {
+            if(isIdle(idleAt)) {
+                run(job, lock);
+            } else {
+                condition.wait_until(lock, idleAt);
+            }
+        } else {
+            condition.wait(lock);
+        }
+    }
+}
@@ -0,0 +1,149 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STORAGECOMPACTOR_H_INCLUDED
+#define STORAGECOMPACTOR_H_INCLUDED
+
+#include <atomic>
+#include <deque>
+
+#include "storage.h"
+
+namespace CryptoKernel {
+/**
+* Compacts key ranges of a Storage in a background thread. Each range is
+* split into slices of roughly equal size using the engine's size
+* estimates, and the slices are compacted one at a time with a pause after
+* each, so the compaction rate stays under a limit and commits never wait
+* behind one long compaction.
+*
+* Writes are tallied per table id byte. Once the puts and erases made to a
+* table since it was last compacted pass the threshold, the table is
+* compacted automatically the next time the database is idle, meaning no
+* commit was made for the idle interval. Compactions can also be queued
+* explicitly, and are then run without waiting for the database to go
+* idle unless asked to.
+*/
+class Storage::Compactor {
+public:
+    /**
+    * Constructs a compactor for the given engine. The thread is only
+    * started once there is something to compact.
+    *
+    * @param db the engine to compact, which must outlive the compactor
+    * @param rate the maximum bytes compacted per second, zero for no limit
+    * @param idle how long no commit must be made before the database is
+    *        idle
+    * @param threshold the bytes written to a table before it is compacted
+    *        automatically, zero disables automatic compaction
+    */
+    Compactor(Backend* db, const uint64_t rate, const std::chrono::milliseconds idle,
+              const uint64_t threshold);
+
+    /**
+    * Stops the thread, abandoning any compaction in progress between two
+    * slices
+    */
+    ~Compactor();
+
+    /**
+    * Records a committed write of a key
+    *
+    * @param key the database key written
+    * @param size the encoded size of the key and value in bytes
+    */
+    void recordPut(const std::string& key, const size_t size);
+
+    /**
+    * Records a committed erase of a key
+    *
+    * @param key the database key erased
+    */
+    void recordErase(const std::string& key);
+
+    /**
+    * Records that a commit was made, which postpones idle compactions
+    */
+    void recordCommit();
+
+    /**
+    * Queues a compaction of the keys from begin up to but not including
+    * end
+    *
+    * @param name the name the range is reported under
+    * @param begin the first key of the range
+    * @param end the key after the range
+    * @param whenIdle true to only compact while the database is idle
+    */
+    void queue(const std::string& name, const std::string& begin, const std::string& end,
+               const bool whenIdle);
+
+    /**
+    * Returns the progress of the compactor as json. "running" is true
+    * while a range is compacted, "table" names it, "slices", "slicesDone",
+    * "bytes", "bytesDone" and "progress" track it and "whenIdle" tells if
+    * it waits for idle periods. "queued" lists the ranges waiting and
+    * "pending" the bytes written to each table since it was last
+    * compacted. "completed" and "bytesCompacted" count every range
+    * finished and "last" describes the most recent one.
+    */
+    Json::Value getStatus();
+
+private:
+    struct Job {
+        std::string name;
+        std::string begin;
+        std::string end;
+        bool whenIdle;
+    };
+
+    struct Range {
+        std::string begin;
+        std::string end;
+        uint64_t size;
+    };
+
+    void addDebt(const std::string& key, const uint64_t bytes);
+    void start();
+    bool nextAutomatic(Job& job);
+    bool isIdle(std::chrono::steady_clock::time_point& idleAt);
+    void split(const std::string& begin, const std::string& end, const uint64_t size,
+               const unsigned int depth, std::vector<Range>& slices);
+    void run(const Job& job, std::unique_lock<std::mutex>& lock);
+    void compactFunc();
+
+    static std::string getRangeName(const uint8_t id);
+    static std::string middleKey(const std::string& begin, const std::string& end);
+
+    Backend* db;
+    uint64_t rate;
+    std::chrono::milliseconds idle;
+    uint64_t threshold;
+
+    std::atomic<uint64_t> debt[256];
+    std::atomic<std::chrono::steady_clock::rep> lastCommit;
+
+    std::deque<Job> jobs;
+    Json::Value status;
+    bool running;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::unique_ptr<std::thread> thread;
+};
+}
+
+#endif // STORAGECOMPACTOR_H_INCLUDED
@@ -0,0 +1,184 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+
+#include "storagefilter.h"
+
+static uint64_t mix(uint64_t value) {
+    // The splitmix64 finaliser
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+
+    return value;
+}
+
+CryptoKernel::Storage::Filter::Filter(const uint64_t expectedKeys,
+                                      const double falsePositiveRate, const uint64_t validFrom) {
+    this->expectedKeys = std::max(expectedKeys, static_cast<uint64_t>(1));
+    this->falsePositiveRate = falsePositiveRate;
+    this->validFrom = validFrom;
+    layerCount = 0;
+    keys = 0;
+    erases = 0;
+    lookups = 0;
+    negatives = 0;
+    falsePositives = 0;
+
+    addLayer();
+}
+
+void CryptoKernel::Storage::Filter::addLayer() {
+    // Layer i holds twice the keys of layer i - 1 at half its false
+    // positive rate, so the rates of all layers sum to the target
+    const unsigned int index = layerCount;
+    const double rate = falsePositiveRate / std::pow(2.0, index + 1);
+
+    std::unique_ptr<Layer> layer(new Layer());
+    layer->capacity = expectedKeys << index;
+    const double bits = -static_cast<double>(layer->capacity) * std::log(rate) /
+                        (std::log(2.0) * std::log(2.0));
+    const uint64_t words = std::max(static_cast<uint64_t>(std::ceil(bits / 64)),
+                                    static_cast<uint64_t>(1));
+    layer->bits = words * 64;
+    layer->hashes = std::max(static_cast<unsigned int>(std::round(
+                                 static_cast<double>(layer->bits) / layer->capacity * std::log(2.0))), 1u);
+    layer->keys = 0;
+    layer->words.reset(new std::atomic<uint64_t>[words]);
+    for(uint64_t i = 0; i < words; i++) {
+        layer->words[i] = 0;
+    }
+
+    layers[index] = std::move(layer);
+    layerCount = index + 1;
+}
+
+void CryptoKernel::Storage::Filter::hashKey(const std::string& key, uint64_t& h1,
+        uint64_t& h2) {
+    // FNV-1a, then two finalised variants of it for double hashing
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(const char c : key) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 0x100000001b3ULL;
+    }
+
+    h1 = mix(hash);
+    h2 = mix(hash ^ 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+bool CryptoKernel::Storage::Filter::test(const Layer& layer, const uint64_t h1,
+        const uint64_t h2) {
+    for(unsigned int i = 0; i < layer.hashes; i++) {
+        const uint64_t bit = (h1 + i * h2) % layer.bits;
+        if((layer.words[bit / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64))) == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void CryptoKernel::Storage::Filter::insert(const std::string& key) {
+    uint64_t h1, h2;
+    hashKey(key, h1, h2);
+
+    const unsigned int count = layerCount;
+    for(unsigned int i = 0; i < count; i++) {
+        if(test(*layers[i], h1, h2)) {
+            return;
+        }
+    }
+
+    if(layers[count - 1]->keys >= layers[count - 1]->capacity && count < maxLayers) {
+        addLayer();
+    }
+
+    Layer& layer = *layers[layerCount - 1];
+    for(unsigned int i = 0; i < layer.hashes; i++) {
+        const uint64_t bit = (h1 + i * h2) % layer.bits;
+        layer.words[bit / 64].fetch_or(uint64_t(1) << (bit % 64));
+    }
+    layer.keys++;
+    keys++;
+}
+
+bool CryptoKernel::Storage::Filter::mayContain(const std::string& key) const {
+    uint64_t h1, h2;
+    hashKey(key, h1, h2);
+
+    const unsigned int count = layerCount;
+    for(unsigned int i = 0; i < count; i++) {
+        if(test(*layers[i], h1, h2)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void CryptoKernel::Storage::Filter::recordLookup(const bool mayContain, const bool found) {
+    lookups++;
+    if(!mayContain) {
+        negatives++;
+    } else if(!found) {
+        falsePositives++;
+    }
+}
+
+void CryptoKernel::Storage::Filter::recordErase() {
+    erases++;
+}
+
+uint64_t CryptoKernel::Storage::Filter::getValidFrom() const {
+    return validFrom;
+}
+
+Json::Value CryptoKernel::Storage::Filter::getStats() const {
+    uint64_t bytes = 0;
+    double notFalsePositive = 1.0;
+    const unsigned int count = layerCount;
+    for(unsigned int i = 0; i < count; i++) {
+        const Layer& layer = *layers[i];
+        bytes += layer.bits / 8;
+
+        // A missing key passes a layer when all its bits happen to be set
+        uint64_t set = 0;
+        for(uint64_t word = 0; word < layer.bits / 64; word++) {
+            uint64_t value = layer.words[word].load(std::memory_order_relaxed);
+            for(; value > 0; value &= value - 1) {
+                set++;
+            }
+        }
+        notFalsePositive *= 1.0 - std::pow(static_cast<double>(set) / layer.bits, layer.hashes);
+    }
+
+    Json::Value returning;
+    returning["keys"] = static_cast<Json::UInt64>(keys);
+    returning["erases"] = static_cast<Json::UInt64>(erases);
+    returning["layers"] = count;
+    returning["bytes"] = static_cast<Json::UInt64>(bytes);
+    returning["targetFalsePositiveRate"] = falsePositiveRate;
+    returning["falsePositiveRate"] = 1.0 - notFalsePositive;
+    returning["lookups"] = static_cast<Json::UInt64>(lookups);
+    returning["negatives"] = static_cast<Json::UInt64>(negatives);
+    returning["falsePositives"] = static_cast<Json::UInt64>(falsePositives);
+
+    return returning;
+}
@@ -0,0 +1,109 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STORAGEFILTER_H_INCLUDED
+#define STORAGEFILTER_H_INCLUDED
+
+#include <atomic>
+
+#include "storage.h"
+
+namespace CryptoKernel {
+/**
+* A Bloom filter over the keys of a table, answering "definitely absent"
+* or "maybe present" without reading the engine. The filter grows in
+* layers: once a layer holds the keys it was sized for, a layer twice as
+* large with half the false positive rate is added, so the overall rate
+* stays under the target however many keys are inserted.
+*
+* Keys are only ever added. Erased keys stay in the filter as false
+* positives until it is rebuilt. One writer may insert while any number
+* of readers query, because bits are set atomically and a new layer is
+* only published once it is built.
+*/
+class Storage::Filter {
+public:
+    /**
+    * Constructs an empty filter
+    *
+    * @param expectedKeys the number of keys the first layer is sized for
+    * @param falsePositiveRate the target false positive rate
+    * @param validFrom the cache sequence number the filter was built at,
+    *        transactions reading from an older snapshot do not use it
+    */
+    Filter(const uint64_t expectedKeys, const double falsePositiveRate,
+           const uint64_t validFrom);
+
+    void insert(const std::string& key);
+
+    /**
+    * Returns false if the key was never inserted
+    */
+    bool mayContain(const std::string& key) const;
+
+    /**
+    * Records a lookup the filter answered, and whether the engine then
+    * found the key when the filter said it may be present
+    */
+    void recordLookup(const bool mayContain, const bool found);
+
+    /**
+    * Records an erase of a key, which stays in the filter
+    */
+    void recordErase();
+
+    uint64_t getValidFrom() const;
+
+    /**
+    * Returns the keys inserted, the erases since, the layers, the memory
+    * used in bytes, the target and estimated false positive rates and the
+    * lookups answered, with how many skipped the engine and how many were
+    * false positives
+    */
+    Json::Value getStats() const;
+
+private:
+    struct Layer {
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+        uint64_t bits;
+        unsigned int hashes;
+        uint64_t capacity;
+        std::atomic<uint64_t> keys;
+    };
+
+    static const unsigned int maxLayers = 32;
+
+    void addLayer();
+    static bool test(const Layer& layer, const uint64_t h1, const uint64_t h2);
+    static void hashKey(const std::string& key, uint64_t& h1, uint64_t& h2);
+
+    std::unique_ptr<Layer> layers[maxLayers];
+    std::atomic<unsigned int> layerCount;
+
+    uint64_t expectedKeys;
+    double falsePositiveRate;
+    uint64_t validFrom;
+
+    std::atomic<uint64_t> keys;
+    std::atomic<uint64_t> erases;
+    std::atomic<uint64_t> lookups;
+    std::atomic<uint64_t> negatives;
+    std::atomic<uint64_t> falsePositives;
+};
+}
+
+#endif // STORAGEFILTER_H_INCLUDED
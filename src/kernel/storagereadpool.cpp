@@ -0,0 +1,112 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+
+#include "storagereadpool.h"
+
+/* Waking the workers costs about as much as a few cached engine reads, so
+   smaller batches are read on the calling thread */
+static const size_t minParallelReads = 8;
+
+CryptoKernel::Storage::ReadPool::ReadPool(const unsigned int threads) {
+    this->threads = threads;
+    running = true;
+}
+
+CryptoKernel::Storage::ReadPool::~ReadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+    workCondition.notify_all();
+    for(auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void CryptoKernel::Storage::ReadPool::run(const size_t count,
+        const std::function<void(const size_t)>& task) {
+    if(threads == 0 || count < minParallelReads) {
+        for(size_t i = 0; i < count; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    std::shared_ptr<Batch> batch(new Batch());
+    batch->task = &task;
+    batch->count = count;
+    batch->next = 0;
+    batch->done = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(workers.empty()) {
+            for(unsigned int i = 0; i < threads; i++) {
+                workers.push_back(std::thread(&CryptoKernel::Storage::ReadPool::workerFunc, this));
+            }
+        }
+        batches.push_back(batch);
+    }
+    workCondition.notify_all();
+
+    work(*batch);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [&] {
+        return batch->done == count;
+    });
+
+    const auto it = std::find(batches.begin(), batches.end(), batch);
+    if(it != batches.end()) {
+        batches.erase(it);
+    }
+}
+
+void CryptoKernel::Storage::ReadPool::work(Batch& batch) {
+    for(size_t i = batch.next++; i < batch.count; i = batch.next++) {
+        (*batch.task)(i);
+
+        if(++batch.done == batch.count) {
+            std::lock_guard<std::mutex> lock(mutex);
+            doneCondition.notify_all();
+        }
+    }
+}
+
+void CryptoKernel::Storage::ReadPool::workerFunc() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(running) {
+        if(batches.empty()) {
+            workCondition.wait(lock);
+            continue;
+        }
+
+        // Batches with every read claimed are left to their callers to
+        // wait on
+        const std::shared_ptr<Batch> batch = batches.front();
+        if(batch->next >= batch->count) {
+            batches.pop_front();
+            continue;
+        }
+
+        lock.unlock();
+        work(*batch);
+        lock.lock();
+    }
+}
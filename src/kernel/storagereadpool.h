@@ -0,0 +1,77 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STORAGEREADPOOL_H_INCLUDED
+#define STORAGEREADPOOL_H_INCLUDED
+
+#include <atomic>
+#include <deque>
+
+#include "storage.h"
+
+namespace CryptoKernel {
+/**
+* Worker threads shared by the transactions of a Storage to read many keys
+* from the engine at once. Each batch of reads is split between the
+* workers and the calling thread, which claim one read at a time, so a
+* batch finishes as soon as the slowest read does rather than after every
+* read in turn. Batches from different transactions are worked on in the
+* order they arrive.
+*/
+class Storage::ReadPool {
+public:
+    /**
+    * Constructs a pool. The threads are only started by the first batch
+    * large enough to be worth splitting.
+    *
+    * @param threads the number of worker threads, zero runs every batch on
+    *        the calling thread
+    */
+    ReadPool(const unsigned int threads);
+
+    ~ReadPool();
+
+    /**
+    * Calls task once for every index from 0 to count - 1, spread over the
+    * workers and the calling thread, and returns once every call has
+    * returned. Small batches are run on the calling thread. The task must
+    * not throw.
+    */
+    void run(const size_t count, const std::function<void(const size_t)>& task);
+
+private:
+    struct Batch {
+        const std::function<void(const size_t)>* task;
+        size_t count;
+        std::atomic<size_t> next;
+        std::atomic<size_t> done;
+    };
+
+    void work(Batch& batch);
+    void workerFunc();
+
+    unsigned int threads;
+    std::deque<std::shared_ptr<Batch>> batches;
+    std::vector<std::thread> workers;
+    bool running;
+    std::mutex mutex;
+    std::condition_variable workCondition;
+    std::condition_variable doneCondition;
+};
+}
+
+#endif // STORAGEREADPOOL_H_INCLUDED
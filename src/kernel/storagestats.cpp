@@ -0,0 +1,185 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "storagestats.h"
+
+Json::Value CryptoKernel::Storage::Stats::Counters::toJson() const {
+    Json::Value returning;
+    returning["gets"] = static_cast<Json::UInt64>(gets);
+    returning["hits"] = static_cast<Json::UInt64>(hits);
+    returning["misses"] = static_cast<Json::UInt64>(misses);
+    returning["scans"] = static_cast<Json::UInt64>(scans);
+    returning["puts"] = static_cast<Json::UInt64>(puts);
+    returning["erases"] = static_cast<Json::UInt64>(erases);
+    returning["bytesRead"] = static_cast<Json::UInt64>(bytesRead);
+    returning["bytesWritten"] = static_cast<Json::UInt64>(bytesWritten);
+
+    return returning;
+}
+
+CryptoKernel::Storage::Stats::Histogram::Histogram() {
+    for(auto& bucket : buckets) {
+        bucket = 0;
+    }
+    count = 0;
+    sum = 0;
+    max = 0;
+}
+
+void CryptoKernel::Storage::Stats::Histogram::record(const uint64_t value) {
+    // Bucket i holds the values with i significant bits
+    unsigned int bucket = 0;
+    for(uint64_t v = value; v > 0; v >>= 1) {
+        bucket++;
+    }
+
+    buckets[bucket]++;
+    count++;
+    sum += value;
+
+    uint64_t current = max;
+    while(value > current && !max.compare_exchange_weak(current, value)) {}
+}
+
+uint64_t CryptoKernel::Storage::Stats::Histogram::percentile(const uint64_t count,
+        const double fraction) const {
+    const uint64_t target = static_cast<uint64_t>(count * fraction + 0.5);
+    uint64_t seen = 0;
+    for(unsigned int i = 0; i < 65; i++) {
+        seen += buckets[i];
+        if(seen >= target && seen > 0) {
+            const uint64_t upper = i == 0 ? 0 : i == 64 ? UINT64_MAX : (uint64_t(1) << i) - 1;
+            return std::min(upper, static_cast<uint64_t>(max));
+        }
+    }
+
+    return max;
+}
+
+Json::Value CryptoKernel::Storage::Stats::Histogram::toJson() const {
+    Json::Value returning;
+    const uint64_t total = count;
+    returning["count"] = static_cast<Json::UInt64>(total);
+    returning["sum"] = static_cast<Json::UInt64>(sum);
+    returning["max"] = static_cast<Json::UInt64>(max);
+    returning["mean"] = total > 0 ? static_cast<double>(sum) / total : 0.0;
+    returning["p50"] = static_cast<Json::UInt64>(percentile(total, 0.5));
+    returning["p90"] = static_cast<Json::UInt64>(percentile(total, 0.9));
+    returning["p99"] = static_cast<Json::UInt64>(percentile(total, 0.99));
+
+    returning["buckets"] = Json::Value(Json::arrayValue);
+    for(unsigned int i = 0; i < 65; i++) {
+        if(buckets[i] > 0) {
+            Json::Value bucket;
+            bucket["le"] = static_cast<Json::UInt64>(i == 0 ? 0 : i == 64 ? UINT64_MAX :
+                                                     (uint64_t(1) << i) - 1);
+            bucket["count"] = static_cast<Json::UInt64>(buckets[i]);
+            returning["buckets"].append(bucket);
+        }
+    }
+
+    return returning;
+}
+
+CryptoKernel::Storage::Stats::Stats() {
+    writeSetSpills = 0;
+}
+
+CryptoKernel::Storage::Stats::Counters& CryptoKernel::Storage::Stats::getCounters(
+    const std::string& key) {
+    const uint8_t id = key.empty() ? 0 : static_cast<uint8_t>(key[0]);
+
+    // Keys of tables without an id byte start with 0xff and the table name
+    if(id != 0xff) {
+        return idCounters[id];
+    }
+
+    std::lock_guard<std::mutex> lock(namedMutex);
+    return namedCounters[getTableName(key)];
+}
+
+void CryptoKernel::Storage::Stats::recordGet(const std::string& key, const bool hit,
+        const size_t size) {
+    Counters& counters = getCounters(key);
+    counters.gets++;
+    if(hit) {
+        counters.hits++;
+    } else {
+        counters.misses++;
+        counters.bytesRead += size;
+    }
+}
+
+void CryptoKernel::Storage::Stats::recordScan(const std::string& key, const size_t size) {
+    Counters& counters = getCounters(key);
+    counters.scans++;
+    counters.bytesRead += size;
+}
+
+void CryptoKernel::Storage::Stats::recordPut(const std::string& key, const size_t size) {
+    Counters& counters = getCounters(key);
+    counters.puts++;
+    counters.bytesWritten += size;
+}
+
+void CryptoKernel::Storage::Stats::recordErase(const std::string& key) {
+    Counters& counters = getCounters(key);
+    counters.erases++;
+    counters.bytesWritten += key.size();
+}
+
+void CryptoKernel::Storage::Stats::recordCommit(const uint64_t micros, const uint64_t keys,
+        const uint64_t bytes) {
+    commitLatency.record(micros);
+    commitKeys.record(keys);
+    commitBytes.record(bytes);
+}
+
+void CryptoKernel::Storage::Stats::recordLockWait(const uint64_t micros) {
+    lockWait.record(micros);
+}
+
+void CryptoKernel::Storage::Stats::recordSpills(const uint64_t spills) {
+    writeSetSpills += spills;
+}
+
+Json::Value CryptoKernel::Storage::Stats::getStats() {
+    Json::Value returning;
+    returning["tables"] = Json::Value(Json::objectValue);
+
+    for(unsigned int id = 0; id < 0xff; id++) {
+        const Counters& counters = idCounters[id];
+        if(counters.gets > 0 || counters.scans > 0 || counters.puts > 0 || counters.erases > 0) {
+            returning["tables"][getTableName(std::string(1, static_cast<char>(id)))] = counters.toJson();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(namedMutex);
+        for(const auto& counters : namedCounters) {
+            returning["tables"][counters.first] = counters.second.toJson();
+        }
+    }
+
+    returning["commitLatency"] = commitLatency.toJson();
+    returning["commitKeys"] = commitKeys.toJson();
+    returning["commitBytes"] = commitBytes.toJson();
+    returning["lockWait"] = lockWait.toJson();
+    returning["writeSetSpills"] = static_cast<Json::UInt64>(writeSetSpills);
+
+    return returning;
+}
@@ -0,0 +1,155 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STORAGESTATS_H_INCLUDED
+#define STORAGESTATS_H_INCLUDED
+
+#include <atomic>
+#include <map>
+
+#include "storage.h"
+
+namespace CryptoKernel {
+/**
+* Operation counters of a Storage. Counters are kept per table, found from
+* the table id at the start of each database key, so recording an
+* operation on a table with a built-in or explicit id takes no lock.
+* Commit latency, commit size and the time write transactions wait for
+* the database lock are kept as histograms.
+*/
+class Storage::Stats {
+public:
+    Stats();
+
+    /**
+    * Records a read of a key
+    *
+    * @param key the database key read
+    * @param hit true if the value was staged, cached or ruled out by a
+    *        filter, false if it was read from the engine
+    * @param size the number of bytes read from the engine
+    */
+    void recordGet(const std::string& key, const bool hit, const size_t size);
+
+    /**
+    * Records a value read from the engine by an iterator
+    *
+    * @param key the database key read
+    * @param size the number of bytes read
+    */
+    void recordScan(const std::string& key, const size_t size);
+
+    /**
+    * Records a committed write of a key
+    *
+    * @param key the database key written
+    * @param size the encoded size of the key and value in bytes
+    */
+    void recordPut(const std::string& key, const size_t size);
+
+    /**
+    * Records a committed erase of a key
+    *
+    * @param key the database key erased
+    */
+    void recordErase(const std::string& key);
+
+    /**
+    * Records a completed commit
+    *
+    * @param micros the time taken by the commit in microseconds
+    * @param keys the number of keys written or erased
+    * @param bytes the size of the batch in bytes
+    */
+    void recordCommit(const uint64_t micros, const uint64_t keys, const uint64_t bytes);
+
+    /**
+    * Records the time a write transaction waited for the database lock
+    *
+    * @param micros the time waited in microseconds
+    */
+    void recordLockWait(const uint64_t micros);
+
+    /**
+    * Records the number of times a committed transaction spilled its write
+    * set
+    */
+    void recordSpills(const uint64_t spills);
+
+    /**
+    * Returns every counter as json. "tables" maps each table name to its
+    * gets, hits, misses, scans, puts, erases, bytesRead and bytesWritten.
+    * "commitLatency" and "lockWait" are histograms in microseconds,
+    * "commitKeys" and "commitBytes" histograms of the commit sizes and
+    * "writeSetSpills" the number of write set spills.
+    */
+    Json::Value getStats();
+
+    /**
+    * A histogram with one bucket per power of two. Percentiles are
+    * reported as the upper bound of the bucket they fall in.
+    */
+    class Histogram {
+    public:
+        Histogram();
+
+        void record(const uint64_t value);
+
+        /**
+        * Returns the count, sum, mean, max, p50, p90, p99 and the non-empty
+        * buckets as {"le": upper bound, "count": values} objects
+        */
+        Json::Value toJson() const;
+
+    private:
+        uint64_t percentile(const uint64_t count, const double fraction) const;
+
+        std::atomic<uint64_t> buckets[65];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+    };
+
+private:
+    struct Counters {
+        std::atomic<uint64_t> gets{0};
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> scans{0};
+        std::atomic<uint64_t> puts{0};
+        std::atomic<uint64_t> erases{0};
+        std::atomic<uint64_t> bytesRead{0};
+        std::atomic<uint64_t> bytesWritten{0};
+
+        Json::Value toJson() const;
+    };
+
+    Counters& getCounters(const std::string& key);
+
+    Counters idCounters[256];
+    std::map<std::string, Counters> namedCounters;
+    std::mutex namedMutex;
+
+    Histogram commitLatency;
+    Histogram commitKeys;
+    Histogram commitBytes;
+    Histogram lockWait;
+    std::atomic<uint64_t> writeSetSpills;
+};
+}
+
+#endif // STORAGESTATS_H_INCLUDED
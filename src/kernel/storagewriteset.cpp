@@ -0,0 +1,267 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+
+#include "storagewriteset.h"
+
+/* The same estimates as the value cache: the hash node and bookkeeping of
+   a key, and decoded values taking roughly twice their encoded size. */
+static const size_t entryOverhead = 128;
+static const size_t decodedFactor = 2;
+
+/* The arena is rebuilt once overwritten values take up half of it */
+static const uint64_t minCompactBytes = 1024 * 1024;
+
+static bool compareKeys(const std::string* lhs, const std::string* rhs) {
+    return *lhs < *rhs;
+}
+
+CryptoKernel::Storage::WriteSet::WriteSet(const uint64_t budget, const bool jsonValues) {
+    this->budget = budget;
+    this->jsonValues = jsonValues;
+    sortedKeys.reset(new std::vector<const std::string*>());
+    garbage = 0;
+    indexBytes = 0;
+    decodedBytes = 0;
+    spills = 0;
+    undoBytes = 0;
+}
+
+CryptoKernel::Storage::WriteSet::Entry& CryptoKernel::Storage::WriteSet::stage(
+    const std::string& key) {
+    const auto inserted = entries.emplace(key, Entry{nullptr, 0, 0, true});
+    Entry& entry = inserted.first->second;
+
+    if(!savepoints.empty()) {
+        // Decoded values are not kept for undo, the arena still holds the
+        // encoded value
+        Entry previous = entry;
+        previous.value.reset();
+        undoLog.push_back(Undo{key, !inserted.second, previous});
+        undoBytes += key.size() + sizeof(Undo);
+    }
+
+    if(inserted.second) {
+        // Element addresses survive rehashing, so the key can be referenced
+        // until the write set is cleared
+        newKeys.push_back(&inserted.first->first);
+        indexBytes += key.size() + entryOverhead;
+    } else {
+        garbage += entry.size;
+        if(entry.value) {
+            decodedBytes -= key.size() + entry.size * decodedFactor;
+        }
+    }
+
+    return entry;
+}
+
+void CryptoKernel::Storage::WriteSet::put(const std::string& key, const Json::Value& value) {
+    Entry& entry = stage(key);
+    const bool wasDecoded = entry.value != nullptr;
+
+    entry.offset = arena.size();
+    if(jsonValues) {
+        arena.append(toString(value));
+    } else {
+        appendBinary(arena, value);
+    }
+    entry.size = arena.size() - entry.offset;
+    entry.erased = false;
+    entry.value = std::make_shared<const Json::Value>(value);
+
+    decodedBytes += key.size() + entry.size * decodedFactor;
+    if(!wasDecoded) {
+        decoded.push_back(&entry);
+    }
+
+    if(decodedBytes > budget) {
+        spill();
+    }
+
+    // Undo records point into the arena, so it is not compacted while a
+    // savepoint is held
+    if(savepoints.empty() && garbage >= minCompactBytes && garbage * 2 >= arena.size()) {
+        compact();
+    }
+}
+
+void CryptoKernel::Storage::WriteSet::erase(const std::string& key) {
+    Entry& entry = stage(key);
+    entry.value.reset();
+    entry.offset = 0;
+    entry.size = 0;
+    entry.erased = true;
+}
+
+void CryptoKernel::Storage::WriteSet::spill() {
+    for(Entry* entry : decoded) {
+        entry->value.reset();
+    }
+    decoded.clear();
+    decodedBytes = 0;
+    spills++;
+}
+
+void CryptoKernel::Storage::WriteSet::compact() {
+    std::string compacted;
+    compacted.reserve(arena.size() - garbage);
+    for(auto& entry : entries) {
+        if(!entry.second.erased) {
+            const size_t offset = compacted.size();
+            compacted.append(arena, entry.second.offset, entry.second.size);
+            entry.second.offset = offset;
+        }
+    }
+
+    arena.swap(compacted);
+    garbage = 0;
+}
+
+unsigned int CryptoKernel::Storage::WriteSet::savepoint() {
+    savepoints.push_back(Mark{undoLog.size(), arena.size(), garbage, indexBytes});
+
+    return savepoints.size() - 1;
+}
+
+void CryptoKernel::Storage::WriteSet::rollbackTo(const unsigned int savepoint) {
+    if(savepoint >= savepoints.size()) {
+        throw std::runtime_error("Savepoint " + std::to_string(savepoint) + " is not held");
+    }
+
+    const Mark& mark = savepoints[savepoint];
+    bool removedKeys = false;
+    while(undoLog.size() > mark.undoSize) {
+        const Undo& undo = undoLog.back();
+        if(undo.existed) {
+            entries.find(undo.key)->second = undo.previous;
+        } else {
+            entries.erase(undo.key);
+            removedKeys = true;
+        }
+        undoBytes -= undo.key.size() + sizeof(Undo);
+        undoLog.pop_back();
+    }
+
+    // Every restored entry was staged before the savepoint, so the values
+    // appended since can be dropped
+    arena.resize(mark.arenaSize);
+    garbage = mark.garbage;
+    indexBytes = mark.indexBytes;
+    savepoints.resize(savepoint + 1);
+
+    decoded.clear();
+    decodedBytes = 0;
+    for(auto& entry : entries) {
+        if(entry.second.value) {
+            decoded.push_back(&entry.second);
+            decodedBytes += entry.first.size() + entry.second.size * decodedFactor;
+        }
+    }
+
+    if(removedKeys) {
+        sortedKeys.reset(new std::vector<const std::string*>());
+        newKeys.clear();
+        for(const auto& entry : entries) {
+            newKeys.push_back(&entry.first);
+        }
+    }
+}
+
+void CryptoKernel::Storage::WriteSet::release(const unsigned int savepoint) {
+    if(savepoint >= savepoints.size()) {
+        throw std::runtime_error("Savepoint " + std::to_string(savepoint) + " is not held");
+    }
+
+    savepoints.resize(savepoint);
+    if(savepoints.empty()) {
+        undoLog.clear();
+        undoBytes = 0;
+    }
+}
+
+const CryptoKernel::Storage::WriteSet::Entry* CryptoKernel::Storage::WriteSet::find(
+    const std::string& key) const {
+    const auto it = entries.find(key);
+    if(it == entries.end()) {
+        return nullptr;
+    }
+
+    return &it->second;
+}
+
+std::shared_ptr<const Json::Value> CryptoKernel::Storage::WriteSet::getValue(
+    const Entry& entry) const {
+    if(entry.value || entry.erased) {
+        return entry.value;
+    }
+
+    return std::make_shared<const Json::Value>(fromBinary(arena.data() + entry.offset,
+            entry.size));
+}
+
+leveldb::Slice CryptoKernel::Storage::WriteSet::getEncoded(const Entry& entry) const {
+    return leveldb::Slice(arena.data() + entry.offset, entry.size);
+}
+
+std::shared_ptr<const std::vector<const std::string*>>
+CryptoKernel::Storage::WriteSet::getSortedKeys() {
+    if(!newKeys.empty()) {
+        // Merge the keys staged since the last call into a new list, so
+        // lists handed out earlier stay unchanged
+        std::sort(newKeys.begin(), newKeys.end(), compareKeys);
+
+        std::shared_ptr<std::vector<const std::string*>> merged(
+            new std::vector<const std::string*>());
+        merged->reserve(sortedKeys->size() + newKeys.size());
+        std::merge(sortedKeys->begin(), sortedKeys->end(), newKeys.begin(), newKeys.end(),
+                   std::back_inserter(*merged), compareKeys);
+
+        sortedKeys = merged;
+        newKeys.clear();
+    }
+
+    return sortedKeys;
+}
+
+const std::unordered_map<std::string, CryptoKernel::Storage::WriteSet::Entry>&
+CryptoKernel::Storage::WriteSet::getEntries() const {
+    return entries;
+}
+
+void CryptoKernel::Storage::WriteSet::clear() {
+    entries.clear();
+    decoded.clear();
+    sortedKeys.reset(new std::vector<const std::string*>());
+    newKeys.clear();
+    std::string().swap(arena);
+    undoLog.clear();
+    savepoints.clear();
+    undoBytes = 0;
+    garbage = 0;
+    indexBytes = 0;
+    decodedBytes = 0;
+}
+
+uint64_t CryptoKernel::Storage::WriteSet::getMemoryUsage() const {
+    return arena.capacity() + indexBytes + decodedBytes + undoBytes;
+}
+
+uint64_t CryptoKernel::Storage::WriteSet::getSpills() const {
+    return spills;
+}
@@ -0,0 +1,163 @@
+/*  CryptoKernel - A library for creating blockchain based digital currency
+    Copyright (C) 2016  James Lovejoy
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STORAGEWRITESET_H_INCLUDED
+#define STORAGEWRITESET_H_INCLUDED
+
+#include <unordered_map>
+#include <vector>
+
+#include <leveldb/slice.h>
+
+#include "storage.h"
+
+namespace CryptoKernel {
+/**
+* The writes staged by a transaction. Keys are hashed, and every value is
+* encoded into an append-only arena when it is staged, which is what the
+* commit writes. Recently staged values also keep their decoded copy so
+* reading them back is free. Once the decoded copies exceed the memory
+* budget they are dropped, spilling the write set to the arena, and spilled
+* values are decoded again when read.
+*
+* While a savepoint is held every write also records the entry it replaced,
+* and the arena is only appended to, so rolling back restores the previous
+* entries and truncates the arena.
+*/
+class Storage::WriteSet {
+public:
+    /**
+    * Constructs an empty write set
+    *
+    * @param budget the approximate memory in bytes decoded values may use
+    *        before they are spilled, zero keeps only the encoded values
+    * @param jsonValues true to encode values as legacy json text rather
+    *        than binary
+    */
+    WriteSet(const uint64_t budget, const bool jsonValues);
+
+    /**
+    * A staged write. Erased keys have no value.
+    */
+    struct Entry {
+        std::shared_ptr<const Json::Value> value;
+        size_t offset;
+        size_t size;
+        bool erased;
+    };
+
+    void put(const std::string& key, const Json::Value& value);
+    void erase(const std::string& key);
+
+    /**
+    * Returns the staged write of the given key, or nullptr if there is
+    * none. The entry is valid until the key is written again.
+    */
+    const Entry* find(const std::string& key) const;
+
+    /**
+    * Returns the value of a staged put, decoding it if it was spilled
+    */
+    std::shared_ptr<const Json::Value> getValue(const Entry& entry) const;
+
+    /**
+    * Returns the encoded value of a staged put. The slice is valid until
+    * the next write.
+    */
+    leveldb::Slice getEncoded(const Entry& entry) const;
+
+    /**
+    * Returns every staged key in order. The returned list is not changed
+    * by later writes.
+    */
+    std::shared_ptr<const std::vector<const std::string*>> getSortedKeys();
+
+    const std::unordered_map<std::string, Entry>& getEntries() const;
+
+    void clear();
+
+    /**
+    * Marks the current state of the write set
+    *
+    * @return the savepoint, which nests inside every savepoint still held
+    */
+    unsigned int savepoint();
+
+    /**
+    * Undoes every write made since the given savepoint. The savepoint is
+    * kept and any savepoints nested inside it are released.
+    *
+    * @throw std::runtime_error if the savepoint is not held
+    */
+    void rollbackTo(const unsigned int savepoint);
+
+    /**
+    * Releases the given savepoint and every savepoint nested inside it,
+    * keeping their writes
+    *
+    * @throw std::runtime_error if the savepoint is not held
+    */
+    void release(const unsigned int savepoint);
+
+    /**
+    * Returns the approximate memory used by the write set in bytes
+    */
+    uint64_t getMemoryUsage() const;
+
+    /**
+    * Returns the number of times decoded values were spilled
+    */
+    uint64_t getSpills() const;
+
+private:
+    Entry& stage(const std::string& key);
+    void spill();
+    void compact();
+
+    struct Undo {
+        std::string key;
+        bool existed;
+        Entry previous;
+    };
+
+    struct Mark {
+        size_t undoSize;
+        size_t arenaSize;
+        uint64_t garbage;
+        uint64_t indexBytes;
+    };
+
+    std::unordered_map<std::string, Entry> entries;
+    std::vector<Entry*> decoded;
+    std::shared_ptr<std::vector<const std::string*>> sortedKeys;
+    std::vector<const std::string*> newKeys;
+
+    std::vector<Undo> undoLog;
+    std::vector<Mark> savepoints;
+    uint64_t undoBytes;
+
+    std::string arena;
+    uint64_t garbage;
+    uint64_t indexBytes;
+    uint64_t decodedBytes;
+    uint64_t budget;
+    bool jsonValues;
+    uint64_t spills;
+};
+}
+
+#endif // STORAGEWRITESET_H_INCLUDED
@@ -0,0 +1,712 @@
+#include <cstdio>
+
+#include "BlockchainTests.h"
+#include "crypto.h"
+#include "blockchaincoinscache.h"
+#include "blockchainmempool.h"
+#include "blockchainvalidationpool.h"
+
+CPPUNIT_TEST_SUITE_REGISTRATION(BlockchainTest);
+
+/* Accepts every block, preferring the one with the most "work" in its
+   consensus data, so tests can build forks by hand */
+class TestConsensus : public CryptoKernel::Consensus {
+public:
+    bool isBlockBetter(CryptoKernel::Storage::Transaction* transaction,
+                       const CryptoKernel::Blockchain::block& block,
+                       const CryptoKernel::Blockchain::dbBlock& tip) {
+        return block.getConsensusData()["work"].asUInt64() >
+               tip.getConsensusData()["work"].asUInt64();
+    }
+
+    bool checkConsensusRules(CryptoKernel::Storage::Transaction* transaction,
+                             const CryptoKernel::Blockchain::block& block,
+                             const CryptoKernel::Blockchain::dbBlock& previousBlock) {
+        return !block.getConsensusData()["invalid"].asBool();
+    }
+
+    Json::Value generateConsensusData(CryptoKernel::Storage::Transaction* transaction,
+                                      const CryptoKernel::BigNum& previousBlockId,
+                                      const std::string& publicKey) {
+        return Json::Value();
+    }
+
+    bool verifyTransaction(CryptoKernel::Storage::Transaction* transaction,
+                           const CryptoKernel::Blockchain::transaction& tx) {
+        return true;
+    }
+
+    bool confirmTransaction(CryptoKernel::Storage::Transaction* transaction,
+                            const CryptoKernel::Blockchain::transaction& tx) {
+        return true;
+    }
+
+    bool submitTransaction(CryptoKernel::Storage::Transaction* transaction,
+                           const CryptoKernel::Blockchain::transaction& tx) {
+        return true;
+    }
+
+    bool submitBlock(CryptoKernel::Storage::Transaction* transaction,
+                     const CryptoKernel::Blockchain::block& block) {
+        return true;
+    }
+
+    void start() {
+    }
+};
+
+/* A chain on the memory engine whose coins are flushed on every commit
+   and whose values are not cached, so its tables can be read and written
+   by opening the same database again */
+class TestChain : public CryptoKernel::Blockchain {
+public:
+    TestChain(CryptoKernel::Log* log) : CryptoKernel::Blockchain(log, "testchaindb", options()) {
+        std::remove("testchaingenesis.json");
+        loadChain(&consensus, "testchaingenesis.json");
+    }
+
+    ~TestChain() {
+        std::remove("testchaingenesis.json");
+    }
+
+    /* A block on the given block paying its reward to an output anyone
+       can spend */
+    block makeBlock(const CryptoKernel::BigNum& previousBlockId, const std::set<transaction>& txs,
+                    const uint64_t work, const uint64_t nonce) {
+        const transaction coinbase({}, {output(100000, nonce, Json::Value())}, nonce, true);
+        Json::Value consensusData;
+        consensusData["work"] = static_cast<Json::UInt64>(work);
+        return block(txs, coinbase, previousBlockId, nonce, consensusData, work + 1);
+    }
+
+    /* A transaction spending an output anyone can spend into another */
+    static transaction spend(const output& out, const uint64_t nonce) {
+        return transaction({input(out.getId(), Json::Value())},
+                           {output(out.getValue() - 3000, nonce, Json::Value())}, nonce);
+    }
+
+private:
+    static Json::Value options() {
+        Json::Value returning;
+        returning["engine"] = "memory";
+        returning["cacheSize"] = 0;
+        returning["coinsCacheSize"] = 0;
+        returning["validationThreads"] = 0;
+        return returning;
+    }
+
+    uint64_t getBlockReward(const uint64_t height) {
+        return 100000;
+    }
+
+    std::string getCoinbaseOwner(const std::string& publicKey) {
+        return publicKey;
+    }
+
+    TestConsensus consensus;
+};
+
+BlockchainTest::BlockchainTest() {
+}
+
+BlockchainTest::~BlockchainTest() {
+    CryptoKernel::Storage::destroy("testcoinsdb");
+    CryptoKernel::Storage::destroy("testchaindb");
+}
+
+void BlockchainTest::setUp() {
+}
+
+void BlockchainTest::tearDown() {
+    CryptoKernel::Storage::destroy("testchaindb");
+    std::remove("testchain.log");
+}
+
+void BlockchainTest::testCoinsCache() {
+    Json::Value options;
+    options["engine"] = "memory";
+    CryptoKernel::Storage database("testcoinsdb", options);
+
+    {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+        dbTx->put("spent", Json::Value("on disk"));
+        dbTx->commit();
+    }
+
+    CryptoKernel::Blockchain::CoinsCache coins(1024 * 1024, 2);
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+
+    // Misses are read from the database and cached
+    CPPUNIT_ASSERT_EQUAL(std::string("on disk"), coins.get(dbTx.get(), "spent")->asString());
+    CPPUNIT_ASSERT(coins.get(dbTx.get(), "spent")->asString() == "on disk");
+    CPPUNIT_ASSERT(coins.get(dbTx.get(), "created")->isNull());
+    CPPUNIT_ASSERT(coins.contains("created"));
+
+    // A key known to be missing is fresh, so erasing it writes nothing
+    coins.put("created", Json::Value("new"));
+    CPPUNIT_ASSERT_EQUAL(std::string("new"), coins.get(dbTx.get(), "created")->asString());
+    coins.erase("created");
+    CPPUNIT_ASSERT(coins.get(dbTx.get(), "created")->isNull());
+
+    coins.erase("spent");
+    coins.put("kept", Json::Value("kept"));
+
+    // Changes after a savepoint are undone without touching earlier ones
+    const size_t savepoint = coins.savepoint();
+    coins.put("undone", Json::Value(1));
+    coins.put("kept", Json::Value("changed"));
+    coins.rollbackTo(savepoint);
+    CPPUNIT_ASSERT(!coins.contains("undone"));
+    CPPUNIT_ASSERT_EQUAL(std::string("kept"), coins.get(dbTx.get(), "kept")->asString());
+
+    // Nothing is written until the cache is flushed
+    CPPUNIT_ASSERT(!coins.needsFlush());
+    coins.recordBlock();
+    coins.recordBlock();
+    CPPUNIT_ASSERT(coins.needsFlush());
+
+    coins.flush(dbTx.get());
+    dbTx->commit();
+    coins.commit(database.getSequence(), database.getOldestSnapshot());
+    coins.flushed();
+    CPPUNIT_ASSERT(!coins.needsFlush());
+
+    {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+        CPPUNIT_ASSERT(readTx->get("spent").isNull());
+        CPPUNIT_ASSERT(readTx->get("created").isNull());
+        CPPUNIT_ASSERT_EQUAL(std::string("kept"), readTx->get("kept").asString());
+    }
+
+    Json::Value stats = coins.getStats();
+    CPPUNIT_ASSERT_EQUAL(1u, stats["flushes"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(1u, stats["flushedPuts"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(1u, stats["flushedErases"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(1u, stats["writesAvoided"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(0u, stats["dirty"].asUInt());
+    CPPUNIT_ASSERT(stats["hits"].asUInt() > 0);
+    CPPUNIT_ASSERT(stats["misses"].asUInt() > 0);
+    CPPUNIT_ASSERT_EQUAL(1u, stats["lastFlush"]["puts"].asUInt());
+
+    // Keys known to be created are fresh without being read, and range
+    // scans see the writes not flushed yet in key order
+    coins.put("range/b", Json::Value(true), true);
+    coins.put("range/a", Json::Value(true), true);
+    coins.erase("kept");
+    coins.put("rangf", Json::Value(true));
+    const auto dirty = coins.getDirty("range/", "range0");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), dirty.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("range/a"), dirty[0].first);
+    CPPUNIT_ASSERT_EQUAL(std::string("range/b"), dirty[1].first);
+    CPPUNIT_ASSERT(coins.getDirty("kept", "kept0")[0].second->isNull());
+    coins.erase("range/a");
+    CPPUNIT_ASSERT_EQUAL(2u, coins.getStats()["writesAvoided"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), coins.getDirty("range/", "range0").size());
+    coins.abort();
+    CPPUNIT_ASSERT(coins.getDirty("", "z").empty());
+    CPPUNIT_ASSERT_EQUAL(std::string("kept"), coins.get(dbTx.get(), "kept")->asString());
+
+    // Aborting undoes every change since the last commit
+    coins.put("aborted", Json::Value(2));
+    coins.abort();
+    CPPUNIT_ASSERT(!coins.contains("aborted"));
+
+    // Read-only transactions may see an older database, so what they read
+    // is not cached
+    {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+        CPPUNIT_ASSERT(coins.get(readTx.get(), "unread")->isNull());
+        CPPUNIT_ASSERT(!coins.contains("unread"));
+        const auto values = coins.getMany(readTx.get(), {"kept", "unread"});
+        CPPUNIT_ASSERT_EQUAL(std::string("kept"), values[0]->asString());
+        CPPUNIT_ASSERT(values[1]->isNull());
+        CPPUNIT_ASSERT(!coins.contains("unread"));
+    }
+
+    // A cache over its budget is emptied once flushed
+    CryptoKernel::Blockchain::CoinsCache small(1, 0);
+    std::unique_ptr<CryptoKernel::Storage::Transaction> smallTx(database.begin());
+    small.put("small", Json::Value(3));
+    CPPUNIT_ASSERT(small.needsFlush());
+    small.flush(smallTx.get());
+    smallTx->commit();
+    small.commit(database.getSequence(), database.getOldestSnapshot());
+    small.flushed();
+    CPPUNIT_ASSERT(!small.contains("small"));
+    CPPUNIT_ASSERT_EQUAL(0u, small.getStats()["bytes"].asUInt());
+}
+
+void BlockchainTest::testCoinsCommittedView() {
+    Json::Value options;
+    options["engine"] = "memory";
+    CryptoKernel::Storage database("testcoinsdb", options);
+
+    CryptoKernel::Blockchain::CoinsCache coins(1024 * 1024, 0);
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    coins.put("range/a", Json::Value("committed"), true);
+    coins.commit(database.getSequence(), database.getOldestSnapshot());
+
+    // Read-only transactions see the cache as of the last commit, while
+    // the writer sees its own changes
+    coins.put("range/a", Json::Value("connecting"));
+    coins.put("range/b", Json::Value("connecting"), true);
+    coins.erase("range/a");
+    {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+        CPPUNIT_ASSERT_EQUAL(std::string("committed"), coins.get(readTx.get(), "range/a")->asString());
+        CPPUNIT_ASSERT(coins.get(readTx.get(), "range/b")->isNull());
+        CPPUNIT_ASSERT(coins.getMany(readTx.get(), {"range/b"})[0]->isNull());
+        CPPUNIT_ASSERT(coins.get(dbTx.get(), "range/a")->isNull());
+
+        const auto committed = coins.getDirty("range/", "range0", true);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), committed.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("committed"), committed[0].second->asString());
+        // The writer's erase of a key never flushed drops it entirely
+        const auto current = coins.getDirty("range/", "range0");
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), current.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("range/b"), current[0].first);
+    }
+
+    // Rolling back to a savepoint keeps the changes before it journaled
+    const size_t savepoint = coins.savepoint();
+    coins.put("range/c", Json::Value(1), true);
+    coins.rollbackTo(savepoint);
+    {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+        CPPUNIT_ASSERT_EQUAL(std::string("committed"), coins.get(readTx.get(), "range/a")->asString());
+    }
+
+    coins.commit(database.getSequence(), database.getOldestSnapshot());
+    {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+        CPPUNIT_ASSERT(coins.get(readTx.get(), "range/a")->isNull());
+        CPPUNIT_ASSERT_EQUAL(std::string("connecting"), coins.get(readTx.get(), "range/b")->asString());
+        CPPUNIT_ASSERT(coins.get(readTx.get(), "range/c")->isNull());
+    }
+
+    // A reader keeps the coins of its snapshot while later commits change
+    // them, without holding any lock
+    dbTx->abort();
+    std::unique_ptr<CryptoKernel::Storage::Transaction> oldTx(database.beginReadOnly());
+    dbTx.reset(database.begin());
+    dbTx->put("block", Json::Value(1));
+    coins.put("range/b", Json::Value("later"));
+    coins.put("range/d", Json::Value("later"), true);
+    dbTx->commit();
+    coins.commit(database.getSequence(), database.getOldestSnapshot());
+    CPPUNIT_ASSERT_EQUAL(std::string("connecting"), coins.get(oldTx.get(), "range/b")->asString());
+    CPPUNIT_ASSERT(coins.getMany(oldTx.get(), {"range/d"})[0]->isNull());
+    {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+        CPPUNIT_ASSERT_EQUAL(std::string("later"), coins.get(readTx.get(), "range/b")->asString());
+    }
+    CPPUNIT_ASSERT_EQUAL(1u, coins.getStats()["versions"].asUInt());
+
+    // Entries dropped by a flush stay visible to it, as its snapshot of the
+    // database predates the flush
+    CryptoKernel::Blockchain::CoinsCache small(1, 0);
+    dbTx.reset(database.begin());
+    small.put("small", Json::Value(3), true);
+    dbTx->commit();
+    small.commit(database.getSequence(), database.getOldestSnapshot());
+    oldTx.reset(database.beginReadOnly());
+    dbTx.reset(database.begin());
+    small.flush(dbTx.get());
+    dbTx->commit();
+    small.commit(database.getSequence(), database.getOldestSnapshot());
+    small.flushed();
+    CPPUNIT_ASSERT(!small.contains("small"));
+    CPPUNIT_ASSERT_EQUAL(3, small.get(oldTx.get(), "small")->asInt());
+
+    // History is released once no reader is older than it
+    oldTx.reset();
+    dbTx.reset(database.begin());
+    dbTx->commit();
+    small.commit(database.getSequence(), database.getOldestSnapshot());
+    CPPUNIT_ASSERT_EQUAL(0u, small.getStats()["versions"].asUInt());
+}
+
+void BlockchainTest::testValidationPool() {
+    CryptoKernel::Blockchain::ValidationPool pool(3);
+
+    // Every task runs exactly once
+    std::vector<std::atomic<unsigned int>> calls(1000);
+    for(auto& count : calls) {
+        count = 0;
+    }
+    CPPUNIT_ASSERT(pool.run(calls.size(), [&](const size_t i) {
+        calls[i]++;
+        return true;
+    }));
+    for(const auto& count : calls) {
+        CPPUNIT_ASSERT_EQUAL(1u, count.load());
+    }
+
+    // The first failure cancels the tasks not started yet, and a task
+    // that throws fails the batch
+    std::atomic<unsigned int> started(0);
+    CPPUNIT_ASSERT(!pool.run(100000, [&](const size_t i) {
+        started++;
+        return i != 0;
+    }));
+    CPPUNIT_ASSERT(started < 100000);
+    CPPUNIT_ASSERT(!pool.run(10, [&](const size_t i) -> bool {
+        if(i == 5) {
+            throw std::runtime_error("invalid");
+        }
+        return true;
+    }));
+    CPPUNIT_ASSERT(pool.run(0, [&](const size_t) {
+        return false;
+    }));
+
+    const Json::Value stats = pool.getStats();
+    CPPUNIT_ASSERT_EQUAL(4u, stats["threads"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(3u, stats["batches"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(2u, stats["cancelled"].asUInt());
+    CPPUNIT_ASSERT(stats["skipped"].asUInt64() > 0);
+    CPPUNIT_ASSERT_EQUAL(10u, stats["lastBatch"]["tasks"].asUInt());
+    CPPUNIT_ASSERT(stats["lastBatch"]["failed"].asBool());
+
+    // A pool without workers runs every task on the calling thread
+    CryptoKernel::Blockchain::ValidationPool serial(0);
+    unsigned int ran = 0;
+    CPPUNIT_ASSERT(serial.run(10, [&](const size_t) {
+        ran++;
+        return true;
+    }));
+    CPPUNIT_ASSERT_EQUAL(10u, ran);
+}
+
+void BlockchainTest::testMempool() {
+    typedef CryptoKernel::Blockchain chain;
+    const auto spend = [](const CryptoKernel::BigNum& outputId, const uint64_t nonce) {
+        return chain::transaction({chain::input(outputId, Json::Value())},
+                                  {chain::output(1, nonce, Json::Value())}, 1);
+    };
+
+    const chain::transaction parent = spend(CryptoKernel::BigNum("a1"), 1);
+    const chain::transaction child = spend(parent.getOutputs().begin()->getId(), 2);
+    const chain::transaction other = spend(CryptoKernel::BigNum("a2"), 3);
+    const chain::transaction cheap = spend(CryptoKernel::BigNum("a3"), 4);
+
+    // A spend of an output already spent in the mempool conflicts
+    chain::Mempool unbounded(0, 0);
+    CPPUNIT_ASSERT(unbounded.insert(parent, 100));
+    CPPUNIT_ASSERT(!unbounded.insert(spend(CryptoKernel::BigNum("a1"), 5), 1000));
+    CPPUNIT_ASSERT(unbounded.insert(child, 900));
+
+    // A transaction spending one output twice cannot be built, so the
+    // mempool's own check against it is a second line of defence
+    CPPUNIT_ASSERT_THROW(chain::transaction({chain::input(CryptoKernel::BigNum("b1"), Json::Value()),
+                                             chain::input(CryptoKernel::BigNum("b1"), Json::Value("other"))},
+                                            {chain::output(1, 6, Json::Value())}, 1),
+                         chain::InvalidElementException);
+
+    // The estimate counts the heap behind the serialized transactions
+    Json::Value stats = unbounded.getStats();
+    CPPUNIT_ASSERT_EQUAL(2u, stats["count"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(1u, stats["conflicts"].asUInt());
+    CPPUNIT_ASSERT(stats["memory"].asUInt64() > stats["bytes"].asUInt64());
+    const uint64_t packageMemory = stats["memory"].asUInt64();
+
+    // The parent pays little but its package with the child pays more than
+    // the other transaction, which is evicted instead
+    chain::Mempool bounded(packageMemory + packageMemory / 4, 0);
+    CPPUNIT_ASSERT(bounded.insert(parent, 100));
+    CPPUNIT_ASSERT(bounded.insert(child, 900));
+    CPPUNIT_ASSERT_EQUAL(0.0, bounded.getMinFeeRate());
+    CPPUNIT_ASSERT(!bounded.insert(other, 400));
+    CPPUNIT_ASSERT_EQUAL(2u, bounded.count());
+
+    // The child waits for its parent to confirm before it is mined
+    const std::set<chain::transaction> selected = bounded.getTransactions();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), selected.size());
+    CPPUNIT_ASSERT(selected.find(parent) != selected.end());
+    CPPUNIT_ASSERT_EQUAL(parent.getOutputs().begin()->getId().toString(),
+                         bounded.getOutput(parent.getOutputs().begin()->getId())["id"].asString());
+    CPPUNIT_ASSERT(bounded.getOutput(other.getOutputs().begin()->getId()).isNull());
+
+    // Once the parent confirms the child spends a confirmed output
+    const chain::transaction coinbase({}, {chain::output(1, 99, Json::Value())}, 1, true);
+    bounded.blockConnected(chain::block({parent}, coinbase, CryptoKernel::BigNum("0"), 1,
+                                        Json::Value(), 1));
+    CPPUNIT_ASSERT_EQUAL(1u, bounded.count());
+    CPPUNIT_ASSERT(bounded.getTransactions().count(child) == 1);
+
+    // Evicting raised the minimum fee rate above the evicted rate
+    CPPUNIT_ASSERT(bounded.getMinFeeRate() > 400.0 / other.size());
+    CPPUNIT_ASSERT(!bounded.insert(cheap, 400));
+    stats = bounded.getStats();
+    CPPUNIT_ASSERT_EQUAL(1u, stats["evicted"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(1u, stats["lowFee"].asUInt());
+    CPPUNIT_ASSERT(stats["memory"].asUInt64() <= stats["maxMemory"].asUInt64());
+
+    // Expiring the parent takes its child with it
+    chain::Mempool expiring(0, 60);
+    CPPUNIT_ASSERT(expiring.insert(parent, 100));
+    CPPUNIT_ASSERT(expiring.insert(child, 900));
+    CPPUNIT_ASSERT_EQUAL(0u, expiring.expire(std::time(0)));
+    CPPUNIT_ASSERT_EQUAL(2u, expiring.expire(std::time(0) + 120));
+    CPPUNIT_ASSERT_EQUAL(0u, expiring.count());
+    CPPUNIT_ASSERT_EQUAL(0u, expiring.size());
+    CPPUNIT_ASSERT_EQUAL(0u, expiring.getStats()["memory"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(2u, expiring.getStats()["expired"].asUInt());
+
+    // A chain stops growing at 25 unconfirmed transactions
+    chain::Mempool chained(0, 0);
+    chain::transaction tip = parent;
+    CPPUNIT_ASSERT(chained.insert(tip, 100));
+    for(unsigned int i = 1; i < 25; i++) {
+        tip = spend(tip.getOutputs().begin()->getId(), 10 + i);
+        CPPUNIT_ASSERT(chained.insert(tip, 100));
+    }
+    CPPUNIT_ASSERT(!chained.insert(spend(tip.getOutputs().begin()->getId(), 100), 100));
+    stats = chained.getStats();
+    CPPUNIT_ASSERT_EQUAL(25u, stats["count"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(24u, stats["unconfirmedParents"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(1u, stats["chainLimit"].asUInt());
+
+    // A block spending the same output as a mempool transaction evicts it
+    // and its descendants
+    chain::Mempool conflicting(0, 0);
+    CPPUNIT_ASSERT(conflicting.insert(parent, 100));
+    CPPUNIT_ASSERT(conflicting.insert(child, 900));
+    CPPUNIT_ASSERT(conflicting.insert(other, 400));
+    conflicting.blockConnected(chain::block({spend(CryptoKernel::BigNum("a1"), 50)}, coinbase,
+                                            CryptoKernel::BigNum("0"), 1, Json::Value(), 1));
+    CPPUNIT_ASSERT_EQUAL(1u, conflicting.count());
+    CPPUNIT_ASSERT(conflicting.getOutput(other.getOutputs().begin()->getId()).isObject());
+
+    // As does a block creating an output the mempool transaction creates
+    const chain::transaction duplicate({chain::input(CryptoKernel::BigNum("c1"), Json::Value())},
+                                       other.getOutputs(), 1);
+    conflicting.blockConnected(chain::block({duplicate}, coinbase, CryptoKernel::BigNum("0"), 1,
+                                            Json::Value(), 1));
+    CPPUNIT_ASSERT_EQUAL(0u, conflicting.count());
+
+    // Outputs removed from the chain take their spenders and descendants
+    // with them, which are returned so a reorg can submit them again
+    CPPUNIT_ASSERT(conflicting.insert(parent, 100));
+    CPPUNIT_ASSERT(conflicting.insert(child, 900));
+    CPPUNIT_ASSERT(conflicting.insert(other, 400));
+    const std::vector<chain::transaction> removed =
+        conflicting.outputsRemoved({CryptoKernel::BigNum("a1"), CryptoKernel::BigNum("d1")});
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), removed.size());
+    CPPUNIT_ASSERT_EQUAL(child.getId().toString(), removed[0].getId().toString());
+    CPPUNIT_ASSERT_EQUAL(parent.getId().toString(), removed[1].getId().toString());
+    CPPUNIT_ASSERT_EQUAL(1u, conflicting.count());
+    CPPUNIT_ASSERT(conflicting.getOutput(parent.getOutputs().begin()->getId()).isNull());
+
+    // Templates take the highest fee rates first
+    chain::Mempool ranked(0, 0);
+    CPPUNIT_ASSERT(ranked.insert(cheap, 100));
+    CPPUNIT_ASSERT(ranked.insert(parent, 900));
+    CPPUNIT_ASSERT(ranked.insert(other, 400));
+    Json::Value projected = ranked.getProjectedBlock();
+    CPPUNIT_ASSERT_EQUAL(3u, projected["count"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(parent.getId().toString(), projected["transactions"][0]["id"].asString());
+    CPPUNIT_ASSERT_EQUAL(other.getId().toString(), projected["transactions"][1]["id"].asString());
+    CPPUNIT_ASSERT_EQUAL(cheap.getId().toString(), projected["transactions"][2]["id"].asString());
+
+    // A transaction too large for the rest of the block is skipped, and
+    // smaller ones with lower fee rates still fill the space it left
+    chain::Mempool full(0, 0);
+    Json::Value padding;
+    padding["padding"] = std::string(100000, 'x');
+    std::vector<chain::transaction> large;
+    for(unsigned int i = 0; i < 41; i++) {
+        large.push_back(chain::transaction({chain::input(CryptoKernel::BigNum("e" + std::to_string(i + 1)),
+                                                         Json::Value())},
+                                           {chain::output(1, 200 + i, padding)}, 1));
+        CPPUNIT_ASSERT(full.insert(large.back(), (41 - i) * 1000000));
+    }
+    CPPUNIT_ASSERT(full.insert(cheap, 100));
+    projected = full.getProjectedBlock();
+    CPPUNIT_ASSERT_EQUAL(41u, projected["count"].asUInt());
+    CPPUNIT_ASSERT(projected["size"].asUInt64() < projected["maxSize"].asUInt64());
+    CPPUNIT_ASSERT_EQUAL(large[39].getId().toString(), projected["transactions"][39]["id"].asString());
+    CPPUNIT_ASSERT_EQUAL(cheap.getId().toString(), projected["transactions"][40]["id"].asString());
+    CPPUNIT_ASSERT(full.getTransactions().count(large[40]) == 0);
+}
+
+void BlockchainTest::testReorgResubmitsMempool() {
+    typedef CryptoKernel::Blockchain chain;
+    CryptoKernel::Log log("testchain.log");
+    TestChain blockchain(&log);
+    const CryptoKernel::BigNum genesisId = blockchain.getBlockByHeight(1).getId();
+
+    const chain::block a1 = blockchain.makeBlock(genesisId, {}, 1, 1);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(a1)));
+    const chain::transaction parent = TestChain::spend(*a1.getCoinbaseTx().getOutputs().begin(), 2);
+    const chain::block a2 = blockchain.makeBlock(a1.getId(), {parent}, 2, 3);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(a2)));
+
+    // The child spends an output of a confirmed transaction
+    const chain::transaction child = TestChain::spend(*parent.getOutputs().begin(), 4);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitTransaction(child)));
+    CPPUNIT_ASSERT_EQUAL(1u, blockchain.mempoolCount());
+
+    // A longer fork without the parent disconnects it, and both the
+    // parent and the child it left in the mempool return
+    const chain::block b2 = blockchain.makeBlock(a1.getId(), {}, 2, 5);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(b2)));
+    const chain::block b3 = blockchain.makeBlock(b2.getId(), {}, 3, 6);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(b3)));
+    CPPUNIT_ASSERT_EQUAL(b3.getId().toString(), blockchain.getBlockDB("tip").getId().toString());
+    CPPUNIT_ASSERT_EQUAL(2u, blockchain.mempoolCount());
+
+    const std::set<chain::transaction> selected = blockchain.getUnconfirmedTransactions();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), selected.size());
+    CPPUNIT_ASSERT(selected.find(parent) != selected.end());
+}
+
+void BlockchainTest::testFailedReorg() {
+    typedef CryptoKernel::Blockchain chain;
+    CryptoKernel::Log log("testchain.log");
+    TestChain blockchain(&log);
+    const CryptoKernel::BigNum genesisId = blockchain.getBlockByHeight(1).getId();
+
+    const chain::block a1 = blockchain.makeBlock(genesisId, {}, 1, 1);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(a1)));
+    const chain::block a2 = blockchain.makeBlock(a1.getId(), {}, 2, 2);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(a2)));
+
+    // The mempool spends the coinbase of the block the reorg disconnects
+    const chain::transaction parent = TestChain::spend(*a2.getCoinbaseTx().getOutputs().begin(), 3);
+    const chain::transaction child = TestChain::spend(*parent.getOutputs().begin(), 4);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitTransaction(parent)));
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitTransaction(child)));
+
+    // The fork's first block spends an output that does not exist, so the
+    // reorg fails once a2 is disconnected
+    const chain::output missing(5000, 5, Json::Value());
+    const chain::block b2 = blockchain.makeBlock(a1.getId(), {TestChain::spend(missing, 6)}, 2, 7);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(b2)));
+    const chain::block b3 = blockchain.makeBlock(b2.getId(), {}, 3, 8);
+    CPPUNIT_ASSERT(!std::get<0>(blockchain.submitBlock(b3)));
+
+    CPPUNIT_ASSERT_EQUAL(a2.getId().toString(), blockchain.getBlockDB("tip").getId().toString());
+    CPPUNIT_ASSERT_EQUAL(2u, blockchain.mempoolCount());
+    CPPUNIT_ASSERT(blockchain.getUnconfirmedTransactions().count(parent) == 1);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(100000),
+                         blockchain.getOutput(a2.getCoinbaseTx().getOutputs().begin()->getId().toString()).getValue());
+}
+
+void BlockchainTest::testDisconnectBlock() {
+    typedef CryptoKernel::Blockchain chain;
+    CryptoKernel::Log log("testchain.log");
+    TestChain blockchain(&log);
+    const CryptoKernel::BigNum genesisId = blockchain.getBlockByHeight(1).getId();
+
+    // The block tables of the chain, read through a second handle on the
+    // same memory database
+    Json::Value options;
+    options["engine"] = "memory";
+    options["cacheSize"] = 0;
+    CryptoKernel::Storage database("testchaindb", options);
+    CryptoKernel::Storage::Table utxos("utxos");
+    CryptoKernel::Storage::Table stxos("stxos");
+    CryptoKernel::Storage::Table undo("undo");
+
+    // a2 pays to a public key, whose output a3 spends
+    CryptoKernel::Crypto crypto(true);
+    const std::string publicKey = crypto.getPublicKey();
+    Json::Value keyed;
+    keyed["publicKey"] = publicKey;
+
+    const chain::block a1 = blockchain.makeBlock(genesisId, {}, 1, 1);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(a1)));
+    const chain::output coinbaseOut = *a1.getCoinbaseTx().getOutputs().begin();
+    const chain::transaction pay({chain::input(coinbaseOut.getId(), Json::Value())},
+                                 {chain::output(coinbaseOut.getValue() - 20000, 2, keyed)}, 2);
+    const chain::block a2 = blockchain.makeBlock(a1.getId(), {pay}, 2, 3);
+    CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(a2)));
+
+    const chain::output owned = *pay.getOutputs().begin();
+    const std::set<chain::output> spentOuts = {chain::output(owned.getValue() - 20000, 4,
+                                               Json::Value())};
+    const CryptoKernel::BigNum outputSetId = chain::transaction({chain::input(owned.getId(),
+                                             Json::Value())}, spentOuts, 4).getOutputSetId();
+    Json::Value signature;
+    signature["signature"] = crypto.sign(owned.getId().toString() + outputSetId.toString());
+    const chain::transaction spendOwned({chain::input(owned.getId(), signature)}, spentOuts, 4);
+
+    const std::string ownedId = owned.getId().toString();
+    const std::string createdId = spentOuts.begin()->getId().toString();
+    const std::string addressKey = publicKey + ":" + ownedId;
+    const auto coinState = [&](const std::string& blockId) {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+        Json::Value returning;
+        returning["owned"] = utxos.get(readTx.get(), ownedId);
+        returning["created"] = utxos.get(readTx.get(), createdId);
+        returning["spent"] = stxos.get(readTx.get(), ownedId);
+        returning["unspentAddress"] = utxos.get(readTx.get(), addressKey, 1);
+        returning["spentAddress"] = stxos.get(readTx.get(), addressKey, 1);
+        returning["undo"] = undo.get(readTx.get(), blockId);
+        return returning;
+    };
+
+    const auto connectSpend = [&](const CryptoKernel::BigNum& previousBlockId,
+                                  const uint64_t work, const uint64_t nonce) {
+        const Json::Value before = coinState("");
+        const chain::block spending = blockchain.makeBlock(previousBlockId, {spendOwned}, work,
+                                      nonce);
+        CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(spending)));
+        CPPUNIT_ASSERT(blockchain.getUnspentOutputs(publicKey).empty());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), blockchain.getSpentOutputs(publicKey).size());
+
+        const Json::Value connected = coinState(spending.getId().toString());
+        CPPUNIT_ASSERT(connected["owned"].isNull());
+        CPPUNIT_ASSERT(connected["created"].isObject());
+        CPPUNIT_ASSERT(connected["spent"].isObject());
+        CPPUNIT_ASSERT(connected["unspentAddress"].isNull());
+        CPPUNIT_ASSERT(connected["spentAddress"].asBool());
+        CPPUNIT_ASSERT(connected["undo"][ownedId].isObject());
+        CPPUNIT_ASSERT(before["undo"].isNull());
+        return std::make_pair(spending, before);
+    };
+
+    // A longer fork disconnects the spending block, which restores the
+    // coins and address index to how they were before it connected
+    const auto disconnect = [&](const chain::block& spending, const Json::Value& before,
+                                const CryptoKernel::BigNum& forkId, const uint64_t work,
+                                const uint64_t nonce) {
+        const chain::block fork1 = blockchain.makeBlock(forkId, {}, work, nonce);
+        CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(fork1)));
+        const chain::block fork2 = blockchain.makeBlock(fork1.getId(), {}, work + 1, nonce + 1);
+        CPPUNIT_ASSERT(std::get<0>(blockchain.submitBlock(fork2)));
+        CPPUNIT_ASSERT_EQUAL(fork2.getId().toString(), blockchain.getBlockDB("tip").getId().toString());
+
+        Json::Value restored = coinState(spending.getId().toString());
+        CPPUNIT_ASSERT(restored["undo"].isNull());
+        restored.removeMember("undo");
+        Json::Value expected = before;
+        expected.removeMember("undo");
+        CPPUNIT_ASSERT_EQUAL(CryptoKernel::Storage::toString(expected),
+                             CryptoKernel::Storage::toString(restored));
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), blockchain.getUnspentOutputs(publicKey).size());
+        CPPUNIT_ASSERT(blockchain.getSpentOutputs(publicKey).empty());
+
+        // The disconnected transaction is submitted again once, after the
+        // fork has connected
+        CPPUNIT_ASSERT_EQUAL(1u, blockchain.mempoolCount());
+        CPPUNIT_ASSERT(blockchain.getUnconfirmedTransactions().count(spendOwned) == 1);
+        return fork2;
+    };
+
+    const auto a3 = connectSpend(a2.getId(), 3, 5);
+    const chain::block b4 = disconnect(a3.first, a3.second, a2.getId(), 3, 6);
+
+    // Blocks connected before undo records were kept have none, and the
+    // outputs they spent are read back from stxos instead
+    const auto b5 = connectSpend(b4.getId(), 5, 8);
+    CPPUNIT_ASSERT_EQUAL(0u, blockchain.mempoolCount());
+    {
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+        undo.erase(dbTx.get(), b5.first.getId().toString());
+        dbTx->commit();
+    }
+    disconnect(b5.first, b5.second, b4.getId(), 5, 9);
+}
@@ -0,0 +1,37 @@
+#ifndef BLOCKCHAINTEST_H
+#define BLOCKCHAINTEST_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "blockchain.h"
+
+class BlockchainTest : public CPPUNIT_NS::TestFixture {
+    CPPUNIT_TEST_SUITE(BlockchainTest);
+
+    CPPUNIT_TEST(testCoinsCache);
+    CPPUNIT_TEST(testCoinsCommittedView);
+    CPPUNIT_TEST(testValidationPool);
+    CPPUNIT_TEST(testMempool);
+    CPPUNIT_TEST(testReorgResubmitsMempool);
+    CPPUNIT_TEST(testFailedReorg);
+    CPPUNIT_TEST(testDisconnectBlock);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    BlockchainTest();
+    virtual ~BlockchainTest();
+    void setUp();
+    void tearDown();
+
+private:
+    void testCoinsCache();
+    void testCoinsCommittedView();
+    void testValidationPool();
+    void testMempool();
+    void testReorgResubmitsMempool();
+    void testFailedReorg();
+    void testDisconnectBlock();
+};
+
+#endif
@@ -1,4 +1,10 @@
+#include <set>
+
+#include <leveldb/db.h>
+#include <leveldb/env.h>
+
 #include "StorageTests.h"
+#include "storagefilter.h"
 
 CPPUNIT_TEST_SUITE_REGISTRATION(StorageTest);
 
@@ -8,6 +14,8 @@ StorageTest::StorageTest() {
 
 StorageTest::~StorageTest() {
     CryptoKernel::Storage::destroy("./testdb");
+    CryptoKernel::Storage::destroy("./testmigratedb");
+    CryptoKernel::Storage::destroy("testmemorydb");
 }
 
 void StorageTest::setUp() {
@@ -147,3 +155,912 @@ void StorageTest::testIterator() {
 
     CPPUNIT_ASSERT(!it->Valid());
 }
+
+void StorageTest::testBinaryRoundTrip() {
+    Json::Value expected;
+    expected["null"] = Json::Value();
+    expected["bool"] = true;
+    expected["int"] = -123456789;
+    expected["uint"] = Json::Value::UInt64(18446744073709551615ULL);
+    expected["real"] = 3.25;
+    expected["string"] = std::string("with\0nul", 8);
+    expected["array"][0] = "a";
+    expected["array"][1] = 0;
+    expected["emptyArray"] = Json::Value(Json::arrayValue);
+    expected["emptyObject"] = Json::Value(Json::objectValue);
+
+    const std::string encoded = CryptoKernel::Storage::toBinary(expected);
+
+    CPPUNIT_ASSERT_EQUAL(expected, CryptoKernel::Storage::fromBinary(encoded));
+    CPPUNIT_ASSERT(encoded.size() < CryptoKernel::Storage::toString(expected).size());
+
+    CPPUNIT_ASSERT(CryptoKernel::Storage::fromBinary("").isNull());
+    CPPUNIT_ASSERT(CryptoKernel::Storage::fromBinary(encoded.substr(0, encoded.size() - 1)).isNull());
+
+    // An array claiming more elements than there are bytes left
+    std::string oversized = CryptoKernel::Storage::toBinary(expected["array"]);
+    oversized.replace(2, 1, "\xff\xff\xff\xff\x0f");
+    CPPUNIT_ASSERT(CryptoKernel::Storage::fromBinary(oversized).isNull());
+
+    // Values written as json text are read back by either encoding
+    Json::Value options;
+    options["engine"] = "memory";
+    options["valueEncoding"] = "json";
+    CryptoKernel::Storage::Table myTable("myTable");
+    {
+        CryptoKernel::Storage database("testjsonvaluesdb", options);
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+        myTable.put(dbTx.get(), "1", expected["array"]);
+        dbTx->commit();
+    }
+
+    options["valueEncoding"] = "binary";
+    {
+        CryptoKernel::Storage database("testjsonvaluesdb", options);
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+        CPPUNIT_ASSERT_EQUAL(expected["array"], myTable.get(dbTx.get(), "1"));
+    }
+    CryptoKernel::Storage::destroy("testjsonvaluesdb");
+
+    options["valueEncoding"] = "xml";
+    CPPUNIT_ASSERT_THROW(CryptoKernel::Storage("testjsonvaluesdb", options), std::runtime_error);
+}
+
+void StorageTest::testMigration() {
+    Json::Value dataToStore;
+    dataToStore["myval"] = "this";
+    dataToStore["anumber"][0] = 4;
+    dataToStore["anumber"][1] = 5;
+
+    CryptoKernel::Storage::destroy("./testmigratedb");
+
+    {
+        leveldb::DB* db;
+        leveldb::Options options;
+        options.create_if_missing = true;
+        CPPUNIT_ASSERT(leveldb::DB::Open(options, "./testmigratedb", &db).ok());
+        db->Put(leveldb::WriteOptions(), "mydata",
+                CryptoKernel::Storage::toString(dataToStore));
+        db->Put(leveldb::WriteOptions(), "blocks/1/5",
+                CryptoKernel::Storage::toString(Json::Value("ab12")));
+        db->Put(leveldb::WriteOptions(), "myTable/0/a/b",
+                CryptoKernel::Storage::toString(dataToStore));
+        delete db;
+    }
+
+    {
+        CryptoKernel::Storage database("./testmigratedb");
+
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+        CPPUNIT_ASSERT_EQUAL(dataToStore, dbTx->get("mydata"));
+
+        // Legacy text keys are rewritten in the binary key format
+        CryptoKernel::Storage::Table blocks("blocks");
+        CryptoKernel::Storage::Table myTable("myTable");
+        CPPUNIT_ASSERT_EQUAL(Json::Value("ab12"), blocks.get(dbTx.get(), "5", 0));
+        CPPUNIT_ASSERT_EQUAL(dataToStore, myTable.get(dbTx.get(), "a/b"));
+        CPPUNIT_ASSERT(dbTx->get("blocks/1/5").isNull());
+    }
+
+    leveldb::DB* db;
+    CPPUNIT_ASSERT(leveldb::DB::Open(leveldb::Options(), "./testmigratedb", &db).ok());
+    std::string raw;
+    db->Get(leveldb::ReadOptions(), "mydata", &raw);
+    delete db;
+
+    CPPUNIT_ASSERT_EQUAL(CryptoKernel::Storage::toBinary(dataToStore), raw);
+}
+
+void StorageTest::testReadOnlySnapshot() {
+    CryptoKernel::Storage database("./testdb");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    dbTx->put("snapshotdata", Json::Value("before"));
+    dbTx->commit();
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+    CPPUNIT_ASSERT(readTx->isReadOnly());
+
+    // A writer can run while the reader is open
+    dbTx.reset(database.begin());
+    dbTx->put("snapshotdata", Json::Value("after"));
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> readTx2(database.beginReadOnly());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("before"), readTx2->get("snapshotdata"));
+
+    dbTx->commit();
+
+    CPPUNIT_ASSERT_EQUAL(Json::Value("before"), readTx->get("snapshotdata"));
+    CPPUNIT_ASSERT_EQUAL(Json::Value("before"), readTx2->get("snapshotdata"));
+
+    readTx.reset(database.beginReadOnly());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("after"), readTx->get("snapshotdata"));
+
+    CPPUNIT_ASSERT_THROW(readTx->put("snapshotdata", Json::Value()), std::runtime_error);
+    CPPUNIT_ASSERT_THROW(readTx->erase("snapshotdata"), std::runtime_error);
+
+    readTx2.reset();
+
+    // The oldest open reader holds back the oldest snapshot sequence
+    readTx.reset(database.beginReadOnly());
+    const uint64_t readSequence = readTx->getSequence();
+    CPPUNIT_ASSERT_EQUAL(database.getSequence(), readSequence);
+    dbTx.reset(database.begin());
+    dbTx->put("snapshotdata", Json::Value("later"));
+    dbTx->commit();
+    CPPUNIT_ASSERT(database.getSequence() > readSequence);
+    CPPUNIT_ASSERT_EQUAL(readSequence, database.getOldestSnapshot());
+    readTx->abort();
+    CPPUNIT_ASSERT_EQUAL(database.getSequence(), database.getOldestSnapshot());
+}
+
+void StorageTest::testMemoryEngine() {
+    Json::Value options;
+    options["engine"] = "memory";
+
+    CryptoKernel::Storage::Table myTable("myTable");
+
+    Json::Value dataToStore;
+    dataToStore["myval"] = "this";
+
+    {
+        CryptoKernel::Storage database("testmemorydb", options);
+
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+        myTable.put(dbTx.get(), "1", dataToStore);
+        myTable.put(dbTx.get(), "2", Json::Value(2));
+        dbTx->commit();
+    }
+
+    // Reopening the same name within the process sees earlier commits
+    CryptoKernel::Storage database("testmemorydb", options);
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+    CPPUNIT_ASSERT_EQUAL(dataToStore, myTable.get(readTx.get(), "1"));
+
+    std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+            CryptoKernel::Storage::Table::Iterator(&myTable, &database));
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    myTable.erase(dbTx.get(), "1");
+    myTable.put(dbTx.get(), "3", Json::Value(3));
+    dbTx->commit();
+
+    // Open snapshots and iterators do not observe the later commit
+    CPPUNIT_ASSERT_EQUAL(dataToStore, myTable.get(readTx.get(), "1"));
+
+    it->SeekToFirst();
+    CPPUNIT_ASSERT(it->Valid());
+    CPPUNIT_ASSERT_EQUAL(std::string("1"), it->key());
+    it->Next();
+    CPPUNIT_ASSERT(it->Valid());
+    CPPUNIT_ASSERT_EQUAL(std::string("2"), it->key());
+    it->Next();
+    CPPUNIT_ASSERT(!it->Valid());
+
+    readTx.reset(database.beginReadOnly());
+    CPPUNIT_ASSERT(myTable.get(readTx.get(), "1").isNull());
+    CPPUNIT_ASSERT_EQUAL(Json::Value(3), myTable.get(readTx.get(), "3"));
+
+    // The memory database is never written to disk
+    CPPUNIT_ASSERT(!leveldb::Env::Default()->FileExists("testmemorydb"));
+
+    Json::Value badOptions;
+    badOptions["engine"] = "unknown";
+    CPPUNIT_ASSERT_THROW(CryptoKernel::Storage("testbaddb", badOptions), std::runtime_error);
+}
+
+void StorageTest::testSharedCache() {
+    CryptoKernel::Storage database("./testdb");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    dbTx->put("cachedata", Json::Value("first"));
+    dbTx->commit();
+
+    // Committed values are served from the cache by later transactions
+    const Json::Value before = database.getCacheStats();
+    dbTx.reset(database.begin());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("first"), dbTx->get("cachedata"));
+    dbTx->abort();
+
+    Json::Value stats = database.getCacheStats();
+    CPPUNIT_ASSERT_EQUAL(before["hits"].asUInt64() + 1, stats["hits"].asUInt64());
+    CPPUNIT_ASSERT_EQUAL(before["misses"].asUInt64(), stats["misses"].asUInt64());
+
+    // A snapshot taken before a commit never sees the cached new value
+    std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+    dbTx.reset(database.begin());
+    dbTx->put("cachedata", Json::Value("second"));
+    dbTx->erase("cachedata2");
+    dbTx->commit();
+
+    CPPUNIT_ASSERT_EQUAL(Json::Value("first"), readTx->get("cachedata"));
+    readTx.reset(database.beginReadOnly());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("second"), readTx->get("cachedata"));
+    CPPUNIT_ASSERT(readTx->get("cachedata2").isNull());
+    readTx.reset();
+
+    // The cache stays within its memory budget
+    Json::Value options;
+    options["engine"] = "memory";
+    options["cacheSize"] = 0.002;
+    CryptoKernel::Storage small("testmemorydb", options);
+
+    dbTx.reset(small.begin());
+    for(unsigned int i = 0; i < 100; i++) {
+        dbTx->put("cachedata" + std::to_string(i), Json::Value(i));
+    }
+    dbTx->commit();
+
+    stats = small.getCacheStats();
+    CPPUNIT_ASSERT(stats["entries"].asUInt() > 0);
+    CPPUNIT_ASSERT(stats["entries"].asUInt() < 100);
+    CPPUNIT_ASSERT(stats["evictions"].asUInt() > 0);
+    CPPUNIT_ASSERT(stats["bytes"].asUInt64() <= stats["budget"].asUInt64());
+
+    // Evicted values are still read from the database
+    dbTx.reset(small.begin());
+    for(unsigned int i = 0; i < 100; i++) {
+        CPPUNIT_ASSERT_EQUAL(Json::Value(i), dbTx->get("cachedata" + std::to_string(i)));
+    }
+    dbTx.reset();
+}
+
+void StorageTest::testDurability() {
+    Json::Value options;
+    options["durability"] = "group";
+    options["groupCommitInterval"] = 10;
+
+    {
+        CryptoKernel::Storage database("./testdb", options);
+        CPPUNIT_ASSERT_EQUAL(CryptoKernel::Storage::DURABILITY_GROUP, database.getDurability());
+
+        for(unsigned int i = 0; i < 10; i++) {
+            std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+            dbTx->put("durabledata", Json::Value(i));
+            dbTx->commit();
+        }
+
+        // Unsynced commits are still visible to later transactions
+        std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+        CPPUNIT_ASSERT_EQUAL(Json::Value(9u), readTx->get("durabledata"));
+
+        database.setDurability(CryptoKernel::Storage::DURABILITY_NONE);
+        std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+        dbTx->put("durabledata", Json::Value("none"));
+        dbTx->commit();
+
+        CPPUNIT_ASSERT_NO_THROW(database.flush());
+        database.setDurability(CryptoKernel::Storage::DURABILITY_SYNC);
+    }
+
+    // Commits made in every mode survive closing the database
+    CryptoKernel::Storage database("./testdb");
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.beginReadOnly());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("none"), dbTx->get("durabledata"));
+
+    Json::Value badOptions;
+    badOptions["durability"] = "unknown";
+    CPPUNIT_ASSERT_THROW(CryptoKernel::Storage("testbaddb", badOptions), std::runtime_error);
+}
+
+void StorageTest::testKeyEncoding() {
+    CryptoKernel::Storage database("./testdb");
+    CryptoKernel::Storage::Table myTable("keyTable");
+    CryptoKernel::Storage::Table blocks("blocks");
+
+    // Hex ids are packed into half their length and heights into 8 bytes
+    const std::string id(64, 'f');
+    CPPUNIT_ASSERT_EQUAL(size_t(36), blocks.getKey(id).size());
+    CPPUNIT_ASSERT_EQUAL(size_t(11), blocks.getKey("123456", 0).size());
+
+    const std::vector<std::string> keys = {"9", "10", "100", "0", "18446744073709551616",
+                                           "1f", "abc", "0abc", id, "Ab+/=", ""
+                                          };
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    for(const std::string& key : keys) {
+        myTable.put(dbTx.get(), key, Json::Value(key));
+    }
+    dbTx->commit();
+
+    dbTx.reset(database.beginReadOnly());
+    std::set<std::string> found;
+    std::vector<std::string> numbers;
+    std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+            CryptoKernel::Storage::Table::Iterator(&myTable, &database));
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        CPPUNIT_ASSERT_EQUAL(Json::Value(it->key()), it->value());
+        CPPUNIT_ASSERT_EQUAL(Json::Value(it->key()), myTable.get(dbTx.get(), it->key()));
+        found.insert(it->key());
+        if(numbers.size() < 4) {
+            numbers.push_back(it->key());
+        }
+    }
+
+    // Every key round trips and integers sort numerically
+    CPPUNIT_ASSERT_EQUAL(keys.size(), found.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("0"), numbers[0]);
+    CPPUNIT_ASSERT_EQUAL(std::string("9"), numbers[1]);
+    CPPUNIT_ASSERT_EQUAL(std::string("10"), numbers[2]);
+    CPPUNIT_ASSERT_EQUAL(std::string("100"), numbers[3]);
+
+    CPPUNIT_ASSERT_THROW(CryptoKernel::Storage::Table("badTable", 1), std::runtime_error);
+    CPPUNIT_ASSERT_NO_THROW(CryptoKernel::Storage::Table("goodTable", 16));
+    CPPUNIT_ASSERT_THROW(myTable.getKey("1", 255), std::runtime_error);
+}
+
+void StorageTest::testRangeIterator() {
+    CryptoKernel::Storage database("./testdb");
+    CryptoKernel::Storage::Table rangeTable("rangeTable");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    for(int i = 1; i <= 20; i++) {
+        rangeTable.put(dbTx.get(), std::to_string(i), Json::Value(i));
+    }
+    rangeTable.put(dbTx.get(), "1", Json::Value("other index"), 0);
+    dbTx->commit();
+
+    // Uncommitted writes of the transaction are visible to its iterators
+    dbTx.reset(database.begin());
+    rangeTable.put(dbTx.get(), "21", Json::Value(21));
+    rangeTable.put(dbTx.get(), "7", Json::Value(70));
+    rangeTable.erase(dbTx.get(), "5");
+
+    std::unique_ptr<CryptoKernel::Storage::Table::Iterator> it(new
+            CryptoKernel::Storage::Table::Iterator(&rangeTable, dbTx.get()));
+
+    std::vector<std::string> keys;
+    for(it->SeekToFirst(); it->Valid(); it->Next()) {
+        keys.push_back(it->key());
+    }
+    CPPUNIT_ASSERT_EQUAL(size_t(20), keys.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("1"), keys.front());
+    CPPUNIT_ASSERT_EQUAL(std::string("4"), keys[3]);
+    CPPUNIT_ASSERT_EQUAL(std::string("6"), keys[4]);
+    CPPUNIT_ASSERT_EQUAL(std::string("21"), keys.back());
+
+    it->Seek("7");
+    CPPUNIT_ASSERT(it->Valid());
+    CPPUNIT_ASSERT_EQUAL(Json::Value(70), it->value());
+
+    // Reverse iteration within bounds
+    it->setLowerBound("3");
+    it->setUpperBound("9");
+    keys.clear();
+    for(it->SeekToLast(); it->Valid(); it->Prev()) {
+        keys.push_back(it->key());
+    }
+    const std::vector<std::string> expected = {"8", "7", "6", "4", "3"};
+    CPPUNIT_ASSERT(expected == keys);
+
+    // Changing direction in the middle of a range
+    it->Seek("6");
+    it->Prev();
+    CPPUNIT_ASSERT_EQUAL(std::string("4"), it->key());
+    it->Next();
+    CPPUNIT_ASSERT_EQUAL(std::string("6"), it->key());
+    it->Next();
+    it->Next();
+    CPPUNIT_ASSERT_EQUAL(std::string("8"), it->key());
+    it->Next();
+    CPPUNIT_ASSERT(!it->Valid());
+
+    // Other indexes are iterated separately
+    it.reset(new CryptoKernel::Storage::Table::Iterator(&rangeTable, dbTx.get(), 0));
+    it->SeekToFirst();
+    CPPUNIT_ASSERT(it->Valid());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("other index"), it->value());
+    it->Next();
+    CPPUNIT_ASSERT(!it->Valid());
+    it.reset();
+    dbTx->abort();
+
+    // Read-only iterators do not see later commits
+    std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+    it.reset(new CryptoKernel::Storage::Table::Iterator(&rangeTable, readTx.get()));
+
+    dbTx.reset(database.begin());
+    rangeTable.erase(dbTx.get(), "20");
+    dbTx->commit();
+
+    it->SeekToLast();
+    CPPUNIT_ASSERT_EQUAL(std::string("20"), it->key());
+    CPPUNIT_ASSERT_EQUAL(Json::Value(20), it->value());
+}
+
+void StorageTest::testStats() {
+    Json::Value options;
+    options["engine"] = "memory";
+    CryptoKernel::Storage::destroy("teststatsdb");
+    CryptoKernel::Storage database("teststatsdb", options);
+    CryptoKernel::Storage::Table utxos("utxos");
+    CryptoKernel::Storage::Table named("statsTable");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    utxos.put(dbTx.get(), "a", Json::Value("first"));
+    utxos.put(dbTx.get(), "b", Json::Value("second"));
+    named.put(dbTx.get(), "c", Json::Value(3));
+    dbTx->commit();
+
+    dbTx.reset(database.begin());
+    utxos.erase(dbTx.get(), "b");
+    dbTx->commit();
+
+    // Each read is a hit when staged or cached, a miss when read from the
+    // engine
+    Json::Value cacheOff;
+    cacheOff["engine"] = "memory";
+    cacheOff["cacheSize"] = 0;
+    CryptoKernel::Storage uncached("teststatsdb", cacheOff);
+    dbTx.reset(uncached.begin());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("first"), utxos.get(dbTx.get(), "a"));
+    utxos.put(dbTx.get(), "d", Json::Value("staged"));
+    CPPUNIT_ASSERT_EQUAL(Json::Value("staged"), utxos.get(dbTx.get(), "d"));
+    dbTx->abort();
+
+    CryptoKernel::Storage::Table::Iterator it(&named, &uncached);
+    for(it.SeekToFirst(); it.Valid(); it.Next()) {
+        CPPUNIT_ASSERT_EQUAL(Json::Value(3), it.value());
+    }
+
+    Json::Value stats = database.getStats();
+    CPPUNIT_ASSERT_EQUAL(Json::Value(2u), stats["tables"]["utxos"]["puts"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(1u), stats["tables"]["utxos"]["erases"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(1u), stats["tables"]["statsTable"]["puts"]);
+    CPPUNIT_ASSERT(stats["tables"]["utxos"]["bytesWritten"].asUInt64() > 0);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(2u), stats["commitLatency"]["count"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(2u), stats["lockWait"]["count"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(4u), stats["commitKeys"]["sum"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(3u), stats["commitKeys"]["max"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value("memory"), stats["engine"]["engine"]);
+    CPPUNIT_ASSERT(stats["cache"].isObject());
+
+    stats = uncached.getStats();
+    CPPUNIT_ASSERT_EQUAL(Json::Value(2u), stats["tables"]["utxos"]["gets"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(1u), stats["tables"]["utxos"]["hits"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(1u), stats["tables"]["utxos"]["misses"]);
+    CPPUNIT_ASSERT(stats["tables"]["utxos"]["bytesRead"].asUInt64() > 0);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(0u), stats["tables"]["utxos"]["puts"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(1u), stats["tables"]["statsTable"]["scans"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(0u), stats["commitLatency"]["count"]);
+
+    CryptoKernel::Storage::destroy("teststatsdb");
+}
+
+void StorageTest::testWriteSetSpill() {
+    Json::Value options;
+    options["engine"] = "memory";
+    options["writeSetSize"] = 0.001;
+    CryptoKernel::Storage::destroy("testwritesetdb");
+    CryptoKernel::Storage database("testwritesetdb", options);
+    CryptoKernel::Storage::Table table("writeSetTable");
+
+    // Staged writes stay readable after they are spilled
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    for(unsigned int i = 0; i < 200; i++) {
+        table.put(dbTx.get(), std::to_string(i), Json::Value(i));
+    }
+    table.put(dbTx.get(), "5", Json::Value("overwritten"));
+    table.erase(dbTx.get(), "7");
+
+    CPPUNIT_ASSERT_EQUAL(Json::Value(0u), table.get(dbTx.get(), "0"));
+    CPPUNIT_ASSERT_EQUAL(Json::Value(199u), table.get(dbTx.get(), "199"));
+    CPPUNIT_ASSERT_EQUAL(Json::Value("overwritten"), table.get(dbTx.get(), "5"));
+    CPPUNIT_ASSERT(table.get(dbTx.get(), "7").isNull());
+
+    unsigned int count = 0;
+    std::string last;
+    CryptoKernel::Storage::Table::Iterator it(&table, dbTx.get());
+    for(it.SeekToFirst(); it.Valid(); it.Next()) {
+        if(count > 0) {
+            CPPUNIT_ASSERT(std::stoul(last) < std::stoul(it.key()));
+        }
+        last = it.key();
+        if(it.key() != "5") {
+            CPPUNIT_ASSERT_EQUAL(Json::Value(std::stoul(it.key())), Json::Value(it.value().asUInt64()));
+        }
+        count++;
+    }
+    CPPUNIT_ASSERT_EQUAL(199u, count);
+
+    dbTx->commit();
+
+    CPPUNIT_ASSERT(database.getStats()["writeSetSpills"].asUInt64() > 0);
+
+    dbTx.reset(database.begin());
+    CPPUNIT_ASSERT_EQUAL(Json::Value(42u), table.get(dbTx.get(), "42"));
+    CPPUNIT_ASSERT_EQUAL(Json::Value("overwritten"), table.get(dbTx.get(), "5"));
+    CPPUNIT_ASSERT(table.get(dbTx.get(), "7").isNull());
+    dbTx->abort();
+    dbTx.reset();
+
+    CryptoKernel::Storage::destroy("testwritesetdb");
+}
+
+void StorageTest::testSavepoints() {
+    Json::Value options;
+    options["engine"] = "memory";
+    CryptoKernel::Storage::destroy("testsavepointdb");
+    CryptoKernel::Storage database("testsavepointdb", options);
+    CryptoKernel::Storage::Table table("savepointTable");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    table.put(dbTx.get(), "kept", Json::Value("first"));
+    table.put(dbTx.get(), "changed", Json::Value("first"));
+
+    const unsigned int outer = dbTx->savepoint();
+    table.put(dbTx.get(), "changed", Json::Value("second"));
+    table.put(dbTx.get(), "added", Json::Value("second"));
+
+    const unsigned int inner = dbTx->savepoint();
+    table.erase(dbTx.get(), "kept");
+    table.put(dbTx.get(), "changed", Json::Value("third"));
+
+    // Rolling back the inner savepoint keeps the outer writes
+    dbTx->rollbackTo(inner);
+    CPPUNIT_ASSERT_EQUAL(Json::Value("first"), table.get(dbTx.get(), "kept"));
+    CPPUNIT_ASSERT_EQUAL(Json::Value("second"), table.get(dbTx.get(), "changed"));
+    CPPUNIT_ASSERT_EQUAL(Json::Value("second"), table.get(dbTx.get(), "added"));
+
+    // Rolling back the outer savepoint undoes both levels
+    table.put(dbTx.get(), "changed", Json::Value("third"));
+    dbTx->rollbackTo(outer);
+    CPPUNIT_ASSERT_EQUAL(Json::Value("first"), table.get(dbTx.get(), "changed"));
+    CPPUNIT_ASSERT(table.get(dbTx.get(), "added").isNull());
+    CPPUNIT_ASSERT_THROW(dbTx->rollbackTo(inner), std::runtime_error);
+
+    std::vector<std::string> keys;
+    CryptoKernel::Storage::Table::Iterator it(&table, dbTx.get());
+    for(it.SeekToFirst(); it.Valid(); it.Next()) {
+        keys.push_back(it.key());
+    }
+    CPPUNIT_ASSERT_EQUAL(size_t(2), keys.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("changed"), keys[0]);
+    CPPUNIT_ASSERT_EQUAL(std::string("kept"), keys[1]);
+
+    // Released writes are committed
+    table.put(dbTx.get(), "released", Json::Value("fourth"));
+    dbTx->release(outer);
+    CPPUNIT_ASSERT_THROW(dbTx->release(outer), std::runtime_error);
+    dbTx->commit();
+
+    dbTx.reset(database.begin());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("first"), table.get(dbTx.get(), "kept"));
+    CPPUNIT_ASSERT_EQUAL(Json::Value("first"), table.get(dbTx.get(), "changed"));
+    CPPUNIT_ASSERT(table.get(dbTx.get(), "added").isNull());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("fourth"), table.get(dbTx.get(), "released"));
+    dbTx->abort();
+    dbTx.reset();
+
+    CryptoKernel::Storage::destroy("testsavepointdb");
+}
+
+void StorageTest::testCheckpoint() {
+    Json::Value options;
+    options["engine"] = "memory";
+    CryptoKernel::Storage::destroy("testcheckpointsource");
+    CryptoKernel::Storage::destroy("./testcheckpointdb");
+    CryptoKernel::Storage database("testcheckpointsource", options);
+    CryptoKernel::Storage::Table table("checkpointTable");
+
+    // Enough data for several batches
+    const std::string padding(100 * 1024, 'x');
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    for(unsigned int i = 0; i < 100; i++) {
+        table.put(dbTx.get(), std::to_string(i), Json::Value(padding));
+    }
+    table.put(dbTx.get(), "before", Json::Value(true));
+    dbTx->commit();
+
+    // Commits made while the checkpoint is written are not part of it
+    unsigned int calls = 0;
+    const Json::Value result = database.checkpoint("./testcheckpointdb",
+    [&](const uint64_t keys, const uint64_t bytes) {
+        if(calls++ == 0) {
+            std::unique_ptr<CryptoKernel::Storage::Transaction> writeTx(database.begin());
+            table.put(writeTx.get(), "after", Json::Value(true));
+            writeTx->commit();
+        }
+        return true;
+    });
+    CPPUNIT_ASSERT(calls > 1);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(102u), result["keys"]);
+    CPPUNIT_ASSERT(result["bytes"].asUInt64() > 100 * padding.size());
+
+    {
+        CryptoKernel::Storage copy("./testcheckpointdb");
+        dbTx.reset(copy.begin());
+        CPPUNIT_ASSERT_EQUAL(Json::Value(padding), table.get(dbTx.get(), "99"));
+        CPPUNIT_ASSERT_EQUAL(Json::Value(true), table.get(dbTx.get(), "before"));
+        CPPUNIT_ASSERT(table.get(dbTx.get(), "after").isNull());
+        dbTx.reset();
+    }
+
+    // A checkpoint never overwrites an existing directory
+    CPPUNIT_ASSERT_THROW(database.checkpoint("./testcheckpointdb"), std::runtime_error);
+    CryptoKernel::Storage::destroy("./testcheckpointdb");
+
+    // A cancelled checkpoint leaves nothing behind
+    CPPUNIT_ASSERT_THROW(database.checkpoint("./testcheckpointdb",
+    [](const uint64_t keys, const uint64_t bytes) {
+        return false;
+    }), std::runtime_error);
+    CPPUNIT_ASSERT(!leveldb::Env::Default()->FileExists("./testcheckpointdb"));
+
+    CryptoKernel::Storage::destroy("testcheckpointsource");
+}
+
+static Json::Value waitForCompactions(CryptoKernel::Storage& database,
+                                      const unsigned int completed) {
+    Json::Value status;
+    for(unsigned int i = 0; i < 500; i++) {
+        status = database.getCompactionStatus();
+        if(status["completed"].asUInt() >= completed && !status["running"].asBool()
+           && status["queued"].empty()) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    return status;
+}
+
+void StorageTest::testCompaction() {
+    Json::Value options;
+    options["engine"] = "memory";
+    options["compactionRate"] = 0;
+    options["compactionThreshold"] = 0;
+    CryptoKernel::Storage::destroy("testcompactiondb");
+    CryptoKernel::Storage database("testcompactiondb", options);
+    CryptoKernel::Storage::Table table("compactionTable");
+
+    // Large tables are compacted a slice at a time
+    const std::string padding(1024 * 1024, 'x');
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    for(unsigned int i = 0; i < 40; i++) {
+        table.put(dbTx.get(), std::to_string(i), Json::Value(padding));
+    }
+    dbTx->commit();
+
+    database.compact({"compactionTable"});
+    Json::Value status = waitForCompactions(database, 1);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(1u), status["completed"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value("compactionTable"), status["last"]["table"]);
+    CPPUNIT_ASSERT(status["last"]["slices"].asUInt64() > 1);
+    CPPUNIT_ASSERT(status["last"]["bytes"].asUInt64() >= 40 * padding.size());
+    CPPUNIT_ASSERT_EQUAL(1.0, status["progress"].asDouble());
+
+    // Versions kept for a snapshot outlive it until their keys are
+    // compacted
+    std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+    dbTx.reset(database.begin());
+    for(unsigned int i = 0; i < 40; i++) {
+        if(i < 10) {
+            table.erase(dbTx.get(), std::to_string(i));
+        } else {
+            table.put(dbTx.get(), std::to_string(i), Json::Value(i));
+        }
+    }
+    dbTx->commit();
+    readTx.reset();
+    CPPUNIT_ASSERT(database.getStats()["engine"]["versions"].asUInt64() > 41);
+
+    database.compact();
+    status = waitForCompactions(database, 2);
+    CPPUNIT_ASSERT_EQUAL(Json::Value("database"), status["last"]["table"]);
+    const Json::Value engine = database.getStats()["engine"];
+    CPPUNIT_ASSERT_EQUAL(Json::Value(31u), engine["keys"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(31u), engine["versions"]);
+
+    dbTx.reset(database.beginReadOnly());
+    CPPUNIT_ASSERT(table.get(dbTx.get(), "5").isNull());
+    CPPUNIT_ASSERT_EQUAL(Json::Value(25u), table.get(dbTx.get(), "25"));
+    dbTx.reset();
+
+    // Tables written past the threshold are compacted once the database
+    // is idle
+    options["compactionThreshold"] = 0.01;
+    options["compactionIdle"] = 0;
+    CryptoKernel::Storage::destroy("testautocompactiondb");
+    CryptoKernel::Storage automatic("testautocompactiondb", options);
+    CryptoKernel::Storage::Table utxos("utxos");
+    dbTx.reset(automatic.begin());
+    utxos.put(dbTx.get(), "small", Json::Value(true));
+    dbTx->commit();
+    CPPUNIT_ASSERT_EQUAL(Json::Value(0u), automatic.getCompactionStatus()["completed"]);
+
+    dbTx.reset(automatic.begin());
+    for(unsigned int i = 0; i < 20; i++) {
+        utxos.put(dbTx.get(), std::to_string(i), Json::Value(std::string(1024, 'x')));
+    }
+    dbTx->commit();
+    dbTx.reset();
+
+    status = waitForCompactions(automatic, 1);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(1u), status["completed"]);
+    CPPUNIT_ASSERT_EQUAL(Json::Value("utxos"), status["last"]["table"]);
+    CPPUNIT_ASSERT(!status["pending"].isMember("utxos"));
+
+    CryptoKernel::Storage::destroy("testcompactiondb");
+    CryptoKernel::Storage::destroy("testautocompactiondb");
+}
+
+void StorageTest::testGetMany() {
+    Json::Value options;
+    options["engine"] = "memory";
+    options["readThreads"] = 4;
+    CryptoKernel::Storage::destroy("testgetmanydb");
+    CryptoKernel::Storage database("testgetmanydb", options);
+    CryptoKernel::Storage::Table table("getManyTable");
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    for(unsigned int i = 0; i < 100; i++) {
+        table.put(dbTx.get(), std::to_string(i), Json::Value(i));
+    }
+    dbTx->commit();
+
+    // Staged writes, cached values, engine reads and missing keys are
+    // returned in the order asked for
+    std::vector<std::string> keys;
+    for(unsigned int i = 0; i < 120; i++) {
+        keys.push_back(std::to_string(i));
+    }
+    dbTx.reset(database.begin());
+    table.put(dbTx.get(), "7", Json::Value("staged"));
+    table.erase(dbTx.get(), "8");
+    const std::vector<Json::Value> values = table.getMany(dbTx.get(), keys);
+    CPPUNIT_ASSERT_EQUAL(keys.size(), values.size());
+    CPPUNIT_ASSERT_EQUAL(Json::Value("staged"), values[7]);
+    CPPUNIT_ASSERT(values[8].isNull());
+    for(unsigned int i = 0; i < 120; i++) {
+        if(i != 7 && i != 8) {
+            CPPUNIT_ASSERT_EQUAL(i < 100, values[i].isNumeric());
+            CPPUNIT_ASSERT_EQUAL(i < 100 ? i : 0, values[i].asUInt());
+        }
+    }
+    dbTx->abort();
+
+    // A snapshot never sees commits made after it began
+    CryptoKernel::Storage::destroy("testgetmanydb");
+    CryptoKernel::Storage cold("testgetmanydb", options);
+    dbTx.reset(cold.begin());
+    for(unsigned int i = 0; i < 100; i++) {
+        table.put(dbTx.get(), std::to_string(i), Json::Value(i));
+    }
+    dbTx->commit();
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(cold.beginReadOnly());
+    dbTx.reset(cold.begin());
+    table.put(dbTx.get(), "50", Json::Value("after"));
+    dbTx->commit();
+    CPPUNIT_ASSERT_EQUAL(50u, table.getMany(readTx.get(), keys)[50].asUInt());
+    readTx.reset();
+
+    // Prefetched keys are served from the cache
+    readTx.reset(cold.beginReadOnly());
+    table.prefetch(readTx.get(), keys);
+    const uint64_t hits = cold.getCacheStats()["hits"].asUInt64();
+    CPPUNIT_ASSERT_EQUAL(Json::Value("after"), table.get(readTx.get(), "50"));
+    CPPUNIT_ASSERT_EQUAL(99u, table.get(readTx.get(), "99").asUInt());
+    CPPUNIT_ASSERT_EQUAL(hits + 2, cold.getCacheStats()["hits"].asUInt64());
+    readTx.reset();
+
+    CryptoKernel::Storage::destroy("testgetmanydb");
+}
+
+void StorageTest::testFilter() {
+    // Filters grow past the keys they were sized for without missing keys
+    // or exceeding their false positive rate
+    CryptoKernel::Storage::Filter filter(100, 0.01, 0);
+    for(unsigned int i = 0; i < 1000; i++) {
+        filter.insert("key" + std::to_string(i));
+    }
+    for(unsigned int i = 0; i < 1000; i++) {
+        CPPUNIT_ASSERT(filter.mayContain("key" + std::to_string(i)));
+    }
+    unsigned int falsePositives = 0;
+    for(unsigned int i = 0; i < 10000; i++) {
+        if(filter.mayContain("missing" + std::to_string(i))) {
+            falsePositives++;
+        }
+    }
+    CPPUNIT_ASSERT(falsePositives < 200);
+    const Json::Value filterStats = filter.getStats();
+    // Keys that already test positive are not inserted again
+    CPPUNIT_ASSERT(filterStats["keys"].asUInt() <= 1000 && filterStats["keys"].asUInt() > 950);
+    CPPUNIT_ASSERT(filterStats["layers"].asUInt() > 1);
+    CPPUNIT_ASSERT(filterStats["falsePositiveRate"].asDouble() < 0.02);
+
+    Json::Value options;
+    options["engine"] = "memory";
+    CryptoKernel::Storage::destroy("testfilterdb");
+    CryptoKernel::Storage database("testfilterdb", options);
+    CryptoKernel::Storage::Table utxos("utxos");
+    CryptoKernel::Storage::Table named("filterTable");
+    CPPUNIT_ASSERT_THROW(database.enableFilter(named), std::runtime_error);
+
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    for(unsigned int i = 0; i < 1000; i++) {
+        utxos.put(dbTx.get(), std::to_string(i), Json::Value(true));
+    }
+    dbTx->commit();
+
+    // Snapshots older than the filter do not use it
+    std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+    database.enableFilter(utxos);
+    CPPUNIT_ASSERT(utxos.get(readTx.get(), "missing").isNull());
+    CPPUNIT_ASSERT_EQUAL(Json::Value(0u), database.getStats()["filters"]["utxos"]["lookups"]);
+    readTx.reset();
+
+    dbTx.reset(database.begin());
+    utxos.put(dbTx.get(), "added", Json::Value(true));
+    utxos.erase(dbTx.get(), "0");
+    dbTx->commit();
+
+    readTx.reset(database.beginReadOnly());
+    CPPUNIT_ASSERT_EQUAL(Json::Value(true), utxos.get(readTx.get(), "added"));
+    CPPUNIT_ASSERT(utxos.get(readTx.get(), "0").isNull());
+    std::vector<std::string> keys;
+    for(unsigned int i = 0; i < 1000; i++) {
+        keys.push_back(std::to_string(i));
+        keys.push_back("missing" + std::to_string(i));
+    }
+    const std::vector<Json::Value> values = utxos.getMany(readTx.get(), keys);
+    for(unsigned int i = 1; i < 1000; i++) {
+        CPPUNIT_ASSERT_EQUAL(Json::Value(true), values[i * 2]);
+        CPPUNIT_ASSERT(values[i * 2 + 1].isNull());
+    }
+    readTx.reset();
+
+    const Json::Value stats = database.getStats()["filters"]["utxos"];
+    CPPUNIT_ASSERT(stats["keys"].asUInt() <= 1001 && stats["keys"].asUInt() > 950);
+    CPPUNIT_ASSERT_EQUAL(Json::Value(1u), stats["erases"]);
+    CPPUNIT_ASSERT(stats["negatives"].asUInt64() > 950);
+    CPPUNIT_ASSERT(stats["falsePositives"].asUInt64() < 50);
+
+    CryptoKernel::Storage::destroy("testfilterdb");
+}
+
+void StorageTest::testGetShared() {
+    Json::Value options;
+    options["engine"] = "memory";
+    CryptoKernel::Storage::destroy("testgetshareddb");
+    CryptoKernel::Storage database("testgetshareddb", options);
+    CryptoKernel::Storage::Table table("getSharedTable");
+
+    Json::Value block;
+    block["height"] = 1;
+    block["data"] = std::string(4096, 'x');
+
+    // Staged values are shared with the write set
+    std::unique_ptr<CryptoKernel::Storage::Transaction> dbTx(database.begin());
+    table.put(dbTx.get(), "block", block);
+    const auto staged = table.getShared(dbTx.get(), "block");
+    CPPUNIT_ASSERT_EQUAL(block, *staged);
+    CPPUNIT_ASSERT(staged == table.getShared(dbTx.get(), "block"));
+
+    const auto missing = table.getShared(dbTx.get(), "missing");
+    CPPUNIT_ASSERT(missing != nullptr);
+    CPPUNIT_ASSERT(missing->isNull());
+    dbTx->commit();
+
+    // Committed values are shared with the cache by every reader
+    std::unique_ptr<CryptoKernel::Storage::Transaction> readTx(database.beginReadOnly());
+    const auto cached = table.getShared(readTx.get(), "block");
+    CPPUNIT_ASSERT(cached == staged);
+    readTx.reset();
+
+    // Values stay valid and unchanged after the key is written again
+    dbTx.reset(database.begin());
+    table.put(dbTx.get(), "block", Json::Value(2));
+    dbTx->commit();
+    dbTx.reset();
+    CPPUNIT_ASSERT_EQUAL(block, *cached);
+
+    readTx.reset(database.beginReadOnly());
+    CPPUNIT_ASSERT_EQUAL(Json::Value(2), *table.getShared(readTx.get(), "block"));
+    readTx.reset();
+
+    CryptoKernel::Storage::destroy("testgetshareddb");
+}
@@ -15,6 +15,22 @@ class StorageTest : public CPPUNIT_NS::TestFixture {
     CPPUNIT_TEST(testToJson);
     CPPUNIT_TEST(testToString);
     CPPUNIT_TEST(testIterator);
+    CPPUNIT_TEST(testBinaryRoundTrip);
+    CPPUNIT_TEST(testMigration);
+    CPPUNIT_TEST(testReadOnlySnapshot);
+    CPPUNIT_TEST(testMemoryEngine);
+    CPPUNIT_TEST(testSharedCache);
+    CPPUNIT_TEST(testDurability);
+    CPPUNIT_TEST(testKeyEncoding);
+    CPPUNIT_TEST(testRangeIterator);
+    CPPUNIT_TEST(testStats);
+    CPPUNIT_TEST(testWriteSetSpill);
+    CPPUNIT_TEST(testSavepoints);
+    CPPUNIT_TEST(testCheckpoint);
+    CPPUNIT_TEST(testCompaction);
+    CPPUNIT_TEST(testGetMany);
+    CPPUNIT_TEST(testFilter);
+    CPPUNIT_TEST(testGetShared);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -32,6 +48,22 @@ private:
     void testToJson();
     void testToString();
     void testIterator();
+    void testBinaryRoundTrip();
+    void testMigration();
+    void testReadOnlySnapshot();
+    void testMemoryEngine();
+    void testSharedCache();
+    void testDurability();
+    void testKeyEncoding();
+    void testRangeIterator();
+    void testStats();
+    void testWriteSetSpill();
+    void testSavepoints();
+    void testCheckpoint();
+    void testCompaction();
+    void testGetMany();
+    void testFilter();
+    void testGetShared();
 };
 
 #endif